@@ -232,6 +232,8 @@ public:
                              sizeof( ZERO_REF ) ) != 0 );
   }
 
+  void set_has_nonzero( const bool has_nonzero ) { has_nonzero_ = has_nonzero; }
+
   void zero_out()
   {
     has_nonzero_ = false;
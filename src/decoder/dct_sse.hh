@@ -5,6 +5,7 @@
 
 extern "C" {
   void vp8_short_fdct4x4_sse2( short *input, short *output, int pitch );
+  void vp8_short_fdct8x4_sse2( short *input, short *output, int pitch );
   void vp8_short_walsh4x4_sse2( short *input, short *output, int pitch );
   void vp8_short_inv_walsh4x4_sse2( const short *input, short *output );
 
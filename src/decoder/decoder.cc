@@ -168,6 +168,12 @@ References::References( MutableRasterHandle && raster )
     alternative( last )
 {}
 
+References::References( const RasterHandle & raster )
+  : last( raster ),
+    golden( last ),
+    alternative( last )
+{}
+
 References::References(EncoderStateDeserializer &idata, const uint16_t width, const uint16_t height)
   : last( move( idata.get_ref( EncoderSerDesTag::REF_LAST, width, height ) ) )
   , golden( last )
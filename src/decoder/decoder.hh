@@ -128,6 +128,8 @@ struct References
 
   References( MutableRasterHandle && raster );
 
+  References( const RasterHandle & raster );
+
   References(EncoderStateDeserializer &idata, const uint16_t width, const uint16_t height);
 
   const VP8Raster & at( const reference_frame reference_id ) const
@@ -30,15 +30,22 @@
 
 #pragma once
 #include <algorithm>
+#include <array>
+#include <climits>
 #include <cstdio>
-#include <fstream>
-#include <iterator>
+#include <cstring>
 #include <string>
 #include <utility>
 #include <vector>
 
+#include <fcntl.h>
+#include <sys/uio.h>
+
+#include "exception.hh"
 #include "file.hh"
 #include "file_descriptor.hh"
+#include "plane_packing.hh"
+#include "raster_handle.hh"
 
 enum class EncoderSerDesTag : uint8_t
   { PROB_TABLE
@@ -53,14 +60,65 @@ enum class EncoderSerDesTag : uint8_t
   , REF_GOLD
   , REF_ALT
   , DECODER
+  , REF_DELTA   // only in a StateStore
+  };
+
+// every state file starts with these, except for the ones written before
+// there was a header at all (which are read as version 0). Since version 2,
+// they're followed by how the raster planes are stored.
+static constexpr char ENCODER_STATE_MAGIC[] = { 'X', 'C', 'S', 'T' };
+static constexpr uint16_t ENCODER_STATE_VERSION = 2;
+static constexpr size_t ENCODER_STATE_HEADER_SIZE = sizeof(ENCODER_STATE_MAGIC) + sizeof(uint16_t) + 1;
+
+enum class EncoderStatePlanes : uint8_t
+  { RAW
+  , PACKED      // see plane_packing.hh
   };
 
 class EncoderStateSerializer {
   private:
+    EncoderStatePlanes planes_;
     std::vector<uint8_t> data_ = {};
 
+    // rasters aren't copied into data_: each one is written out from its own
+    // planes, at the given offset of data_
+    std::vector<std::pair<size_t, RasterHandle>> rasters_ = {};
+
+    static uint32_t raster_length(const VP8Raster &ref) {
+      return ref.width() * ref.height() + 2 * (ref.width() / 2) * (ref.height() / 2);
+    }
+
+    // the header, and then data_ with the planes of the rasters in between
+    std::vector<iovec> segments(const std::array<uint8_t, ENCODER_STATE_HEADER_SIZE> &header) const {
+      std::vector<iovec> ret;
+      ret.reserve(2 + 4 * rasters_.size());
+      ret.push_back({const_cast<uint8_t *>(header.data()), header.size()});
+
+      size_t offset = 0;
+      for (const auto &raster : rasters_) {
+        ret.push_back({const_cast<uint8_t *>(data_.data() + offset), raster.first - offset});
+        for (const TwoD<uint8_t> *plane : {&raster.second.get().Y(), &raster.second.get().U(), &raster.second.get().V()}) {
+          ret.push_back({const_cast<uint8_t *>(&plane->at(0, 0)), plane->width() * plane->height()});
+        }
+        offset = raster.first;
+      }
+      ret.push_back({const_cast<uint8_t *>(data_.data() + offset), data_.size() - offset});
+
+      return ret;
+    }
+
+    std::array<uint8_t, ENCODER_STATE_HEADER_SIZE> header(void) const {
+      std::array<uint8_t, ENCODER_STATE_HEADER_SIZE> ret;
+      std::memcpy(ret.data(), ENCODER_STATE_MAGIC, sizeof(ENCODER_STATE_MAGIC));
+      ret[sizeof(ENCODER_STATE_MAGIC)] = ENCODER_STATE_VERSION & 0xff;
+      ret[sizeof(ENCODER_STATE_MAGIC) + 1] = ENCODER_STATE_VERSION >> 8;
+      ret[sizeof(ENCODER_STATE_MAGIC) + 2] = (uint8_t) planes_;
+      return ret;
+    }
+
   public:
-    EncoderStateSerializer() {}
+    EncoderStateSerializer(const EncoderStatePlanes planes = EncoderStatePlanes::RAW)
+      : planes_(planes) {}
 
     void reserve(size_t n) {
       data_.reserve(data_.size() + n);
@@ -89,61 +147,156 @@ class EncoderStateSerializer {
       return offset;
     }
 
+    size_t put_bytes(const uint8_t *bytes, const size_t len) {
+      size_t posn = data_.size();
+      data_.insert(data_.end(), bytes, bytes + len);
+      return posn;
+    }
+
+    // copies (or packs) the planes, a whole plane at a time
     size_t put(const VP8Raster &ref, EncoderSerDesTag t) {
-      unsigned width = ref.width();
-      unsigned height = ref.height();
-      uint32_t len = width * height + 2 * (width / 2) * (height / 2);
+      uint32_t len = raster_length(ref);
       this->reserve(5 + len);
       this->put(t);
-      this->put(len);
+      size_t placeholder = this->put(len);
+
+      for (const TwoD<uint8_t> *plane : {&ref.Y(), &ref.U(), &ref.V()}) {
+        if (planes_ == EncoderStatePlanes::PACKED) {
+          pack_plane(*plane, data_);
+        } else {
+          const uint8_t *pixels = &plane->at(0, 0);
+          data_.insert(data_.end(), pixels, pixels + plane->width() * plane->height());
+        }
+      }
+
+      len = data_.size() - placeholder - 4;
+      this->put(len, placeholder);
+
+      return len + 5;
+    }
+
+    // doesn't copy anything: the raster is immutable, so it's enough to hold on
+    // to it until it's written
+    size_t put(const RasterHandle &ref, EncoderSerDesTag t) {
+      if (planes_ == EncoderStatePlanes::PACKED) {
+        return this->put(ref.get(), t);
+      }
 
-      ref.Y().forall([this](uint8_t &f){ this->put(f); });
-      ref.U().forall([this](uint8_t &f){ this->put(f); });
-      ref.V().forall([this](uint8_t &f){ this->put(f); });
+      uint32_t len = raster_length(ref.get());
+      this->reserve(5);
+      this->put(t);
+      this->put(len);
+      rasters_.emplace_back(data_.size(), ref);
 
       return len + 5;
     }
 
     void write(const char *filename) {
-      std::ofstream output_file(filename);
-      std::ostream_iterator<uint8_t> output_iter(output_file);
-      std::copy(data_.begin(), data_.end(), output_iter);
+      FileDescriptor fd(SystemCall(filename, open(filename, O_WRONLY | O_CREAT | O_TRUNC, 0644)));
+      this->write(fd);
     }
 
     void write(const std::string &filename) {
       this->write(filename.c_str());
     }
 
+    void write(FileDescriptor &fd) {
+      const auto header_bytes = header();
+      std::vector<iovec> iov = segments(header_bytes);
+
+      size_t next = 0;
+      while (next < iov.size()) {
+        const int count = std::min(iov.size() - next, (size_t) IOV_MAX);
+        size_t written = SystemCall("writev", writev(fd.fd_num(), &iov.at(next), count));
+
+        // skip what made it, and write the rest of a partly written segment
+        while (next < iov.size() and written >= iov.at(next).iov_len) {
+          written -= iov.at(next).iov_len;
+          next++;
+        }
+        if (written > 0) {
+          iov.at(next).iov_base = static_cast<uint8_t *>(iov.at(next).iov_base) + written;
+          iov.at(next).iov_len -= written;
+        }
+      }
+    }
+
     void write(FILE *file) {
-      std::fwrite(data_.data(), 1, data_.size(), file);
+      const auto header_bytes = header();
+
+      for (const iovec &segment : segments(header_bytes)) {
+        if (std::fwrite(segment.iov_base, 1, segment.iov_len, file) != segment.iov_len) {
+          throw std::runtime_error("fwrite failed");
+        }
+      }
     }
 };
 
 class EncoderStateDeserializer : File {
   private:
+    EncoderStatePlanes planes_;
+    size_t start_;
     size_t ptr_;
 
+    // reads the header (if there is one), and leaves ptr_ just past it
+    void read_header(void) {
+      planes_ = EncoderStatePlanes::RAW;
+      start_ = 0;
+
+      if (File::size() < sizeof(ENCODER_STATE_MAGIC) + 2 or
+          std::memcmp(chunk().buffer(), ENCODER_STATE_MAGIC, sizeof(ENCODER_STATE_MAGIC)) != 0) {
+        ptr_ = start_;
+        return;
+      }
+
+      const uint16_t version = chunk()(sizeof(ENCODER_STATE_MAGIC), 2).le16();
+      start_ = sizeof(ENCODER_STATE_MAGIC) + 2;
+
+      switch (version) {
+        case 1:
+          break;
+
+        case 2:
+          planes_ = static_cast<EncoderStatePlanes>((*this)(start_++, 1).octet());
+          if (planes_ != EncoderStatePlanes::RAW and planes_ != EncoderStatePlanes::PACKED) {
+            throw std::runtime_error("unsupported encoder state plane format");
+          }
+          break;
+
+        default:
+          throw std::runtime_error("unsupported encoder state version " + std::to_string(version));
+      }
+
+      ptr_ = start_;
+    }
+
   public:
     EncoderStateDeserializer(const char *filename)
       : File(filename)
-      , ptr_(0) {}
+      , planes_()
+      , start_()
+      , ptr_() { read_header(); }
 
     EncoderStateDeserializer(const std::string &filename)
       : File(filename.c_str())
-      , ptr_(0) {}
+      , planes_()
+      , start_()
+      , ptr_() { read_header(); }
 
     EncoderStateDeserializer(FILE *file)
       : File(std::move(FileDescriptor(file)))
-      , ptr_(0) {}
+      , planes_()
+      , start_()
+      , ptr_() { read_header(); }
 
     template<typename T, typename F, typename ...Ps> static T build(F f, Ps ...ps) {
       EncoderStateDeserializer idata(f);
       return T::deserialize(idata, std::forward<Ps>(ps)...);
     }
 
-    void reset(void) { ptr_ = 0; }
+    void reset(void) { ptr_ = start_; }
     size_t remaining(void) const { return chunk().size() - ptr_; }
-    size_t size(void) const { return chunk().size(); }
+    size_t size(void) const { return chunk().size() - start_; }
 
     EncoderSerDesTag peek_tag(void) {
       return static_cast<EncoderSerDesTag>((*this)(ptr_, 1).octet());
@@ -163,6 +316,13 @@ class EncoderStateDeserializer : File {
       return ret;
     }
 
+    // points into the file, so only good as long as the deserializer is
+    const uint8_t *get_bytes(const size_t len) {
+      const uint8_t *ret = (*this)(ptr_, len).buffer();
+      ptr_ += len;
+      return ret;
+    }
+
     MutableRasterHandle get_ref(EncoderSerDesTag t, const uint16_t width, const uint16_t height) {
       MutableRasterHandle raster(width, height);
 
@@ -176,13 +336,29 @@ class EncoderStateDeserializer : File {
 
         uint32_t expect_len = rwidth * rheight + 2 * (rwidth / 2) * (rheight / 2);
         uint32_t get_len = this->get<uint32_t>();
-        assert(get_len == expect_len);
-        (void) get_len;     // only used in assert
-        (void) expect_len;  // only used in assert
-
-        raster.get().Y().forall([this](uint8_t &f){ f = this->get<uint8_t>(); });
-        raster.get().U().forall([this](uint8_t &f){ f = this->get<uint8_t>(); });
-        raster.get().V().forall([this](uint8_t &f){ f = this->get<uint8_t>(); });
+        if ((planes_ == EncoderStatePlanes::RAW and get_len != expect_len) or get_len > remaining()) {
+          throw std::runtime_error("bad raster length in encoder state");
+        }
+
+        if (planes_ == EncoderStatePlanes::PACKED) {
+          const uint8_t *packed = (*this)(ptr_, get_len).buffer();
+          size_t used = 0;
+          for (TwoD<uint8_t> *plane : {&raster.get().Y(), &raster.get().U(), &raster.get().V()}) {
+            used += unpack_plane(packed + used, get_len - used, *plane);
+          }
+          if (used != get_len) {
+            throw std::runtime_error("bad packed raster length in encoder state");
+          }
+          ptr_ += get_len;
+          return raster;
+        }
+
+        // one memcpy per plane, straight out of the mapped file
+        for (TwoD<uint8_t> *plane : {&raster.get().Y(), &raster.get().U(), &raster.get().V()}) {
+          const size_t plane_size = plane->width() * plane->height();
+          std::memcpy(&plane->at(0, 0), (*this)(ptr_, plane_size).buffer(), plane_size);
+          ptr_ += plane_size;
+        }
       }
 
       return raster;
@@ -63,12 +63,13 @@ class Frame
   Optional<TwoD<MacroblockType>> macroblock_headers_ {};
 
   ProbabilityArray< num_segments > calculate_mb_segment_tree_probs( void ) const;
-  SafeArray< Quantizer, num_segments > calculate_segment_quantizers( const Optional< Segmentation > & segmentation ) const;
 
   std::vector< uint8_t > serialize_first_partition( const ProbabilityTables & probability_tables ) const;
   std::vector< std::vector< uint8_t > > serialize_tokens( const ProbabilityTables & probability_tables ) const;
 
  public:
+  SafeArray< Quantizer, num_segments > calculate_segment_quantizers( const Optional< Segmentation > & segmentation ) const;
+
   void relink_y2_blocks( void );
   void loopfilter( const Optional< Segmentation > & segmentation,
                    const Optional< FilterAdjustments > & quantizer_filter_adjustments,
@@ -0,0 +1,213 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <cstring>
+#include <endian.h>
+#include <stdexcept>
+
+#include "plane_packing.hh"
+#include "safe_array.hh"
+
+using namespace std;
+
+/* The work is done on eight pixels at a time, as the bytes of a uint64_t. */
+
+static constexpr size_t block_size = 32;
+
+static constexpr uint64_t low_bits = 0x0101010101010101;
+static constexpr uint64_t high_bits = 0x8080808080808080;
+
+static inline uint64_t load( const uint8_t * p )
+{
+  uint64_t ret;
+  memcpy( &ret, p, sizeof( ret ) );
+  return le64toh( ret );
+}
+
+static inline void store( uint8_t * p, const uint64_t value )
+{
+  const uint64_t le_value = htole64( value );
+  memcpy( p, &le_value, sizeof( le_value ) );
+}
+
+/* bytewise a - b and a + b, modulo 256 */
+static inline uint64_t subtract( const uint64_t a, const uint64_t b )
+{
+  return ( ( a | high_bits ) - ( b & ~high_bits ) ) ^ ( ( a ^ ~b ) & high_bits );
+}
+
+static inline uint64_t add( const uint64_t a, const uint64_t b )
+{
+  return ( ( a & ~high_bits ) + ( b & ~high_bits ) ) ^ ( ( a ^ b ) & high_bits );
+}
+
+/* small errors of either sign become small numbers: 0, -1, 1, -2, 2... */
+static inline uint64_t zigzag( const uint64_t errors )
+{
+  return ( ( errors & ~high_bits ) << 1 ) ^ ( ( ( errors >> 7 ) & low_bits ) * 0xff );
+}
+
+static inline uint64_t unzigzag( const uint64_t values )
+{
+  return ( ( values >> 1 ) & ~high_bits ) ^ ( ( values & low_bits ) * 0xff );
+}
+
+/* bit i of the result is the lowest bit of byte i, and back */
+static inline uint8_t gather_bits( const uint64_t values )
+{
+  return ( ( values & low_bits ) * 0x0102040810204080 ) >> 56;
+}
+
+static const SafeArray<uint64_t, 256> & scatter_table( void )
+{
+  static const SafeArray<uint64_t, 256> table =
+    [] ()
+    {
+      SafeArray<uint64_t, 256> ret;
+      for ( unsigned int byte = 0; byte < 256; byte++ ) {
+        ret.at( byte ) = 0;
+        for ( unsigned int i = 0; i < 8; i++ ) {
+          ret.at( byte ) |= uint64_t( ( byte >> i ) & 1 ) << ( 8 * i );
+        }
+      }
+      return ret;
+    } ();
+
+  return table;
+}
+
+static unsigned int bit_width( uint64_t values )
+{
+  values |= values >> 32;
+  values |= values >> 16;
+  values |= values >> 8;
+
+  unsigned int ret = 0;
+  for ( unsigned int v = values & 0xff; v; v >>= 1 ) {
+    ret++;
+  }
+  return ret;
+}
+
+void pack_plane( const TwoD<uint8_t> & plane, vector<uint8_t> & out )
+{
+  const unsigned int width = plane.width();
+  const size_t size = size_t( width ) * plane.height();
+  const uint8_t * pixels = &plane.at( 0, 0 );
+
+  /* the prediction errors, padded to a whole number of blocks */
+  vector<uint8_t> errors( ( size + block_size - 1 ) / block_size * block_size );
+
+  errors[ 0 ] = zigzag( pixels[ 0 ] ) & 0xff;
+  for ( size_t i = 1; i < min<size_t>( width, size ); i++ ) {
+    errors[ i ] = zigzag( uint8_t( pixels[ i ] - pixels[ i - 1 ] ) ) & 0xff;
+  }
+
+  size_t i = width;
+  for ( ; i + sizeof( uint64_t ) <= size; i += sizeof( uint64_t ) ) {
+    store( &errors[ i ], zigzag( subtract( load( pixels + i ), load( pixels + i - width ) ) ) );
+  }
+  for ( ; i < size; i++ ) {
+    errors[ i ] = zigzag( uint8_t( pixels[ i ] - pixels[ i - width ] ) ) & 0xff;
+  }
+
+  /* each block is its bit width, followed by that many bit planes of
+     block_size bits (bit j of plane k is bit k of the j-th error) */
+  out.reserve( out.size() + size + size / block_size + 1 );
+
+  for ( size_t block = 0; block < errors.size(); block += block_size ) {
+    SafeArray<uint64_t, block_size / 8> values;
+    for ( size_t g = 0; g < values.size(); g++ ) {
+      values.at( g ) = load( &errors[ block + 8 * g ] );
+    }
+
+    const unsigned int bits = bit_width( values.at( 0 ) | values.at( 1 ) | values.at( 2 ) | values.at( 3 ) );
+    out.push_back( bits );
+
+    for ( unsigned int k = 0; k < bits; k++ ) {
+      for ( size_t g = 0; g < values.size(); g++ ) {
+        out.push_back( gather_bits( values.at( g ) >> k ) );
+      }
+    }
+  }
+}
+
+size_t unpack_plane( const uint8_t * data, const size_t length, TwoD<uint8_t> & plane )
+{
+  const unsigned int width = plane.width();
+  const size_t size = size_t( width ) * plane.height();
+  uint8_t * pixels = &plane.at( 0, 0 );
+  const SafeArray<uint64_t, 256> & scatter = scatter_table();
+
+  size_t used = 0;
+
+  for ( size_t block = 0; block < size; block += block_size ) {
+    if ( used >= length or data[ used ] > 8 or used + 1 + 4 * data[ used ] > length ) {
+      throw runtime_error( "packed plane is truncated or corrupt" );
+    }
+
+    const unsigned int bits = data[ used++ ];
+
+    SafeArray<uint64_t, block_size / 8> values {{}};
+    for ( unsigned int k = 0; k < bits; k++ ) {
+      for ( size_t g = 0; g < values.size(); g++ ) {
+        values.at( g ) |= scatter.at( data[ used++ ] ) << k;
+      }
+    }
+
+    if ( block + block_size <= size ) {
+      for ( size_t g = 0; g < values.size(); g++ ) {
+        store( pixels + block + 8 * g, unzigzag( values.at( g ) ) );
+      }
+    } else {
+      uint8_t last_block[ block_size ];
+      for ( size_t g = 0; g < values.size(); g++ ) {
+        store( last_block + 8 * g, unzigzag( values.at( g ) ) );
+      }
+      memcpy( pixels + block, last_block, size - block );
+    }
+  }
+
+  /* undo the prediction: the first row from the left, the rest from above */
+  for ( size_t i = 1; i < min<size_t>( width, size ); i++ ) {
+    pixels[ i ] += pixels[ i - 1 ];
+  }
+
+  /* (eight at a time only if those eight don't depend on each other) */
+  size_t i = width;
+  if ( width >= sizeof( uint64_t ) ) {
+    for ( ; i + sizeof( uint64_t ) <= size; i += sizeof( uint64_t ) ) {
+      store( pixels + i, add( load( pixels + i ), load( pixels + i - width ) ) );
+    }
+  }
+  for ( ; i < size; i++ ) {
+    pixels[ i ] += pixels[ i - width ];
+  }
+
+  return used;
+}
@@ -33,6 +33,10 @@
 #include "vp8_raster.hh"
 #include "intrapred_sse.hh"
 
+#ifdef HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
 using namespace std;
 
 template <unsigned int size>
@@ -476,6 +480,224 @@ uint8_t avg2( const uint8_t x, const uint8_t y )
   return (x + y + 1) >> 1;
 }
 
+/* Apart from B_DC_PRED and B_TM_PRED, the subblock predictors are made of
+   averages of two or three neighbouring pixels along the edge
+
+     e = left[ 3 ], left[ 2 ], left[ 1 ], left[ 0 ], above[ -1 ], above[ 0 ], ..., above[ 7 ]
+
+   (the order of Predictors::east()). EdgeAverages computes all of them at
+   once, and every row of these predictions is then four consecutive bytes
+   of avg2 or avg3, or close to it. */
+struct EdgeAverages
+{
+  /* avg2( e[ i ], e[ i + 1 ] ), and avg3( e[ i - 1 ], e[ i ], e[ i + 1 ] ),
+     where e[ -1 ] = e[ 0 ] and e[ 13 ] = e[ 12 ] */
+  alignas( 16 ) SafeArray<uint8_t, 16> avg2 {};
+  alignas( 16 ) SafeArray<uint8_t, 16> avg3 {};
+
+  uint8_t bottom_left;
+
+  EdgeAverages( const uint8_t * above, const uint8_t * left );
+};
+
+#ifdef HAVE_SSE2
+
+EdgeAverages::EdgeAverages( const uint8_t * above, const uint8_t * left )
+  : bottom_left( left[ 3 ] )
+{
+  const __m128i left_column = _mm_cvtsi32_si128( ( uint32_t( left[ 0 ] ) << 24 ) | ( uint32_t( left[ 1 ] ) << 16 )
+                                                 | ( uint32_t( left[ 2 ] ) << 8 ) | left[ 3 ] );
+  const __m128i above_row = _mm_or_si128( _mm_loadl_epi64( reinterpret_cast<const __m128i *>( above - 1 ) ),
+                                          _mm_slli_si128( _mm_cvtsi32_si128( above[ 7 ] ), 8 ) );
+
+  const __m128i edge = _mm_or_si128( left_column, _mm_slli_si128( above_row, 4 ) );
+
+  const __m128i first = _mm_cvtsi32_si128( 0xff );
+  const __m128i last = _mm_slli_si128( first, 12 );
+
+  const __m128i previous = _mm_or_si128( _mm_slli_si128( edge, 1 ), _mm_and_si128( edge, first ) );
+  const __m128i next = _mm_or_si128( _mm_srli_si128( edge, 1 ), _mm_and_si128( edge, last ) );
+
+  /* _mm_avg_epu8 rounds up, so ( x + z ) >> 1 is that minus the lost bit */
+  const __m128i outer = _mm_sub_epi8( _mm_avg_epu8( previous, next ),
+                                      _mm_and_si128( _mm_xor_si128( previous, next ), _mm_set1_epi8( 1 ) ) );
+
+  _mm_store_si128( reinterpret_cast<__m128i *>( &avg2.at( 0 ) ), _mm_avg_epu8( edge, next ) );
+  _mm_store_si128( reinterpret_cast<__m128i *>( &avg3.at( 0 ) ), _mm_avg_epu8( outer, edge ) );
+}
+
+#else
+
+EdgeAverages::EdgeAverages( const uint8_t * above, const uint8_t * left )
+  : bottom_left( left[ 3 ] )
+{
+  /* e[ i ] is at i + 1 */
+  SafeArray<uint8_t, 15> edge;
+
+  for ( unsigned int i = 0; i < 4; i++ ) {
+    edge.at( i + 1 ) = left[ 3 - i ];
+  }
+
+  for ( unsigned int i = 0; i < 9; i++ ) {
+    edge.at( i + 5 ) = above[ int( i ) - 1 ];
+  }
+
+  edge.at( 0 ) = edge.at( 1 );
+  edge.at( 14 ) = edge.at( 13 );
+
+  for ( unsigned int i = 0; i < 13; i++ ) {
+    avg2.at( i ) = ::avg2( edge.at( i + 1 ), edge.at( i + 2 ) );
+    avg3.at( i ) = ::avg3( edge.at( i ), edge.at( i + 1 ), edge.at( i + 2 ) );
+  }
+}
+
+#endif
+
+static void copy_row( uint8_t * row, const SafeArray<uint8_t, 16> & from, const unsigned int first )
+{
+  memcpy( row, &from.at( first ), 4 );
+}
+
+/* writes the prediction of one of the modes made of edge averages */
+static void edge_predict( const bmode b_mode, const EdgeAverages & edge,
+                          uint8_t * output, const unsigned int stride )
+{
+  const auto & avg2 = edge.avg2;
+  const auto & avg3 = edge.avg3;
+
+  /* the rows of B_HD_PRED and B_HU_PRED alternate between the two */
+  SafeArray<uint8_t, 16> interleaved {};
+
+  switch ( b_mode ) {
+  case B_VE_PRED:
+    for ( unsigned int row = 0; row < 4; row++ ) {
+      copy_row( output + row * stride, avg3, 5 );
+    }
+    break;
+
+  case B_HE_PRED:
+    for ( unsigned int row = 0; row < 4; row++ ) {
+      memset( output + row * stride, avg3.at( 3 - row ), 4 );
+    }
+    break;
+
+  case B_LD_PRED:
+    for ( unsigned int row = 0; row < 4; row++ ) {
+      copy_row( output + row * stride, avg3, 6 + row );
+    }
+    break;
+
+  case B_RD_PRED:
+    for ( unsigned int row = 0; row < 4; row++ ) {
+      copy_row( output + row * stride, avg3, 4 - row );
+    }
+    break;
+
+  case B_VR_PRED:
+    copy_row( output, avg2, 4 );
+    copy_row( output + stride, avg3, 4 );
+    /* the last two rows are the first two shifted right, with the first
+       column going further down the left edge */
+    output[ 2 * stride ] = avg3.at( 3 );
+    memcpy( output + 2 * stride + 1, &avg2.at( 4 ), 3 );
+    output[ 3 * stride ] = avg3.at( 2 );
+    memcpy( output + 3 * stride + 1, &avg3.at( 4 ), 3 );
+    break;
+
+  case B_VL_PRED:
+    copy_row( output, avg2, 5 );
+    copy_row( output + stride, avg3, 6 );
+    copy_row( output + 2 * stride, avg2, 6 );
+    copy_row( output + 3 * stride, avg3, 7 );
+    /* the last column skips one */
+    output[ 2 * stride + 3 ] = avg3.at( 10 );
+    output[ 3 * stride + 3 ] = avg3.at( 11 );
+    break;
+
+  case B_HD_PRED:
+    for ( unsigned int i = 0; i < 5; i++ ) {
+      interleaved.at( 2 * i ) = avg2.at( i );
+      interleaved.at( 2 * i + 1 ) = avg3.at( i + 1 );
+    }
+
+    for ( unsigned int row = 1; row < 4; row++ ) {
+      copy_row( output + row * stride, interleaved, 6 - 2 * row );
+    }
+
+    copy_row( output, interleaved, 6 );
+    output[ 2 ] = avg3.at( 5 );
+    output[ 3 ] = avg3.at( 6 );
+    break;
+
+  case B_HU_PRED:
+    for ( unsigned int i = 0; i < 3; i++ ) {
+      interleaved.at( 2 * i ) = avg2.at( 2 - i );
+      interleaved.at( 2 * i + 1 ) = avg3.at( 2 - i );
+    }
+
+    memset( &interleaved.at( 6 ), edge.bottom_left, 4 );
+
+    for ( unsigned int row = 0; row < 4; row++ ) {
+      copy_row( output + row * stride, interleaved, 2 * row );
+    }
+    break;
+
+  default: throw LogicError();
+  }
+}
+
+#ifdef HAVE_SSE2
+
+template <>
+void VP8Raster::Block4::vertical_smoothed_predict( const Predictors & predictors,
+                                                   BlockSubRange & output ) const
+{
+  edge_predict( B_VE_PRED, EdgeAverages( predictors.above, predictors.left ),
+                &output.at( 0, 0 ), output.stride() );
+}
+
+template <>
+void VP8Raster::Block4::horizontal_smoothed_predict( const Predictors & predictors,
+                                                     BlockSubRange & output ) const
+{
+  edge_predict( B_HE_PRED, EdgeAverages( predictors.above, predictors.left ),
+                &output.at( 0, 0 ), output.stride() );
+}
+
+template <>
+void VP8Raster::Block4::left_down_predict( const Predictors & predictors,
+                                           BlockSubRange & output ) const
+{
+  edge_predict( B_LD_PRED, EdgeAverages( predictors.above, predictors.left ),
+                &output.at( 0, 0 ), output.stride() );
+}
+
+template <>
+void VP8Raster::Block4::right_down_predict( const Predictors & predictors,
+                                            BlockSubRange & output ) const
+{
+  edge_predict( B_RD_PRED, EdgeAverages( predictors.above, predictors.left ),
+                &output.at( 0, 0 ), output.stride() );
+}
+
+template <>
+void VP8Raster::Block4::vertical_right_predict( const Predictors & predictors,
+                                                BlockSubRange & output ) const
+{
+  edge_predict( B_VR_PRED, EdgeAverages( predictors.above, predictors.left ),
+                &output.at( 0, 0 ), output.stride() );
+}
+
+template <>
+void VP8Raster::Block4::vertical_left_predict( const Predictors & predictors,
+                                               BlockSubRange & output ) const
+{
+  edge_predict( B_VL_PRED, EdgeAverages( predictors.above, predictors.left ),
+                &output.at( 0, 0 ), output.stride() );
+}
+
+#else
+
 template <>
 void VP8Raster::Block4::vertical_smoothed_predict( const Predictors & predictors,
                                                    BlockSubRange & output ) const
@@ -558,6 +780,8 @@ void VP8Raster::Block4::vertical_left_predict( const Predictors & predictors,
   output.at( 3, 3 ) =                     avg3( predictors.above[ 5 ], predictors.above[ 6 ], predictors.above[ 7 ] );
 }
 
+#endif
+
 #ifdef HAVE_SSE2
 
 template <>
@@ -642,6 +866,56 @@ void VP8Raster::Block4::intra_predict( const bmode b_mode,
   }
 }
 
+template <>
+void VP8Raster::Block4::intra_predict_all( const Predictors & predictors,
+                                           IntraPredictions & output ) const
+{
+  uint16_t sum = 4;
+
+  for ( unsigned int i = 0; i < 4; i++ ) {
+    sum += predictors.above[ i ] + predictors.left[ i ];
+  }
+
+  memset( &output.at( B_DC_PRED ).at( 0 ), sum >> 3, 16 );
+
+#ifdef HAVE_SSE2
+
+  uint32_t above;
+  memcpy( &above, predictors.above, 4 );
+
+  const __m128i above_row = _mm_sub_epi16( _mm_unpacklo_epi8( _mm_cvtsi32_si128( above ), _mm_setzero_si128() ),
+                                           _mm_set1_epi16( predictors.above[ -1 ] ) );
+  const __m128i two_rows = _mm_unpacklo_epi64( above_row, above_row );
+
+  const auto left = [&] ( const unsigned int row ) -> int16_t { return predictors.left[ row ]; };
+
+  const __m128i top = _mm_add_epi16( two_rows, _mm_set_epi16( left( 1 ), left( 1 ), left( 1 ), left( 1 ),
+                                                              left( 0 ), left( 0 ), left( 0 ), left( 0 ) ) );
+  const __m128i bottom = _mm_add_epi16( two_rows, _mm_set_epi16( left( 3 ), left( 3 ), left( 3 ), left( 3 ),
+                                                                 left( 2 ), left( 2 ), left( 2 ), left( 2 ) ) );
+
+  _mm_storeu_si128( reinterpret_cast<__m128i *>( &output.at( B_TM_PRED ).at( 0 ) ),
+                    _mm_packus_epi16( top, bottom ) );
+
+#else
+
+  for ( unsigned int row = 0; row < 4; row++ ) {
+    for ( unsigned int column = 0; column < 4; column++ ) {
+      output.at( B_TM_PRED ).at( 4 * row + column ) = clamp255( predictors.left[ row ]
+                                                                + predictors.above[ column ]
+                                                                - predictors.above[ -1 ] );
+    }
+  }
+
+#endif
+
+  const EdgeAverages edge( predictors.above, predictors.left );
+
+  for ( unsigned int b_mode = B_VE_PRED; b_mode < num_intra_b_modes; b_mode++ ) {
+    edge_predict( bmode( b_mode ), edge, &output.at( b_mode ).at( 0 ), 4 );
+  }
+}
+
 static constexpr SafeArray<SafeArray<int16_t, 6>, 8> sixtap_filters =
   {{ { { 0,  0,  128,    0,   0,  0 } },
      { { 0, -6,  123,   12,  -1,  0 } },
@@ -0,0 +1,408 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <cerrno>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+
+#include <endian.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "exception.hh"
+#include "file.hh"
+#include "state_store.hh"
+
+using namespace std;
+
+static constexpr size_t index_entry_size = 24;
+static constexpr size_t macroblock_bytes = 16 * 16 + 2 * 8 * 8;
+
+static void make_directory( const string & path )
+{
+  if ( mkdir( path.c_str(), 0755 ) < 0 and errno != EEXIST ) {
+    throw unix_error( "mkdir " + path );
+  }
+}
+
+StateStore::StateStore( const string & directory, const EncoderStatePlanes planes )
+  : directory_( directory ),
+    planes_( planes )
+{
+  make_directory( directory_ );
+  make_directory( directory_ + "/objects" );
+}
+
+string StateStore::index_path( void ) const
+{
+  return directory_ + "/index";
+}
+
+string StateStore::object_path( const uint64_t hash ) const
+{
+  char name[ 17 ];
+  snprintf( name, sizeof( name ), "%016llx", static_cast<unsigned long long>( hash ) );
+  return directory_ + "/objects/" + name;
+}
+
+bool StateStore::has_object( const uint64_t hash ) const
+{
+  struct stat info;
+  return stat( object_path( hash ).c_str(), &info ) == 0;
+}
+
+void StateStore::write_object( const uint64_t hash, EncoderStateSerializer & odata ) const
+{
+  /* nobody gets to see half an object: it's written under a name of its own,
+     since another writer might be storing the same one, and renamed into
+     place once it's complete */
+  const string path = object_path( hash );
+  string temp_path = path + ".XXXXXX";
+
+  FileDescriptor temp_file( SystemCall( "mkstemp", mkstemp( &temp_path[ 0 ] ) ) );
+
+  try {
+    SystemCall( "fchmod", fchmod( temp_file.fd_num(), 0644 ) );
+    odata.write( temp_file );
+    SystemCall( "rename", rename( temp_path.c_str(), path.c_str() ) );
+  }
+  catch ( ... ) {
+    unlink( temp_path.c_str() );
+    throw;
+  }
+}
+
+void StateStore::read_index( void ) const
+{
+  struct stat info;
+  if ( stat( index_path().c_str(), &info ) < 0
+       or static_cast<uint64_t>( info.st_size ) < index_size_ + index_entry_size ) {
+    return;
+  }
+
+  /* a record that is still being appended is left for next time */
+  const size_t length = ( info.st_size - index_size_ ) / index_entry_size * index_entry_size;
+  string buffer( length, 0 );
+
+  FileDescriptor file( SystemCall( index_path(), open( index_path().c_str(), O_RDONLY ) ) );
+
+  for ( size_t done = 0; done < length; ) {
+    const ssize_t count = SystemCall( "pread", pread( file.fd_num(), &buffer[ done ],
+                                                      length - done, index_size_ + done ) );
+    if ( count == 0 ) {
+      throw runtime_error( "index of " + directory_ + " got shorter" );
+    }
+
+    done += count;
+  }
+
+  const Chunk records( buffer );
+
+  for ( size_t offset = 0; offset < length; offset += index_entry_size ) {
+    const IndexEntry entry { static_cast<uint32_t>( records( offset, 4 ).le32() ),
+                             records( offset + 8, 8 ).le64(),
+                             records( offset + 16, 8 ).le64() };
+
+    if ( index_.count( entry.minihash ) == 0 ) {
+      index_order_.push_back( entry.minihash );
+    }
+
+    index_[ entry.minihash ] = entry;
+  }
+
+  index_size_ += length;
+}
+
+Optional<StateStore::IndexEntry> StateStore::find( const uint32_t minihash ) const
+{
+  read_index();
+
+  const auto entry = index_.find( minihash );
+
+  if ( entry == index_.end() ) {
+    return {};
+  }
+
+  return make_optional( true, entry->second );
+}
+
+vector<uint32_t> StateStore::minihashes( void ) const
+{
+  read_index();
+  return index_order_;
+}
+
+void StateStore::remember( const uint64_t hash, const RasterHandle & raster )
+{
+  recent_rasters_.emplace_front( hash, raster );
+
+  if ( recent_rasters_.size() > recent_raster_count ) {
+    recent_rasters_.pop_back();
+  }
+}
+
+RasterHandle StateStore::load_raster( const uint64_t hash, const uint16_t width, const uint16_t height )
+{
+  for ( auto recent = recent_rasters_.begin(); recent != recent_rasters_.end(); recent++ ) {
+    if ( recent->first == hash ) {
+      recent_rasters_.splice( recent_rasters_.begin(), recent_rasters_, recent );
+      return recent_rasters_.front().second;
+    }
+  }
+
+  EncoderStateDeserializer idata( object_path( hash ) );
+
+  if ( idata.peek_tag() != EncoderSerDesTag::REF_DELTA ) {
+    RasterHandle raster( idata.get_ref( EncoderSerDesTag::REF_LAST, width, height ) );
+    remember( hash, raster );
+    return raster;
+  }
+
+  idata.get_tag();
+  idata.get<uint32_t>();
+  const uint64_t parent_hash = idata.get<uint64_t>();
+  idata.get<uint8_t>();
+  const uint32_t count = idata.get<uint32_t>();
+
+  MutableRasterHandle raster( width, height );
+  raster.get().copy_from( load_raster( parent_hash, width, height ).get() );
+  const unsigned int mb_width = raster.get().width() / 16;
+
+  for ( uint32_t i = 0; i < count; i++ ) {
+    const uint32_t mb = idata.get<uint32_t>();
+    const unsigned int column = mb % mb_width;
+    const unsigned int row = mb / mb_width;
+    const uint8_t * pixels = idata.get_bytes( macroblock_bytes );
+
+    for ( unsigned int y = 0; y < 16; y++, pixels += 16 ) {
+      memcpy( &raster.get().Y().at( 16 * column, 16 * row + y ), pixels, 16 );
+    }
+
+    for ( TwoD<uint8_t> * plane : { &raster.get().U(), &raster.get().V() } ) {
+      for ( unsigned int y = 0; y < 8; y++, pixels += 8 ) {
+        memcpy( &plane->at( 8 * column, 8 * row + y ), pixels, 8 );
+      }
+    }
+  }
+
+  RasterHandle ret( move( raster ) );
+  remember( hash, ret );
+  return ret;
+}
+
+unsigned int StateStore::delta_depth( const uint64_t hash ) const
+{
+  EncoderStateDeserializer idata( object_path( hash ) );
+
+  if ( idata.peek_tag() != EncoderSerDesTag::REF_DELTA ) {
+    return 0;
+  }
+
+  idata.get_tag();
+  idata.get<uint32_t>();
+  idata.get<uint64_t>();
+  return idata.get<uint8_t>();
+}
+
+static bool same_macroblock( const VP8Raster & a, const VP8Raster & b,
+                             const unsigned int column, const unsigned int row )
+{
+  for ( unsigned int y = 0; y < 16; y++ ) {
+    if ( memcmp( &a.Y().at( 16 * column, 16 * row + y ), &b.Y().at( 16 * column, 16 * row + y ), 16 ) ) {
+      return false;
+    }
+  }
+
+  for ( unsigned int y = 0; y < 8; y++ ) {
+    if ( memcmp( &a.U().at( 8 * column, 8 * row + y ), &b.U().at( 8 * column, 8 * row + y ), 8 )
+         or memcmp( &a.V().at( 8 * column, 8 * row + y ), &b.V().at( 8 * column, 8 * row + y ), 8 ) ) {
+      return false;
+    }
+  }
+
+  return true;
+}
+
+void StateStore::store_raster( const RasterHandle & raster, const Optional<IndexEntry> & parent,
+                               const uint16_t width, const uint16_t height )
+{
+  const uint64_t hash = raster.hash();
+  EncoderStateSerializer odata( planes_ );
+
+  unsigned int depth = 0;
+  if ( parent.initialized() ) {
+    depth = delta_depth( parent.get().raster_hash ) + 1;
+  }
+
+  if ( depth == 0 or depth > max_delta_depth ) {
+    odata.put( raster, EncoderSerDesTag::REF_LAST );
+    write_object( hash, odata );
+    remember( hash, raster );
+    return;
+  }
+
+  const VP8Raster & base = load_raster( parent.get().raster_hash, width, height ).get();
+  const unsigned int mb_width = raster.get().width() / 16;
+  const unsigned int mb_height = raster.get().height() / 16;
+
+  vector<uint32_t> changed;
+  for ( unsigned int row = 0; row < mb_height; row++ ) {
+    for ( unsigned int column = 0; column < mb_width; column++ ) {
+      if ( not same_macroblock( raster.get(), base, column, row ) ) {
+        changed.push_back( row * mb_width + column );
+      }
+    }
+  }
+
+  /* a delta that's most of the raster isn't worth the trouble */
+  if ( 2 * changed.size() > mb_width * mb_height ) {
+    odata.put( raster, EncoderSerDesTag::REF_LAST );
+    write_object( hash, odata );
+    remember( hash, raster );
+    return;
+  }
+
+  odata.put( EncoderSerDesTag::REF_DELTA );
+  const size_t placeholder = odata.put( uint32_t( 0 ) );
+  odata.put( parent.get().raster_hash );
+  odata.put( uint8_t( depth ) );
+  odata.put( uint32_t( changed.size() ) );
+
+  uint8_t pixels[ macroblock_bytes ];
+  for ( const uint32_t mb : changed ) {
+    const unsigned int column = mb % mb_width;
+    const unsigned int row = mb / mb_width;
+    uint8_t * out = pixels;
+
+    for ( unsigned int y = 0; y < 16; y++, out += 16 ) {
+      memcpy( out, &raster.get().Y().at( 16 * column, 16 * row + y ), 16 );
+    }
+
+    for ( const TwoD<uint8_t> * plane : { &raster.get().U(), &raster.get().V() } ) {
+      for ( unsigned int y = 0; y < 8; y++, out += 8 ) {
+        memcpy( out, &plane->at( 8 * column, 8 * row + y ), 8 );
+      }
+    }
+
+    odata.put( mb );
+    odata.put_bytes( pixels, macroblock_bytes );
+  }
+
+  odata.put( uint32_t( 8 + 1 + 4 + changed.size() * ( 4 + macroblock_bytes ) ), placeholder );
+  write_object( hash, odata );
+  remember( hash, raster );
+}
+
+uint32_t StateStore::put( const Decoder & decoder, const uint32_t parent_minihash )
+{
+  const DecoderState state = decoder.get_state();
+  const RasterHandle raster = decoder.get_references().last;
+
+  /* the minihash that get() will give back */
+  const uint32_t minihash = Decoder( state, References( raster ) ).minihash();
+  const IndexEntry entry { minihash, state.hash(), raster.hash() };
+
+  /* the hashes aren't collision-proof, so an object that's already there has
+     to be the same before it's shared */
+  if ( has_object( entry.state_hash ) ) {
+    if ( EncoderStateDeserializer::build<DecoderState>( object_path( entry.state_hash ) ) != state ) {
+      throw runtime_error( "a different decoder state has the same hash in " + directory_ );
+    }
+  }
+  else {
+    EncoderStateSerializer odata;
+    state.serialize( odata );
+    write_object( entry.state_hash, odata );
+  }
+
+  if ( has_object( entry.raster_hash ) ) {
+    if ( load_raster( entry.raster_hash, state.width, state.height ).get() != raster.get() ) {
+      throw runtime_error( "a different raster has the same hash in " + directory_ );
+    }
+  }
+  else {
+    Optional<IndexEntry> parent;
+    if ( parent_minihash != 0 and parent_minihash != entry.minihash ) {
+      parent = find( parent_minihash );
+    }
+
+    /* only a raster of the same size can be a base */
+    if ( parent.initialized() ) {
+      const DecoderState parent_state =
+        EncoderStateDeserializer::build<DecoderState>( object_path( parent.get().state_hash ) );
+
+      if ( parent_state.width != state.width or parent_state.height != state.height ) {
+        parent.clear();
+      }
+    }
+
+    store_raster( raster, parent, state.width, state.height );
+  }
+
+  const Optional<IndexEntry> existing = find( entry.minihash );
+  if ( existing.initialized() and existing.get().state_hash == entry.state_hash
+       and existing.get().raster_hash == entry.raster_hash ) {
+    return entry.minihash;
+  }
+
+  uint8_t record[ index_entry_size ] = {};
+  const uint32_t le_minihash = htole32( entry.minihash );
+  const uint64_t le_state_hash = htole64( entry.state_hash );
+  const uint64_t le_raster_hash = htole64( entry.raster_hash );
+  memcpy( record, &le_minihash, 4 );
+  memcpy( record + 8, &le_state_hash, 8 );
+  memcpy( record + 16, &le_raster_hash, 8 );
+
+  FileDescriptor index_file( SystemCall( index_path(), open( index_path().c_str(),
+                                                             O_WRONLY | O_APPEND | O_CREAT, 0644 ) ) );
+  index_file.write( Chunk( record, index_entry_size ) );
+
+  return entry.minihash;
+}
+
+Decoder StateStore::get( const uint32_t minihash )
+{
+  const Optional<IndexEntry> entry = find( minihash );
+
+  if ( not entry.initialized() ) {
+    throw runtime_error( "no state with that minihash in " + directory_ );
+  }
+
+  DecoderState state = EncoderStateDeserializer::build<DecoderState>( object_path( entry.get().state_hash ) );
+  const RasterHandle raster = load_raster( entry.get().raster_hash, state.width, state.height );
+
+  Decoder decoder( move( state ), References( raster ) );
+
+  if ( decoder.minihash() != minihash ) {
+    throw runtime_error( "state in " + directory_ + " does not match its minihash" );
+  }
+
+  return decoder;
+}
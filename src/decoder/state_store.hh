@@ -0,0 +1,111 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#ifndef STATE_STORE_HH
+#define STATE_STORE_HH
+
+/* A directory of decoder states, looked up by minihash. Decoder states and
+   reference rasters are stored once each, under their hashes, in objects/;
+   a raster can also be stored as the macroblocks that changed since another
+   raster. The index file maps each minihash to the objects it's made of, in
+   fixed-size records; it is only ever appended to, and the latest record
+   for a minihash wins. */
+
+#include <cstdint>
+#include <list>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+#include "decoder.hh"
+#include "enc_state_serializer.hh"
+#include "optional.hh"
+
+class StateStore
+{
+public:
+  struct IndexEntry
+  {
+    uint32_t minihash;
+    uint64_t state_hash;
+    uint64_t raster_hash;
+  };
+
+  /* how many deltas a raster can be away from a full one */
+  static constexpr unsigned int max_delta_depth = 16;
+
+private:
+  std::string directory_;
+  EncoderStatePlanes planes_;
+
+  /* the last few rasters that were loaded or stored, with their hashes */
+  static constexpr size_t recent_raster_count = 4;
+  std::list<std::pair<uint64_t, RasterHandle>> recent_rasters_ {};
+
+  /* the index as far as it has been read: the latest entry for every
+     minihash, and the minihashes in the order they first appeared. Catching
+     up with other writers only takes reading the records past index_size_. */
+  mutable std::unordered_map<uint32_t, IndexEntry> index_ {};
+  mutable std::vector<uint32_t> index_order_ {};
+  mutable uint64_t index_size_ { 0 };
+
+  std::string index_path( void ) const;
+  std::string object_path( const uint64_t hash ) const;
+  bool has_object( const uint64_t hash ) const;
+  void write_object( const uint64_t hash, EncoderStateSerializer & odata ) const;
+
+  void read_index( void ) const;
+  Optional<IndexEntry> find( const uint32_t minihash ) const;
+
+  void remember( const uint64_t hash, const RasterHandle & raster );
+  RasterHandle load_raster( const uint64_t hash, const uint16_t width, const uint16_t height );
+  unsigned int delta_depth( const uint64_t hash ) const;
+
+  void store_raster( const RasterHandle & raster, const Optional<IndexEntry> & parent,
+                     const uint16_t width, const uint16_t height );
+
+public:
+  StateStore( const std::string & directory,
+              const EncoderStatePlanes planes = EncoderStatePlanes::RAW );
+
+  /* stores the decoder, as it would be serialized (i.e., only the last
+     reference), under the minihash of that, which is returned. If
+     parent_minihash is a state in the store, its last reference can be the
+     base of a delta. An object that is already there under the same hash has
+     to have the same contents, or this throws. */
+  uint32_t put( const Decoder & decoder, const uint32_t parent_minihash = 0 );
+
+  Decoder get( const uint32_t minihash );
+
+  bool contains( const uint32_t minihash ) const { return find( minihash ).initialized(); }
+
+  std::vector<uint32_t> minihashes( void ) const;
+};
+
+#endif /* STATE_STORE_HH */
@@ -33,6 +33,7 @@
 
 #include "config.h"
 #include "raster.hh"
+#include "modemv_data.hh"
 
 #ifdef HAVE_SSE2
 #include "predictor_sse.hh"
@@ -121,6 +122,12 @@ public:
                         const Predictors & predictors,
                         TwoDSubRange<uint8_t, size, size> & output ) const;
 
+    /* every subblock mode at once (Block4 only), in bmode order, each
+       prediction packed row by row */
+    typedef SafeArray<SafeArray<uint8_t, size * size>, num_intra_b_modes> IntraPredictions;
+
+    void intra_predict_all( const Predictors & predictors, IntraPredictions & output ) const;
+
     void inter_predict( const MotionVector & mv,
                         const TwoD<uint8_t> & reference ) { inter_predict( mv, reference, this->contents_ ); }
 
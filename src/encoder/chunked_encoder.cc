@@ -0,0 +1,303 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <sys/mman.h>
+
+#include <deque>
+#include <algorithm>
+#include <future>
+#include <stdexcept>
+#include <thread>
+
+#include "chunked_encoder.hh"
+#include "uncompressed_chunk.hh"
+
+using namespace std;
+
+/* the originals of a chunk, which every re-encode reads again */
+class RasterList : public FrameInput
+{
+private:
+  const vector<RasterHandle> & rasters_;
+  size_t next_ { 0 };
+  uint16_t width_, height_;
+
+public:
+  RasterList( const vector<RasterHandle> & rasters,
+              const uint16_t width, const uint16_t height )
+    : rasters_( rasters ), width_( width ), height_( height )
+  {}
+
+  Optional<RasterHandle> get_next_frame() override
+  {
+    if ( next_ == rasters_.size() ) {
+      return {};
+    }
+
+    return Optional<RasterHandle>( true, rasters_.at( next_++ ) );
+  }
+
+  uint16_t display_width() override { return width_; }
+  uint16_t display_height() override { return height_; }
+};
+
+/* an IVF in anonymous memory, written first and read afterwards */
+class MemoryIVF
+{
+private:
+  FileDescriptor fd_;
+  IVFWriter writer_;
+
+  FileDescriptor duplicate_fd() const
+  {
+    return FileDescriptor( SystemCall( "dup", dup( fd_.fd_num() ) ) );
+  }
+
+public:
+  MemoryIVF( const uint16_t width, const uint16_t height )
+    : fd_( SystemCall( "memfd_create", memfd_create( "chunk", 0 ) ) ),
+      writer_( duplicate_fd(), "VP80", width, height, 1, 1 )
+  {}
+
+  IVFWriter & writer() { return writer_; }
+  IVF reader() const { return IVF( duplicate_fd() ); }
+};
+
+/* re-encodes the originals of a chunk to start from the given state, with
+   the prediction modes of another encoding of them, on reencode_threads
+   threads; returns the state that the new encoding ends in */
+static Decoder reencode_chunk( const Decoder & state,
+                               const SpeedPreset & speed,
+                               const unsigned int reencode_threads,
+                               const vector<RasterHandle> & originals,
+                               const IVF & prediction_ivf,
+                               const Decoder & prediction_state,
+                               const double kf_q_weight,
+                               const bool extra_frame_chunk,
+                               IVFWriter & output )
+{
+  Encoder encoder { state, speed };
+  encoder.set_reencode_threads( reencode_threads );
+
+  RasterList rasters { originals, prediction_ivf.width(), prediction_ivf.height() };
+
+  encoder.reencode( rasters, prediction_ivf, prediction_state, kf_q_weight,
+                    extra_frame_chunk, output );
+
+  return encoder.export_decoder();
+}
+
+ChunkedEncoder::ChunkedEncoder( const uint16_t width, const uint16_t height,
+                                const SpeedPreset & speed,
+                                const unsigned int frames_per_chunk,
+                                const unsigned int thread_count )
+  : width_( width ), height_( height ), speed_( speed ),
+    frames_per_chunk_( frames_per_chunk ), thread_count_( thread_count )
+{
+  if ( frames_per_chunk_ == 0 or thread_count_ == 0 ) {
+    throw runtime_error( "chunks need at least one frame and one thread" );
+  }
+}
+
+/* the chunks share the cores (the rebase on the calling thread runs
+   alongside thread_count_ chunk encodings) */
+unsigned int ChunkedEncoder::reencode_threads() const
+{
+  return max( 1u, thread::hardware_concurrency() / thread_count_ );
+}
+
+Decoder ChunkedEncoder::encode_independently( const vector<RasterHandle> & originals,
+                                              IVFWriter & output ) const
+{
+  Encoder encoder { width_, height_, speed_ };
+
+  auto encode_frame =
+    [&] ( const RasterHandle & original )
+    {
+      return y_ac_qi_.initialized()
+        ? encoder.encode_with_quantizer( original.get(), y_ac_qi_.get() )
+        : encoder.encode_with_minimum_ssim( original.get(), minimum_ssim_ );
+    };
+
+  for ( size_t i = 0; i + 1 < originals.size(); i++ ) {
+    output.append_frame( encode_frame( originals.at( i ) ) );
+  }
+
+  /* like xc-terminate-chunk, make the last frame refresh all the references,
+     so that the chunk ends in a state where they're all the same */
+  Decoder decoder = encoder.export_decoder();
+  const vector<uint8_t> last_frame = encode_frame( originals.back() );
+  UncompressedChunk uch { last_frame, width_, height_, false };
+
+  if ( uch.key_frame() ) {
+    KeyFrame frame = decoder.parse_frame<KeyFrame>( uch );
+    output.append_frame( last_frame );
+
+    decoder.decode_frame( frame );
+  }
+  else {
+    InterFrame frame = decoder.parse_frame<InterFrame>( uch );
+
+    frame.mutable_header().refresh_last = true;
+    frame.mutable_header().refresh_golden_frame = true;
+    frame.mutable_header().refresh_alternate_frame = true;
+    frame.mutable_header().copy_buffer_to_golden.clear();
+    frame.mutable_header().copy_buffer_to_alternate.clear();
+
+    output.append_frame( frame.serialize( decoder.get_state().probability_tables ) );
+
+    decoder.decode_frame( frame );
+  }
+
+  return decoder;
+}
+
+unsigned int ChunkedEncoder::encode( FrameInput & input, IVFWriter & output )
+{
+  if ( input.display_width() != width_ or input.display_height() != height_
+       or output.width() != width_ or output.height() != height_ ) {
+    throw runtime_error( "raster size mismatch" );
+  }
+
+  struct PendingChunk
+  {
+    vector<RasterHandle> originals;
+
+    /* the states that the independent encodings of this chunk and of the one
+       before it end in (the latter is invalid for the first chunk) */
+    shared_future<Decoder> final_state;
+    shared_future<Decoder> previous_final_state;
+
+    /* the first chunk as it is, and any other one re-encoded to start from
+       previous_final_state */
+    future<MemoryIVF> encoding;
+  };
+
+  deque<PendingChunk> pending;
+  shared_future<Decoder> last_final_state;
+  Optional<RasterHandle> last_original;
+  bool input_done = false;
+
+  Decoder rebased_state { width_, height_ };
+  unsigned int chunk_count = 0;
+
+  while ( true ) {
+    /* keep thread_count chunks in the works */
+    while ( not input_done and pending.size() < thread_count_ ) {
+      vector<RasterHandle> originals;
+
+      while ( originals.size() < frames_per_chunk_ ) {
+        Optional<RasterHandle> raster = input.get_next_frame();
+
+        if ( not raster.initialized() ) {
+          input_done = true;
+          break;
+        }
+
+        originals.push_back( raster.get() );
+      }
+
+      if ( originals.empty() ) {
+        break;
+      }
+
+      vector<RasterHandle> rasters;
+      const bool extra_frame = extra_frame_chunks_ and last_original.initialized();
+
+      if ( extra_frame ) {
+        rasters.push_back( last_original.get() );
+      }
+
+      rasters.insert( rasters.end(), originals.begin(), originals.end() );
+      last_original = Optional<RasterHandle>( true, originals.back() );
+
+      promise<Decoder> final_state_promise;
+      shared_future<Decoder> final_state = final_state_promise.get_future().share();
+      shared_future<Decoder> previous_final_state = last_final_state;
+
+      future<MemoryIVF> encoding = async( launch::async,
+        [this, rasters, extra_frame, previous_final_state,
+         final_state_promise = move( final_state_promise )] () mutable
+        {
+          MemoryIVF independent { width_, height_ };
+
+          try {
+            final_state_promise.set_value( encode_independently( rasters, independent.writer() ) );
+          }
+          catch ( ... ) {
+            final_state_promise.set_exception( current_exception() );
+            throw;
+          }
+
+          if ( not previous_final_state.valid() ) {
+            return independent;
+          }
+
+          MemoryIVF reencoded { width_, height_ };
+          reencode_chunk( previous_final_state.get(), speed_, reencode_threads(),
+                          rasters, independent.reader(),
+                          Decoder( width_, height_ ), kf_q_weight_, extra_frame,
+                          reencoded.writer() );
+
+          return reencoded;
+        } );
+
+      last_final_state = final_state;
+      pending.push_back( PendingChunk { move( originals ), final_state,
+                                        previous_final_state, move( encoding ) } );
+    }
+
+    if ( pending.empty() ) {
+      break;
+    }
+
+    /* rebase the oldest chunk, which everything before it is done with */
+    PendingChunk & chunk = pending.front();
+    const MemoryIVF encoding = chunk.encoding.get();
+    const IVF encoding_ivf = encoding.reader();
+
+    if ( not chunk.previous_final_state.valid() ) {
+      for ( uint32_t i = 0; i < encoding_ivf.frame_count(); i++ ) {
+        output.append_frame( encoding_ivf.frame( i ) );
+      }
+
+      rebased_state = chunk.final_state.get();
+    }
+    else {
+      rebased_state = reencode_chunk( rebased_state, speed_, reencode_threads(),
+                                      chunk.originals, encoding_ivf,
+                                      chunk.previous_final_state.get(), kf_q_weight_, false,
+                                      output );
+    }
+
+    pending.pop_front();
+    chunk_count++;
+  }
+
+  return chunk_count;
+}
@@ -0,0 +1,90 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#ifndef CHUNKED_ENCODER_HH
+#define CHUNKED_ENCODER_HH
+
+/* ExCamera, in a single process. The input is cut into chunks that are
+   encoded independently, on several threads, each one starting with a key
+   frame. As soon as its predecessor is done, a chunk is re-encoded to start
+   from the state that the predecessor ends in, instead of a key frame. The
+   last step has to go in order: each chunk is rebased on the state that the
+   already rebased predecessor ends in, and appended to the output. Only the
+   originals of the chunks in flight are held, and the states and the
+   intermediate IVFs never leave memory. */
+
+#include <cstdint>
+#include <vector>
+
+#include "encoder.hh"
+#include "frame_input.hh"
+#include "ivf_writer.hh"
+#include "optional.hh"
+
+class ChunkedEncoder
+{
+private:
+  uint16_t width_, height_;
+  SpeedPreset speed_;
+
+  unsigned int frames_per_chunk_;
+  unsigned int thread_count_;
+
+  /* a constant quantizer, or else the minimum SSIM of every frame */
+  Optional<uint8_t> y_ac_qi_ {};
+  double minimum_ssim_ { 0.99 };
+
+  double kf_q_weight_ { 1.0 };
+  bool extra_frame_chunks_ { false };
+
+  Decoder encode_independently( const std::vector<RasterHandle> & originals,
+                                IVFWriter & output ) const;
+
+  unsigned int reencode_threads() const;
+
+public:
+  /* thread_count is how many chunks are encoded at once */
+  ChunkedEncoder( const uint16_t width, const uint16_t height,
+                  const SpeedPreset & speed,
+                  const unsigned int frames_per_chunk,
+                  const unsigned int thread_count );
+
+  void set_quantizer( const uint8_t y_ac_qi ) { y_ac_qi_ = Optional<uint8_t>( true, y_ac_qi ); }
+  void set_minimum_ssim( const double ssim ) { y_ac_qi_ = Optional<uint8_t>(); minimum_ssim_ = ssim; }
+  void set_kf_q_weight( const double weight ) { kf_q_weight_ = weight; }
+
+  /* every chunk but the first is encoded with the last original of its
+     predecessor in front of it, so that even its first frame gets to be
+     an inter frame when it's encoded independently */
+  void set_extra_frame_chunks( const bool enabled ) { extra_frame_chunks_ = enabled; }
+
+  /* encodes the rest of the input into output; returns the number of chunks */
+  unsigned int encode( FrameInput & input, IVFWriter & output );
+};
+
+#endif /* CHUNKED_ENCODER_HH */
@@ -198,6 +198,8 @@ void Costs::fill_mode_costs()
     }
   }
 
+  compute_cost( inter_bmode_costs, invariant_b_mode_probs, b_mode_tree );
+
   // fill mbmode_costs
   compute_cost( mbmode_costs.at( 0 ), kf_y_mode_probs, kf_y_mode_tree );
   compute_cost( mbmode_costs.at( 1 ), k_default_y_mode_probs, y_mode_tree );
@@ -205,6 +207,13 @@ void Costs::fill_mode_costs()
   // fill intra_uv_mode_costs
   compute_cost( intra_uv_mode_costs.at( 0 ), kf_uv_mode_probs, uv_mode_tree );
   compute_cost( intra_uv_mode_costs.at( 1 ), k_default_uv_mode_probs, uv_mode_tree );
+
+  // fill split_mv_costs and submv_ref_costs
+  compute_cost( split_mv_costs, split_mv_probs, split_mv_tree );
+
+  for ( size_t i = 0; i < submv_ref_costs.size(); i++ ) {
+    compute_cost( submv_ref_costs.at( i ), submv_ref_probs2.at( i ), submv_ref_tree );
+  }
 }
 
 /*
@@ -216,6 +225,34 @@ void Costs::fill_mv_ref_costs( const ProbabilityArray<num_mv_refs> & mv_mode_pro
   compute_cost( mbmode_costs.at( 1 ), mv_mode_probs, mv_ref_tree );
 }
 
+/*
+ * Based on libvpx:vp8/encoder/rdopt.c:vp8_calc_ref_frame_costs
+ */
+void Costs::fill_reference_frame_costs( const Probability prob_inter,
+                                        const Probability prob_last,
+                                        const Probability prob_golden )
+{
+  reference_frame_costs.at( CURRENT_FRAME ) = cost_zero( prob_inter );
+  reference_frame_costs.at( LAST_FRAME )    = cost_one( prob_inter ) + cost_zero( prob_last );
+  reference_frame_costs.at( GOLDEN_FRAME )  = cost_one( prob_inter ) + cost_one( prob_last )
+                                              + cost_zero( prob_golden );
+  reference_frame_costs.at( ALTREF_FRAME )  = cost_one( prob_inter ) + cost_one( prob_last )
+                                              + cost_one( prob_golden );
+}
+
+uint64_t Costs::branch_cost( const pair<uint32_t, uint32_t> & counts, const Probability prob )
+{
+  return static_cast<uint64_t>( counts.first ) * cost_zero( prob )
+         + static_cast<uint64_t>( counts.second ) * cost_one( prob );
+}
+
+uint32_t Costs::update_cost( const Probability update_prob, const bool update,
+                             const unsigned int value_bits )
+{
+  /* vp8_prob_cost is in 1/256 bits */
+  return cost_bit( update_prob, update ) + ( update ? value_bits * 256 : 0 );
+}
+
 /*
  * Taken from: libvpx:vp8/encoder/mcomp.c:29
  */
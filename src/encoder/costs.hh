@@ -49,14 +49,29 @@ public:
                       num_intra_b_modes>,
             num_intra_b_modes> bmode_costs;
 
+  /* interframes code the subblock modes without the above and left context */
+  SafeArray<uint16_t, num_intra_b_modes> inter_bmode_costs;
+
   SafeArray<SafeArray<uint16_t, num_uv_modes>, 2> intra_uv_mode_costs;
 
+  /* SPLITMV: the partitioning, and then the mode of each partition
+     (indexed by the same context as submv_ref_probs2) */
+  SafeArray<uint16_t, 4> split_mv_costs;
+  SafeArray<SafeArray<uint16_t, num_intra_b_modes + num_inter_b_modes>, 5> submv_ref_costs;
+
+  /* cost of signaling the reference frame of an inter-frame macroblock
+     (CURRENT_FRAME meaning that it's intra-coded) */
+  SafeArray<uint16_t, num_reference_frames> reference_frame_costs;
+
   void fill_token_costs( const ProbabilityTables & probability_tables );
 
   void fill_mode_costs();
   void fill_mv_ref_costs( const ProbabilityArray< num_mv_refs > & mv_ref_probs );
   void fill_mv_component_costs( const SafeArray<SafeArray<Probability, MV_PROB_CNT>, 2> & motion_vector_probs );
   void fill_mv_sad_costs();
+  void fill_reference_frame_costs( const Probability prob_inter,
+                                   const Probability prob_last,
+                                   const Probability prob_golden );
 
   uint32_t motion_vector_cost( const MotionVector & mv, size_t weight ) const;
   uint32_t sad_motion_vector_cost( const MotionVector & mv,
@@ -66,6 +81,16 @@ public:
   template<class Block>
   uint32_t block_cost( const Block & block ) const;
 
+  /* cost of taking a binary branch `counts.first` times one way (zero) and
+     `counts.second` times the other (one), with the given probability */
+  static uint64_t branch_cost( const std::pair<uint32_t, uint32_t> & counts,
+                               const Probability prob );
+
+  /* cost of the flag that says whether a probability is updated (coded with
+     `update_prob`), plus the `value_bits`-bit value that follows if it is */
+  static uint32_t update_cost( const Probability update_prob, const bool update,
+                               const unsigned int value_bits );
+
   static uint8_t token_for_coeff( int16_t coeff );
   static uint16_t coeff_base_cost( int16_t coeff );
 };
@@ -30,6 +30,7 @@
 
 #include "encoder.hh"
 #include "scorer.hh"
+#include "residual.hh"
 
 using namespace std;
 
@@ -167,12 +168,277 @@ void Encoder::update_decoder_state( const InterFrame & frame )
   } else {
     decoder_state_.filter_adjustments.clear();
   }
+
+  if ( frame.header().update_segmentation.initialized() ) {
+    if ( decoder_state_.segmentation.initialized() ) {
+      decoder_state_.segmentation.get().update( frame.header() );
+    } else {
+      decoder_state_.segmentation.initialize( frame.header(), width(), height() );
+    }
+  } else {
+    decoder_state_.segmentation.clear();
+  }
+
+  update_segmentation_map( frame );
+
+  reference_probs_ = { { frame.header().prob_inter,
+                         frame.header().prob_references_last,
+                         frame.header().prob_references_golden } };
+
+  if ( frame.header().refresh_golden_frame ) {
+    frames_since_golden_refresh_ = 0;
+  }
+  else {
+    frames_since_golden_refresh_++;
+  }
+
+  if ( intra_refresh_column_.initialized() ) {
+    const unsigned int next_column = intra_refresh_column_.get() + intra_refresh_width_;
+
+    if ( next_column < frame.macroblocks().width() ) {
+      intra_refresh_column_.reset( next_column );
+    }
+    else {
+      intra_refresh_column_.clear();
+    }
+  }
+
+  TokenBranchCounts token_branch_counts;
+  frame.macroblocks().forall(
+    [&] ( const InterFrameMacroblock & frame_mb ) { frame_mb.accumulate_token_branches( token_branch_counts ); }
+  );
+  last_token_branch_counts_ = make_shared<const TokenBranchCounts>( token_branch_counts );
+
+  vector<MotionVector> motion_field;
+  motion_field.reserve( frame.macroblocks().width() * frame.macroblocks().height() );
+
+  frame.macroblocks().forall(
+    [&] ( const InterFrameMacroblock & frame_mb )
+    {
+      motion_field.push_back( frame_mb.inter_coded() ? frame_mb.base_motion_vector()
+                                                     : MotionVector() );
+    }
+  );
+
+  motion_field_ = make_shared<const vector<MotionVector>>( move( motion_field ) );
+}
+
+/*
+ * The golden frame is refreshed periodically, which is what helps with static
+ * backgrounds and occlusions; on those frames, the previous golden frame is
+ * kept around as the altref, so there's always a reference that's older than
+ * the last refresh to fall back on. Otherwise, both are left alone.
+ */
+void Encoder::set_reference_updates( InterFrameHeader & header ) const
+{
+  if ( golden_refresh_interval_ > 0
+       and frames_since_golden_refresh_ + 1 >= golden_refresh_interval_ ) {
+    header.refresh_golden_frame = true;
+    header.copy_buffer_to_golden.clear();
+
+    header.refresh_alternate_frame = false;
+    header.copy_buffer_to_alternate.reset( 2 ); /* golden -> altref */
+  }
+  else {
+    header.refresh_golden_frame = false;
+    header.copy_buffer_to_golden.reset( 0 );
+
+    header.refresh_alternate_frame = false;
+    header.copy_buffer_to_alternate.reset( 0 );
+  }
+}
+
+void Encoder::restore_reference_probs( InterFrameHeader & header ) const
+{
+  header.prob_inter = reference_probs_.at( 0 );
+  header.prob_references_last = reference_probs_.at( 1 );
+  header.prob_references_golden = reference_probs_.at( 2 );
+}
+
+/*
+ * LAST is always searched. GOLDEN and ALTREF are only searched when they hold
+ * something that the references before them don't (right after a key frame,
+ * all three are the same raster). This also prepares the cost of signaling
+ * each reference, based on the probabilities in `header` (which are the ones
+ * from the last inter frame that this encoder wrote, if any; see
+ * restore_reference_probs), and downscales `raster` for the pyramid search.
+ */
+Encoder::MotionSearchContext Encoder::prepare_motion_search( const VP8Raster & raster,
+                                                             const InterFrameHeader & header )
+{
+  vector<reference_frame> search_references { LAST_FRAME };
+
+  if ( references_.golden != references_.last ) {
+    search_references.push_back( GOLDEN_FRAME );
+  }
+
+  if ( references_.alternative != references_.last
+       and references_.alternative != references_.golden ) {
+    search_references.push_back( ALTREF_FRAME );
+  }
+
+  auto prob_or_default = [] ( const uint8_t prob ) -> Probability { return prob ? prob : 128; };
+
+  costs().fill_reference_frame_costs( prob_or_default( header.prob_inter ),
+                                     prob_or_default( header.prob_references_last ),
+                                     prob_or_default( header.prob_references_golden ) );
+
+  const size_t mb_count = ( ( width() + 15 ) / 16 ) * ( ( height() + 15 ) / 16 );
+
+  vector<uint32_t> newmv_sads = ( newmv_sads_ and newmv_sads_->size() == mb_count )
+                                ? *newmv_sads_
+                                : vector<uint32_t>( mb_count, numeric_limits<uint32_t>::max() );
+
+  const FrameAnalysis * analysis = analysis_of( raster );
+
+  if ( analysis ) {
+    return { move( search_references ), shared_ptr<const LumaPyramid>( analysis_, &analysis->pyramid ),
+             analysis->motion_field, 0, 0, move( newmv_sads ) };
+  }
+
+  return { move( search_references ), make_shared<const LumaPyramid>( raster.Y() ), {}, 0, 0,
+           move( newmv_sads ) };
+}
+
+/* what the search found for this frame is what the next one starts from */
+void Encoder::finish_motion_search( MotionSearchContext & search )
+{
+  newmv_sads_ = make_shared<const vector<uint32_t>>( move( search.newmv_sads ) );
+}
+
+/*
+ * Compares the frame with the last one (see FrameComparison). If most of the
+ * macroblocks are better off intra-coded, the motion search would mostly be
+ * wasted, and the frame becomes a key frame. During an intra refresh cycle,
+ * only the columns that were already refreshed are looked at; the rest of the
+ * last frame is stale. If the lookahead already compared the frame with the
+ * original before it, that's what decides.
+ *
+ * Records the decision in encode_stats_.
+ */
+bool Encoder::scene_cut( const VP8Raster & raster )
+{
+  encode_stats_.scene_cut.clear();
+
+  if ( not has_state_ or not speed_.scene_cut_detection ) {
+    return false;
+  }
+
+  const FrameAnalysis * analysis = analysis_of( raster );
+  bool cut;
+
+  if ( analysis and analysis->comparison.initialized() and not intra_refresh_column_.initialized() ) {
+    cut = analysis->comparison.get().scene_cut();
+  }
+  else {
+    const shared_ptr<const LumaPyramid> source = analysis
+      ? shared_ptr<const LumaPyramid>( analysis_, &analysis->pyramid )
+      : make_shared<const LumaPyramid>( raster.Y() );
+
+    const unsigned int plane_width = intra_refresh_column_.initialized()
+                                     ? 4 * intra_refresh_column_.get()
+                                     : source->level( 2 ).width();
+
+    cut = FrameComparison( *source, safe_references_.pyramid( LAST_FRAME ), plane_width ).scene_cut();
+  }
+
+  encode_stats_.scene_cut.reset( cut );
+
+  if ( cut ) {
+    encode_stats_.sad_evaluations_per_mb.clear();
+  }
+
+  return cut;
+}
+
+/*
+ * Looks for a new motion vector on the downscaled planes: every vector within
+ * speed_.pyramid_search_range pixels of each of the `seeds` is tried at quarter
+ * resolution, and the best one is then refined by a pixel in each direction at
+ * half resolution. SADs are scaled up to make them comparable with the motion
+ * vector cost, which is relative to `base_mv`, like the one for NEWMV.
+ *
+ * The result is a full-pixel motion vector (not relative to `base_mv`).
+ */
+MotionVector Encoder::pyramid_search( const LumaPyramid & source,
+                                      const LumaPyramid & reference,
+                                      const unsigned int mb_column,
+                                      const unsigned int mb_row,
+                                      const vector<MotionVector> & seeds,
+                                      const MotionVector & base_mv,
+                                      const size_t y_ac_qi ) const
+{
+  /* (x, y) in pixels of the given level */
+  typedef pair<int, int> Displacement;
+
+  auto search =
+    [&] ( const unsigned int level, const Displacement & center, const int range,
+          Displacement & best, uint32_t & best_cost )
+    {
+      const unsigned int size = 16 >> level;
+      const int scale = 8 << level; /* 1/8-pixel units per pixel */
+
+      for ( int dy = center.second - range; dy <= center.second + range; dy++ ) {
+        for ( int dx = center.first - range; dx <= center.first + range; dx++ ) {
+          if ( abs( dx * scale ) > 1023 or abs( dy * scale ) > 1023 ) {
+            continue;
+          }
+
+          const Optional<uint32_t> distortion =
+            source.sad( reference, level, size, mb_column * size, mb_row * size, dx, dy );
+
+          if ( not distortion.initialized() ) {
+            continue;
+          }
+
+          const MotionVector mv( dx * scale, dy * scale );
+          const uint32_t cost =
+            rdcost( costs().sad_motion_vector_cost( mv, base_mv, sad_per_bit16lut[ y_ac_qi ] ),
+                    distortion.get() << ( 2 * level ), 1, 1 );
+
+          if ( cost < best_cost ) {
+            best_cost = cost;
+            best = { dx, dy };
+          }
+        }
+      }
+    };
+
+  auto to_quarter_pixels =
+    [] ( const int16_t v ) -> int { return ( v + ( v < 0 ? -16 : 16 ) ) / 32; };
+
+  vector<Displacement> centers;
+
+  for ( const MotionVector & seed : seeds ) {
+    const Displacement center { to_quarter_pixels( seed.x() ), to_quarter_pixels( seed.y() ) };
+
+    if ( find( centers.begin(), centers.end(), center ) == centers.end() ) {
+      centers.push_back( center );
+    }
+  }
+
+  Displacement best { 0, 0 };
+  uint32_t best_cost = numeric_limits<uint32_t>::max();
+
+  for ( const Displacement & center : centers ) {
+    search( 2, center, speed_.pyramid_search_range, best, best_cost );
+  }
+
+  if ( best_cost == numeric_limits<uint32_t>::max() ) {
+    return base_mv; /* none of the candidates fit inside the reference */
+  }
+
+  const Displacement half_center { 2 * best.first, 2 * best.second };
+
+  best = half_center;
+  best_cost = numeric_limits<uint32_t>::max();
+  search( 1, half_center, 1, best, best_cost );
+
+  return MotionVector( best.first * 16, best.second * 16 );
 }
 
 Encoder::MVSearchResult Encoder::diamond_search( const VP8Raster::Macroblock & original_mb,
-                                                 VP8Raster::Macroblock & temp_mb,
                                                  InterFrameMacroblock & frame_mb,
-                                                 const VP8Raster & reference,
                                                  const SafeRaster & safe_reference,
                                                  MotionVector base_mv,
                                                  MotionVector origin,
@@ -180,36 +446,76 @@ Encoder::MVSearchResult Encoder::diamond_search( const VP8Raster::Macroblock & o
                                                  const size_t y_ac_qi ) const
 {
   size_t first_step = step_size / 2;
-
-  auto reference_mb = reference.macroblock( original_mb.Y.column(),
-                                            original_mb.Y.row() );
-
-  TwoDSubRange<uint8_t, 16, 16> & prediction = temp_mb.Y.mutable_contents();
+  uint32_t distortion = numeric_limits<uint32_t>::max();
+  size_t sad_evaluations = 0;
 
   base_mv = Scorer::clamp( base_mv, frame_mb.context() );
 
   constexpr array<array<int16_t, 2>, 5> check_sites = {{
     { -1, 0 }, { 0, -1 }, { 0, 0 }, { 0, 1 }, { 1, 0 }
   }};
+  constexpr size_t center = 2;
+
+  /* after the first step, the center is the previous step's best vector and
+     its SAD is already known; the other sites go to the kernel four at a time */
+  bool center_known = false;
 
   while ( step_size > 1 ) {
-    MBPredictionData best_pred;
-    MBPredictionData pred;
+    SafeArray<MotionVector, check_sites.size()> site_mvs;
+    SafeArray<bool, check_sites.size()> in_bounds;
+    SafeArray<uint32_t, check_sites.size()> distortions;
+
+    SafeArray<MotionVector, 4> batch;
+    SafeArray<size_t, 4> batch_sites;
+    unsigned int batch_size = 0;
+
+    auto flush_batch =
+      [&] ()
+      {
+        const SafeArray<uint32_t, 4> sads = subpixel_sad_x4( original_mb.Y, safe_reference,
+                                                             batch, batch_size );
+
+        for ( unsigned int i = 0; i < batch_size; i++ ) {
+          distortions.at( batch_sites.at( i ) ) = sads.at( i );
+        }
+
+        sad_evaluations += batch_size;
+        batch_size = 0;
+      };
+
+    for ( size_t site = 0; site < check_sites.size(); site++ ) {
+      site_mvs.at( site ) = origin + MotionVector( step_size * check_sites[ site ][ 0 ],
+                                                   step_size * check_sites[ site ][ 1 ] );
+      in_bounds.at( site ) = not out_of_bounds( site_mvs.at( site ) );
+
+      if ( not in_bounds.at( site ) ) continue;
+
+      if ( site == center and center_known ) {
+        distortions.at( site ) = distortion;
+        continue;
+      }
+
+      batch.at( batch_size ) = Scorer::clamp( site_mvs.at( site ) + base_mv, frame_mb.context() );
+      batch_sites.at( batch_size ) = site;
 
-    for ( const auto & check_site : check_sites ) {
-      pred.mv = MotionVector();
-      MotionVector direction( step_size * check_site[ 0 ],
-                              step_size * check_site[ 1 ] );
+      if ( ++batch_size == batch.size() ) {
+        flush_batch();
+      }
+    }
 
-      pred.mv += origin + direction;
+    if ( batch_size > 0 ) {
+      flush_batch();
+    }
 
-      if ( out_of_bounds( pred.mv ) ) continue;
+    MBPredictionData best_pred;
+    MBPredictionData pred;
 
-      MotionVector this_mv( Scorer::clamp( pred.mv + base_mv, frame_mb.context() ) );
+    for ( size_t site = 0; site < check_sites.size(); site++ ) {
+      if ( not in_bounds.at( site ) ) continue;
 
-      reference_mb.Y().inter_predict( this_mv, safe_reference, prediction );
-      pred.distortion = sad( original_mb.Y, prediction );
-      pred.rate = costs_.sad_motion_vector_cost( pred.mv, MotionVector(), sad_per_bit16lut[ y_ac_qi ] );
+      pred.mv = site_mvs.at( site );
+      pred.distortion = distortions.at( site );
+      pred.rate = costs().sad_motion_vector_cost( pred.mv, MotionVector(), sad_per_bit16lut[ y_ac_qi ] );
       pred.cost = rdcost( pred.rate, pred.distortion, 1, 1 );
 
       if ( pred.cost < best_pred.cost  ) {
@@ -222,10 +528,319 @@ Encoder::MVSearchResult Encoder::diamond_search( const VP8Raster::Macroblock & o
     }
 
     origin = best_pred.mv;
+    distortion = best_pred.distortion;
     step_size /= 2;
+
+    center_known = ( best_pred.cost != numeric_limits<uint32_t>::max() );
+  }
+
+  return { origin, first_step, distortion, sad_evaluations };
+}
+
+/*
+ * The diamond search only looks at the four axial neighbours of its origin and
+ * ranks them by SAD. Once it has converged, this refines the vector by looking
+ * at all eight neighbours at half- and then quarter-pixel distance, scoring the
+ * interpolated predictions the same way the mode decision does (variance and
+ * motion vector cost), and moving as long as that keeps improving.
+ *
+ * `origin` is relative to `base_mv`, and so is the result.
+ */
+MotionVector Encoder::subpixel_search( const VP8Raster::Macroblock & original_mb,
+                                       InterFrameMacroblock & frame_mb,
+                                       const SafeRaster & safe_reference,
+                                       const MotionVector & base_mv,
+                                       MotionVector origin ) const
+{
+  constexpr array<array<int16_t, 2>, 8> check_sites = {{
+    { -1, -1 }, { 0, -1 }, { 1, -1 },
+    { -1,  0 },            { 1,  0 },
+    { -1,  1 }, { 0,  1 }, { 1,  1 }
+  }};
+
+  auto evaluate =
+    [&] ( const MotionVector & mv ) -> uint32_t
+    {
+      const MotionVector this_mv = mv + base_mv;
+
+      if ( out_of_bounds( mv ) or
+           not ( Scorer::clamp( this_mv, frame_mb.context() ) == this_mv ) ) {
+        return numeric_limits<uint32_t>::max();
+      }
+
+      return rdcost( costs().motion_vector_cost( mv, 96 ),
+                     subpixel_variance( original_mb.Y, safe_reference, this_mv ),
+                     RATE_MULTIPLIER, DISTORTION_MULTIPLIER );
+    };
+
+  uint32_t best_cost = evaluate( origin );
+
+  /* motion vectors are in 1/8 pixel units; luma only uses even ones */
+  for ( int16_t step_size : { 4, 2 } ) {
+    for ( size_t iteration = 0; iteration < speed_.subpixel_search_iterations; iteration++ ) {
+      MotionVector best_mv = origin;
+
+      for ( const auto & check_site : check_sites ) {
+        const MotionVector candidate = origin + MotionVector( step_size * check_site[ 0 ],
+                                                              step_size * check_site[ 1 ] );
+        const uint32_t cost = evaluate( candidate );
+
+        if ( cost < best_cost ) {
+          best_cost = cost;
+          best_mv = candidate;
+        }
+      }
+
+      if ( best_mv == origin ) {
+        break;
+      }
+
+      origin = best_mv;
+    }
+  }
+
+  return origin;
+}
+
+/*
+ * Finds the cheapest way of coding the macroblock with SPLITMV, among the
+ * partitionings enabled in the speed preset. Partitions are visited in
+ * bitstream order, and each one takes whichever of LEFT4X4, ABOVE4X4, ZERO4X4
+ * and NEW4X4 has the lowest rd-cost. NEW4X4 starts from `new_mv` (the
+ * whole-macroblock vector) or `best_ref`, and, if split_mv_refinement is set,
+ * is refined with a small diamond that only looks at the pixels of the
+ * partition.
+ *
+ * There's no Y2 block with SPLITMV, so the distortion is the plain SSE. The
+ * rate doesn't include the mode and reference costs, as for the other inter
+ * modes. The prediction for the best partitioning is left in `temp_mb.Y`.
+ */
+Encoder::SplitMVSearchResult Encoder::split_mv_search( const VP8Raster::Macroblock & original_mb,
+                                                      VP8Raster::Macroblock & temp_mb,
+                                                      InterFrameMacroblock & frame_mb,
+                                                      const SafeRaster & safe_reference,
+                                                      const MotionVector & best_ref,
+                                                      const MotionVector & new_mv )
+{
+  typedef vector<pair<uint8_t, uint8_t>> Partition;
+
+  auto partition_distortion =
+    [&] ( const Partition & partition, const MotionVector & mv ) -> uint32_t
+    {
+      uint32_t distortion = 0;
+
+      for ( const auto & sb : partition ) {
+        auto & temp_sb = temp_mb.Y_sub_at( sb.first, sb.second );
+        original_mb.Y_sub_at( sb.first, sb.second ).inter_predict( mv, safe_reference,
+                                                                    temp_sb.mutable_contents() );
+        distortion += sse( original_mb.Y_sub_at( sb.first, sb.second ), temp_sb.contents() );
+      }
+
+      return distortion;
+    };
+
+  auto new_mv_cost =
+    [&] ( const Partition & partition, const MotionVector & mv, const uint16_t mode_cost ) -> uint32_t
+    {
+      if ( out_of_bounds( mv - best_ref ) ) {
+        return numeric_limits<uint32_t>::max();
+      }
+
+      return rdcost( mode_cost + costs().motion_vector_cost( mv - best_ref, 96 ),
+                     partition_distortion( partition, mv ),
+                     RATE_MULTIPLIER, DISTORTION_MULTIPLIER );
+    };
+
+  constexpr array<array<int16_t, 2>, 4> check_sites = {{
+    { -1, 0 }, { 0, -1 }, { 0, 1 }, { 1, 0 }
+  }};
+
+  SplitMVSearchResult best_result;
+
+  /* the search uses the subblocks of frame_mb as the context of the partitions
+     that follow, but they might be holding the modes of the B_PRED candidate,
+     which we have to leave alone */
+  SafeArray<SafeArray<bmode, 4>, 4> saved_modes;
+  SafeArray<SafeArray<MotionVector, 4>, 4> saved_motion_vectors;
+
+  frame_mb.Y().forall_ij(
+    [&] ( const YBlock & frame_sb, unsigned int sb_column, unsigned int sb_row )
+    {
+      saved_modes.at( sb_row ).at( sb_column ) = frame_sb.prediction_mode();
+      saved_motion_vectors.at( sb_row ).at( sb_column ) = frame_sb.motion_vector();
+    }
+  );
+  best_result.pred.prediction_mode = SPLITMV;
+
+  for ( uint8_t partition_id = 0; partition_id < mv_partitions.size(); partition_id++ ) {
+    if ( not ( speed_.split_mv_partitionings & ( 1 << partition_id ) ) ) {
+      continue;
+    }
+
+    uint32_t rate = costs().split_mv_costs.at( partition_id );
+    uint32_t distortion = 0;
+
+    for ( const Partition & partition : mv_partitions.at( partition_id ) ) {
+      YBlock & first_sb = frame_mb.Y().at( partition.front().first, partition.front().second );
+
+      const MotionVector default_mv;
+      const MotionVector & left_mv = first_sb.context().left.initialized()
+        ? first_sb.context().left.get()->motion_vector() : default_mv;
+      const MotionVector & above_mv = first_sb.context().above.initialized()
+        ? first_sb.context().above.get()->motion_vector() : default_mv;
+
+      /* see YBlock::write_subblock_inter_prediction */
+      uint8_t submv_ref_index = 0;
+
+      if ( left_mv == above_mv and left_mv.empty() ) {
+        submv_ref_index = 4;
+      } else if ( left_mv == above_mv ) {
+        submv_ref_index = 3;
+      } else if ( above_mv.empty() ) {
+        submv_ref_index = 2;
+      } else if ( left_mv.empty() ) {
+        submv_ref_index = 1;
+      }
+
+      const auto & mode_costs = costs().submv_ref_costs.at( submv_ref_index );
+
+      bmode best_mode = ZERO4X4;
+      MotionVector best_mv;
+      uint32_t best_cost = numeric_limits<uint32_t>::max();
+
+      for ( const bmode mode : { LEFT4X4, ABOVE4X4, ZERO4X4 } ) {
+        const MotionVector mv = ( mode == LEFT4X4 ) ? left_mv
+                              : ( mode == ABOVE4X4 ) ? above_mv
+                              : MotionVector();
+
+        const uint32_t cost = rdcost( mode_costs.at( mode ), partition_distortion( partition, mv ),
+                                      RATE_MULTIPLIER, DISTORTION_MULTIPLIER );
+
+        if ( cost < best_cost ) {
+          best_mode = mode;
+          best_mv = mv;
+          best_cost = cost;
+        }
+      }
+
+      /* NEW4X4 */
+      MotionVector origin = new_mv;
+      uint32_t origin_cost = new_mv_cost( partition, origin, mode_costs.at( NEW4X4 ) );
+
+      if ( not ( new_mv == best_ref ) ) {
+        const uint32_t cost = new_mv_cost( partition, best_ref, mode_costs.at( NEW4X4 ) );
+
+        if ( cost < origin_cost ) {
+          origin = best_ref;
+          origin_cost = cost;
+        }
+      }
+
+      if ( speed_.split_mv_refinement ) {
+        for ( int16_t step_size : { 8, 4, 2 } ) {
+          for ( bool moved = true; moved; ) {
+            moved = false;
+
+            for ( const auto & check_site : check_sites ) {
+              const MotionVector candidate = origin + MotionVector( step_size * check_site[ 0 ],
+                                                                    step_size * check_site[ 1 ] );
+              const uint32_t cost = new_mv_cost( partition, candidate, mode_costs.at( NEW4X4 ) );
+
+              if ( cost < origin_cost ) {
+                origin = candidate;
+                origin_cost = cost;
+                moved = true;
+              }
+            }
+          }
+        }
+      }
+
+      if ( origin_cost < best_cost ) {
+        best_mode = NEW4X4;
+        best_mv = origin;
+        best_cost = origin_cost;
+      }
+
+      /* the partitions that follow use this one as their context */
+      for ( const auto & sb : partition ) {
+        YBlock & frame_sb = frame_mb.Y().at( sb.first, sb.second );
+        frame_sb.set_prediction_mode( best_mode );
+        frame_sb.set_motion_vector( best_mv );
+      }
+
+      rate += mode_costs.at( best_mode );
+
+      if ( best_mode == NEW4X4 ) {
+        rate += costs().motion_vector_cost( best_mv - best_ref, 96 );
+      }
+
+      distortion += partition_distortion( partition, best_mv );
+    }
+
+    const uint32_t cost = rdcost( rate, distortion, RATE_MULTIPLIER, DISTORTION_MULTIPLIER );
+
+    if ( cost < best_result.pred.cost ) {
+      best_result.pred.rate = rate;
+      best_result.pred.distortion = distortion;
+      best_result.pred.cost = cost;
+      best_result.partition_id = partition_id;
+
+      frame_mb.Y().forall_ij(
+        [&] ( const YBlock & frame_sb, unsigned int sb_column, unsigned int sb_row )
+        {
+          best_result.modes.at( sb_row ).at( sb_column ) = frame_sb.prediction_mode();
+          best_result.motion_vectors.at( sb_row ).at( sb_column ) = frame_sb.motion_vector();
+        }
+      );
+    }
+  }
+
+  if ( best_result.pred.cost != numeric_limits<uint32_t>::max() ) {
+    temp_mb.Y_sub_forall_ij(
+      [&] ( VP8Raster::Block4 & temp_sb, unsigned int sb_column, unsigned int sb_row )
+      {
+        original_mb.Y_sub_at( sb_column, sb_row ).inter_predict( best_result.motion_vectors.at( sb_row ).at( sb_column ),
+                                                                 safe_reference, temp_sb.mutable_contents() );
+      }
+    );
   }
 
-  return { origin, first_step };
+  frame_mb.Y().forall_ij(
+    [&] ( YBlock & frame_sb, unsigned int sb_column, unsigned int sb_row )
+    {
+      frame_sb.set_prediction_mode( saved_modes.at( sb_row ).at( sb_column ) );
+      frame_sb.set_motion_vector( saved_motion_vectors.at( sb_row ).at( sb_column ) );
+    }
+  );
+
+  return best_result;
+}
+
+/*
+ * A static macroblock (think of the background of a video call) would end up
+ * as ZEROMV from LAST_FRAME after the whole search anyway, as nothing else can
+ * code it in fewer bits. Transforming its residual is cheap, since the blocks
+ * that are too small to survive quantization aren't transformed at all.
+ */
+bool Encoder::static_macroblock( const VP8Raster::Macroblock & original_mb,
+                                 const Quantizer & quantizer ) const
+{
+  const auto reference_mb = references_.at( LAST_FRAME ).macroblock( original_mb.Y.column(),
+                                                                     original_mb.Y.row() );
+
+  const MacroblockTransform transform( quantizer );
+  MacroblockResidual residual;
+
+  transform.luma( original_mb, reference_mb.macroblock(), true, residual );
+
+  if ( residual.Y_nonzero or residual.Y2_nonzero ) {
+    return false;
+  }
+
+  transform.chroma( original_mb, reference_mb.macroblock(), residual );
+
+  return not ( residual.U_nonzero or residual.V_nonzero );
 }
 
 void Encoder::luma_mb_inter_predict( const VP8Raster::Macroblock & original_mb,
@@ -234,25 +849,43 @@ void Encoder::luma_mb_inter_predict( const VP8Raster::Macroblock & original_mb,
                                      InterFrameMacroblock & frame_mb,
                                      const Quantizer & quantizer,
                                      MVComponentCounts & /* component_counts */,
+                                     MotionSearchContext & search,
                                      const size_t y_ac_qi,
                                      const EncoderPass encoder_pass )
 {
+  if ( speed_.static_skip and static_macroblock( original_mb, quantizer ) ) {
+    search.macroblocks++;
+
+    frame_mb.mutable_header().is_inter_mb = true;
+    frame_mb.mutable_header().set_reference( LAST_FRAME );
+    frame_mb.mutable_header().partition_id.clear();
+
+    const auto reference_mb = references_.at( LAST_FRAME ).macroblock( original_mb.Y.column(),
+                                                                       original_mb.Y.row() );
+    reconstructed_mb.Y.mutable_contents().copy_from( reference_mb.macroblock().Y.contents() );
+
+    luma_mb_apply_inter_prediction( original_mb, reconstructed_mb, frame_mb,
+                                    quantizer, ZEROMV, MotionVector() );
+    return;
+  }
+
   MBPredictionData best_pred;
 
   best_pred = luma_mb_best_prediction_mode( original_mb, reconstructed_mb, temp_mb,
                                             frame_mb, quantizer, encoder_pass, true );
 
-  reference_frame frame_ref = LAST_FRAME;
+  best_pred.rate += costs().reference_frame_costs.at( CURRENT_FRAME );
+  best_pred.cost = rdcost( best_pred.rate, best_pred.distortion, RATE_MULTIPLIER,
+                           DISTORTION_MULTIPLIER );
 
+  /* the census doesn't depend on the reference, as we never set the sign bias
+     for golden or altref */
   frame_mb.mutable_header().is_inter_mb = true;
-  frame_mb.mutable_header().set_reference( frame_ref );
+  frame_mb.mutable_header().set_reference( LAST_FRAME );
 
   MotionVector best_mv;
-  const VP8Raster & reference = references_.at( frame_ref );
-  const SafeRaster & safe_reference = safe_references_.get( frame_ref );
-
-  const auto reference_mb = reference.macroblock( original_mb.Y.column(),
-                                                  original_mb.Y.row() );
+  reference_frame best_frame_ref = LAST_FRAME;
+  SplitMVSearchResult best_split;
 
   TwoDSubRange<uint8_t, 16, 16> & prediction = temp_mb.Y.mutable_contents();
 
@@ -264,103 +897,286 @@ void Encoder::luma_mb_inter_predict( const VP8Raster::Macroblock & original_mb,
                                                           mv_counts_to_probs.at( counts.at( 2 ) ).at( 2 ),
                                                           mv_counts_to_probs.at( counts.at( 3 ) ).at( 3 ) }};
 
-  costs_.fill_mv_ref_costs( mv_ref_probs );
-
-  constexpr array<mbmode, 4> inter_modes = { ZEROMV, NEARESTMV, NEARMV, NEWMV, /* SPLIMV */ };
+  costs().fill_mv_ref_costs( mv_ref_probs );
 
-  for ( const mbmode prediction_mode : inter_modes ) {
-    MBPredictionData pred;
-    pred.prediction_mode = prediction_mode;
-    MotionVector mv;
-
-    switch ( prediction_mode ) {
-    case NEWMV:
-      /* In the case of REALTIME_QUALITY, we should limit the number of times
-       * that we search for a new motion vector.
-       */
-      if ( encode_quality_ == REALTIME_QUALITY ) {
-        if ( not ( frame_mb.context().column % 4 == 0 and frame_mb.context().row % 4 == 0 ) ) {
-          continue;
-        }
-      }
+  constexpr array<mbmode, 5> inter_modes = { ZEROMV, NEARESTMV, NEARMV, NEWMV, SPLITMV };
 
-      for ( int step = 512; step > 1; ) {
-        MVSearchResult result = diamond_search( original_mb, temp_mb, frame_mb,
-                                                reference, safe_reference,
-                                                best_ref, mv, step, y_ac_qi );
+  const unsigned int mb_column = original_mb.Y.column();
+  const unsigned int mb_row = original_mb.Y.row();
 
-        if ( result.mv == mv ) {
-          break; // there's no need to continue the search
-        }
+  const size_t mb_width = ( width() + 15 ) / 16;
+  const size_t mb_index = mb_row * mb_width + mb_column;
 
-        mv = result.mv;
-        step = result.first_step;
-      }
+  /* the likeliest new motion vectors: the census, the vectors of the left,
+     above and above-right macroblocks (the census doesn't see the last one),
+     this macroblock in the last frame, where the lookahead saw it move from
+     the last original, and zero */
+  vector<MotionVector> predictors { best_ref, census.nearest(), census.near() };
 
-      mv += best_ref;
+  for ( const auto & neighbour : { frame_mb.context().left, frame_mb.context().above,
+                                   frame_mb.context().above_right } ) {
+    if ( neighbour.initialized() and neighbour.get()->inter_coded() ) {
+      predictors.push_back( neighbour.get()->base_motion_vector() );
+    }
+  }
 
-      if ( mv.empty() ) {
-        continue;
-      }
+  if ( motion_field_ and mb_index < motion_field_->size() ) {
+    predictors.push_back( motion_field_->at( mb_index ) );
+  }
 
-      break;
+  if ( mb_index < search.source_motion_field.size() ) {
+    predictors.push_back( search.source_motion_field.at( mb_index ) );
+  }
 
-    case NEARESTMV:
-    case NEARMV:
-      mv = Scorer::clamp( ( prediction_mode == NEARMV ) ? census.near() : census.nearest(),
-                          frame_mb.context() );
+  predictors.push_back( MotionVector() );
 
-      if ( mv.empty() ) {
-        // Same as ZEROMV
-        continue;
-      }
+  /* a predictor is good enough if it does about as well as what was found for
+     the neighbours (and for this macroblock in the last frame) */
+  const vector<uint32_t> & newmv_sads = search.newmv_sads;
+  uint32_t neighbour_sad = newmv_sads.at( mb_index );
 
-      break;
+  if ( mb_column > 0 ) {
+    neighbour_sad = min( neighbour_sad, newmv_sads.at( mb_index - 1 ) );
+  }
 
-    case ZEROMV:
-      mv = MotionVector();
-      break;
+  if ( mb_row > 0 ) {
+    neighbour_sad = min( neighbour_sad, newmv_sads.at( mb_index - mb_width ) );
 
-    default:
-      throw runtime_error( "not supported" );
+    if ( mb_column + 1 < mb_width ) {
+      neighbour_sad = min( neighbour_sad, newmv_sads.at( mb_index - mb_width + 1 ) );
     }
+  }
 
-    reference_mb.macroblock().Y.inter_predict( mv, safe_reference, prediction );
+  uint32_t early_termination_sad = MIN_EARLY_TERMINATION_SAD;
 
-    pred.distortion = variance( original_mb.Y, prediction );
-    pred.rate = costs_.mbmode_costs.at( 1 ).at( prediction_mode );
+  if ( neighbour_sad != numeric_limits<uint32_t>::max() ) {
+    early_termination_sad = neighbour_sad + neighbour_sad / 4;
 
-    if ( prediction_mode == NEWMV ) {
-      pred.rate += costs_.motion_vector_cost( mv - best_ref, 96 );
+    if ( early_termination_sad < MIN_EARLY_TERMINATION_SAD ) {
+      early_termination_sad = MIN_EARLY_TERMINATION_SAD;
+    }
+    else if ( early_termination_sad > MAX_EARLY_TERMINATION_SAD ) {
+      early_termination_sad = MAX_EARLY_TERMINATION_SAD;
     }
+  }
+
+  search.macroblocks++;
+
+  for ( const reference_frame frame_ref : search.references ) {
+    const VP8Raster & reference = references_.at( frame_ref );
+    const SafeRaster & safe_reference = safe_references_.get( frame_ref );
+
+    const auto reference_mb = reference.macroblock( original_mb.Y.column(),
+                                                    original_mb.Y.row() );
+
+    /* where SPLITMV starts looking for new vectors */
+    MotionVector new_mv = best_ref;
+
+    for ( const mbmode prediction_mode : inter_modes ) {
+      MBPredictionData pred;
+      pred.prediction_mode = prediction_mode;
+      MotionVector mv;
+
+      switch ( prediction_mode ) {
+      case SPLITMV:
+        {
+          if ( speed_.split_mv_partitionings == 0
+               or ( not speed_.long_term_new_mvs and frame_ref != LAST_FRAME ) ) {
+            continue;
+          }
+
+          SplitMVSearchResult split = split_mv_search( original_mb, temp_mb, frame_mb,
+                                                       safe_reference, best_ref, new_mv );
+
+          if ( split.pred.cost == numeric_limits<uint32_t>::max() ) {
+            continue;
+          }
+
+          split.pred.rate += costs().mbmode_costs.at( 1 ).at( SPLITMV )
+                             + costs().reference_frame_costs.at( frame_ref );
+          split.pred.cost = rdcost( split.pred.rate, split.pred.distortion, RATE_MULTIPLIER,
+                                    DISTORTION_MULTIPLIER );
+
+          if ( split.pred.cost < best_pred.cost ) {
+            best_frame_ref = frame_ref;
+            best_pred = split.pred;
+            best_split = split;
+            reconstructed_mb.Y.mutable_contents().copy_from( prediction );
+          }
+        }
+
+        continue;
+
+      case NEWMV:
+        /* In the faster presets, the long-term references are only tried
+         * with the motion vectors that we already know about.
+         */
+        if ( not speed_.long_term_new_mvs and frame_ref != LAST_FRAME ) {
+          continue;
+        }
+
+        {
+          /* the predictors come first; if the best of them is good enough, we
+             stop there, otherwise the pyramid search gets to propose one more
+             vector and the diamond search refines the winner */
+          MVSearchResult best_result { MotionVector(), 0, numeric_limits<uint32_t>::max(), 0 };
+          uint32_t best_cost = numeric_limits<uint32_t>::max();
+
+          auto try_predictor =
+            [&] ( const MotionVector & predictor )
+            {
+              const MotionVector candidate = Scorer::clamp( predictor, frame_mb.context() ) - best_ref;
+
+              if ( out_of_bounds( candidate ) ) {
+                return;
+              }
+
+              const uint32_t sad = subpixel_sad( original_mb.Y, safe_reference, candidate + best_ref );
+              const uint32_t cost = rdcost( costs().sad_motion_vector_cost( candidate, MotionVector(),
+                                                                           sad_per_bit16lut[ y_ac_qi ] ),
+                                            sad, 1, 1 );
+              search.sad_evaluations++;
+
+              if ( cost < best_cost ) {
+                best_cost = cost;
+                best_result.mv = candidate;
+                best_result.distortion = sad;
+              }
+            };
+
+          if ( speed_.predictor_search ) {
+            vector<MotionVector> tried;
+
+            for ( const MotionVector & predictor : predictors ) {
+              if ( find( tried.begin(), tried.end(), predictor ) == tried.end() ) {
+                tried.push_back( predictor );
+                try_predictor( predictor );
+              }
+            }
+          }
+
+          const bool terminated_early = best_result.distortion < early_termination_sad;
+
+          if ( not terminated_early ) {
+            try_predictor( pyramid_search( *search.pyramid, safe_references_.pyramid( frame_ref ),
+                                           mb_column, mb_row, predictors, best_ref, y_ac_qi ) );
+
+            for ( int step = 8; step > 1; ) {
+              MVSearchResult result = diamond_search( original_mb, frame_mb, safe_reference,
+                                                      best_ref, best_result.mv, step, y_ac_qi );
+              search.sad_evaluations += result.sad_evaluations;
+
+              if ( result.mv == best_result.mv ) {
+                break; // there's no need to continue the search
+              }
+
+              best_result = result;
+              step = result.first_step;
+            }
+          }
+
+          if ( frame_ref == LAST_FRAME ) {
+            search.newmv_sads.at( mb_index ) = best_result.distortion;
+          }
+
+          mv = best_result.mv;
+
+          /* a predictor that was good enough can still be refined, if we can
+             afford it */
+          if ( speed_.subpixel_search_iterations > 0
+               and ( not terminated_early or speed_.refine_early_termination ) ) {
+            mv = subpixel_search( original_mb, frame_mb, safe_reference, best_ref, mv );
+          }
+
+          mv += best_ref;
+          new_mv = mv;
+
+          if ( mv.empty() ) {
+            continue;
+          }
+        }
+
+        break;
+
+      case NEARESTMV:
+      case NEARMV:
+        mv = Scorer::clamp( ( prediction_mode == NEARMV ) ? census.near() : census.nearest(),
+                            frame_mb.context() );
+
+        if ( mv.empty() ) {
+          // Same as ZEROMV
+          continue;
+        }
+
+        break;
+
+      case ZEROMV:
+        mv = MotionVector();
+        break;
+
+      default:
+        throw runtime_error( "not supported" );
+      }
+
+      reference_mb.macroblock().Y.inter_predict( mv, safe_reference, prediction );
+
+      pred.distortion = variance( original_mb.Y, prediction );
+      pred.rate = costs().mbmode_costs.at( 1 ).at( prediction_mode )
+                  + costs().reference_frame_costs.at( frame_ref );
+
+      if ( prediction_mode == NEWMV ) {
+        pred.rate += costs().motion_vector_cost( mv - best_ref, 96 );
+      }
 
-    /* chroma_mb_inter_predict( original_mb, reconstructed_mb, temp_mb, frame_mb,
-                             quantizer, encoder_pass );
+      /* chroma_mb_inter_predict( original_mb, reconstructed_mb, temp_mb, frame_mb,
+                               quantizer, encoder_pass );
 
-    pred.distortion += sse( original_mb.U, reconstructed_mb.U.contents() );
-    pred.distortion += sse( original_mb.V, reconstructed_mb.V.contents() ); */
+      pred.distortion += sse( original_mb.U, reconstructed_mb.U.contents() );
+      pred.distortion += sse( original_mb.V, reconstructed_mb.V.contents() ); */
 
-    pred.cost = rdcost( pred.rate, pred.distortion, RATE_MULTIPLIER,
-                        DISTORTION_MULTIPLIER );
+      pred.cost = rdcost( pred.rate, pred.distortion, RATE_MULTIPLIER,
+                          DISTORTION_MULTIPLIER );
 
-    if ( pred.cost < best_pred.cost ) {
-      best_mv = mv;
-      best_pred = pred;
-      reconstructed_mb.Y.mutable_contents().copy_from( prediction );
+      if ( pred.cost < best_pred.cost ) {
+        best_mv = mv;
+        best_frame_ref = frame_ref;
+        best_pred = pred;
+        reconstructed_mb.Y.mutable_contents().copy_from( prediction );
+      }
     }
   }
 
+  frame_mb.mutable_header().partition_id.clear();
+
   if ( best_pred.prediction_mode <= B_PRED ) {
     frame_mb.mutable_header().is_inter_mb = false;
     frame_mb.mutable_header().set_reference( CURRENT_FRAME );
 
+    /* neighbouring SPLITMV macroblocks see these as their left or above
+       vectors, and the decoder has them all zero for intra macroblocks */
+    frame_mb.Y().forall( [&] ( YBlock & frame_sb ) { frame_sb.set_motion_vector( MotionVector() ); } );
+
     luma_mb_apply_intra_prediction( original_mb, reconstructed_mb, temp_mb,
                                     frame_mb, quantizer, best_pred.prediction_mode,
                                     encoder_pass );
   }
   else {
     frame_mb.mutable_header().is_inter_mb = true;
-    frame_mb.mutable_header().set_reference( frame_ref );
+    frame_mb.mutable_header().set_reference( best_frame_ref );
+
+    if ( best_pred.prediction_mode == SPLITMV ) {
+      frame_mb.mutable_header().partition_id.initialize( best_split.partition_id );
+
+      frame_mb.Y().forall_ij(
+        [&] ( YBlock & frame_sb, unsigned int sb_column, unsigned int sb_row )
+        {
+          frame_sb.set_prediction_mode( best_split.modes.at( sb_row ).at( sb_column ) );
+          frame_sb.set_motion_vector( best_split.motion_vectors.at( sb_row ).at( sb_column ) );
+        }
+      );
+
+      best_mv = frame_mb.base_motion_vector();
+    }
 
     luma_mb_apply_inter_prediction( original_mb, reconstructed_mb, frame_mb,
                                     quantizer, best_pred.prediction_mode,
@@ -368,6 +1184,71 @@ void Encoder::luma_mb_inter_predict( const VP8Raster::Macroblock & original_mb,
   }
 }
 
+/* how many macroblock columns each band of an intra refresh cycle can take:
+   the share of the frame that fits in intra_refresh_size_, going by what the
+   whole frame would cost as a key frame at `y_ac_qi` (a subsampled estimate,
+   done once when the cycle starts) */
+unsigned int Encoder::intra_refresh_width( const VP8Raster & raster, const size_t y_ac_qi )
+{
+  const unsigned int mb_columns = ( width() + 15 ) / 16;
+
+  CoefficientHistogram histogram;
+  const size_t key_frame_size = estimate_frame_size( raster, y_ac_qi, histogram, true );
+
+  if ( intra_refresh_size_ >= key_frame_size ) {
+    return mb_columns;
+  }
+
+  return max( 1u, static_cast<unsigned int>( intra_refresh_size_ * mb_columns / key_frame_size ) );
+}
+
+/* macroblocks in the band are intra-coded, whatever they'd cost as inter
+   macroblocks */
+void Encoder::luma_mb_intra_refresh( const VP8Raster::Macroblock & original_mb,
+                                     VP8Raster::Macroblock & reconstructed_mb,
+                                     VP8Raster::Macroblock & temp_mb,
+                                     InterFrameMacroblock & frame_mb,
+                                     const Quantizer & quantizer )
+{
+  const MBPredictionData best_pred = luma_mb_best_prediction_mode( original_mb, reconstructed_mb, temp_mb,
+                                                                   frame_mb, quantizer, FIRST_PASS, true );
+
+  frame_mb.mutable_header().is_inter_mb = false;
+  frame_mb.mutable_header().set_reference( CURRENT_FRAME );
+  frame_mb.mutable_header().partition_id.clear();
+  frame_mb.Y().forall( [&] ( YBlock & frame_sb ) { frame_sb.set_motion_vector( MotionVector() ); } );
+
+  luma_mb_apply_intra_prediction( original_mb, reconstructed_mb, temp_mb,
+                                  frame_mb, quantizer, best_pred.prediction_mode, FIRST_PASS );
+}
+
+/* macroblocks that the cycle hasn't reached yet are left as they are in the
+   last frame: the reference has nothing to do with what's there now, so
+   coding them against it would cost about as much as intra-coding them, which
+   is what the cycle spreads over several frames */
+void Encoder::keep_unrefreshed_macroblock( InterFrameMacroblock & frame_mb ) const
+{
+  frame_mb.mutable_header().is_inter_mb = true;
+  frame_mb.mutable_header().set_reference( LAST_FRAME );
+  frame_mb.mutable_header().partition_id.clear();
+
+  frame_mb.Y2().set_prediction_mode( ZEROMV );
+  frame_mb.Y2().set_coded( true );
+  frame_mb.set_base_motion_vector( MotionVector() );
+
+  frame_mb.Y().forall(
+    [&] ( YBlock & frame_sb )
+    {
+      frame_sb.set_motion_vector( MotionVector() );
+      frame_sb.set_Y_after_Y2();
+    }
+  );
+
+  frame_mb.U().forall( [&] ( UVBlock & frame_sb ) { frame_sb.set_motion_vector( MotionVector() ); } );
+
+  frame_mb.zero_out();
+}
+
 /*
  * Please refer to luma_mb_apply_intra_prediction for some information
  * about this method.
@@ -382,55 +1263,23 @@ void Encoder::luma_mb_apply_inter_prediction( const VP8Raster::Macroblock & orig
   frame_mb.Y2().set_prediction_mode( best_pred );
   frame_mb.set_base_motion_vector( best_mv );
 
-  if ( best_pred == SPLITMV ) {
-    frame_mb.Y().forall_ij(
-      [&] ( YBlock & frame_sb, unsigned int sb_column, unsigned int sb_row )
-      {
-        auto & original_sb = original_mb.Y_sub_at( sb_column, sb_row );
-
-        frame_sb.mutable_coefficients().subtract_dct( original_sb,
-          reconstructed_mb.Y_sub_at( sb_column, sb_row ).contents() );
-
-        frame_sb.set_Y_without_Y2();
-        frame_sb.mutable_coefficients() = YBlock::quantize( quantizer, frame_sb.coefficients() );
-        frame_sb.calculate_has_nonzero();
-      }
-    );
-
-    frame_mb.Y2().set_coded( false );
-    frame_mb.Y2().calculate_has_nonzero();
+  const bool with_y2 = ( best_pred != SPLITMV );
 
-    frame_mb.calculate_has_nonzero();
-  }
-  else {
+  if ( with_y2 ) {
     frame_mb.Y().forall(
       [&] ( YBlock & frame_sb ) { frame_sb.set_motion_vector( frame_mb.base_motion_vector() ); }
     );
+  }
 
-    SafeArray<int16_t, 16> walsh_input;
-
-    // XXX refactor this and its keyframe counterpart to remove the redundancy.
-    frame_mb.Y().forall_ij(
-      [&] ( YBlock & frame_sb, unsigned int sb_column, unsigned int sb_row )
-      {
-        auto & original_sb = original_mb.Y_sub_at( sb_column, sb_row );
-
-        frame_sb.mutable_coefficients().subtract_dct( original_sb,
-          reconstructed_mb.Y_sub_at( sb_column, sb_row ).contents() );
-
-        walsh_input.at( sb_column + 4 * sb_row ) = frame_sb.coefficients().at( 0 );
-        frame_sb.set_dc_coefficient( 0 );
-        frame_sb.set_Y_after_Y2();
+  MacroblockResidual residual;
+  MacroblockTransform( quantizer ).luma( original_mb, reconstructed_mb, with_y2, residual );
+  residual.copy_luma( frame_mb.Y(), frame_mb.Y2(), with_y2 );
 
-        frame_sb.mutable_coefficients() = YBlock::quantize( quantizer, frame_sb.coefficients() );
-        frame_sb.calculate_has_nonzero();
-      }
-    );
+  frame_mb.Y2().set_coded( with_y2 );
 
-    frame_mb.Y2().set_coded( true );
-    frame_mb.Y2().mutable_coefficients().wht( walsh_input );
-    frame_mb.Y2().mutable_coefficients() = Y2Block::quantize( quantizer, frame_mb.Y2().coefficients() );
+  if ( not with_y2 ) {
     frame_mb.Y2().calculate_has_nonzero();
+    frame_mb.calculate_has_nonzero();
   }
 }
 
@@ -477,31 +1326,9 @@ void Encoder::chroma_mb_inter_predict( const VP8Raster::Macroblock & original_mb
                                   reference.V(), reconstructed_mb.V.mutable_contents() );
   }
 
-  frame_mb.U().forall_ij(
-    [&] ( UVBlock & frame_sb, unsigned int sb_column, unsigned int sb_row )
-    {
-      auto & original_sb = original_mb.U_sub_at( sb_column, sb_row );
-
-      frame_sb.mutable_coefficients().subtract_dct( original_sb,
-        reconstructed_mb.U_sub_at( sb_column, sb_row ).contents() );
-
-      frame_sb.mutable_coefficients() = UVBlock::quantize( quantizer, frame_sb.coefficients() );
-      frame_sb.calculate_has_nonzero();
-    }
-  );
-
-  frame_mb.V().forall_ij(
-    [&] ( UVBlock & frame_sb, unsigned int sb_column, unsigned int sb_row )
-    {
-      auto & original_sb = original_mb.V_sub_at( sb_column, sb_row );
-
-      frame_sb.mutable_coefficients().subtract_dct( original_sb,
-        reconstructed_mb.V_sub_at( sb_column, sb_row ).contents() );
-
-      frame_sb.mutable_coefficients() = UVBlock::quantize( quantizer, frame_sb.coefficients() );
-      frame_sb.calculate_has_nonzero();
-    }
-  );
+  MacroblockResidual residual;
+  MacroblockTransform( quantizer ).chroma( original_mb, reconstructed_mb, residual );
+  residual.copy_chroma( frame_mb.U(), frame_mb.V() );
 
   frame_mb.calculate_has_nonzero();
 }
@@ -513,15 +1340,59 @@ void Encoder::optimize_mv_probs( InterFrame & frame, const MVComponentCounts & c
       const uint32_t false_count = counts.at( i ).at( j ).first;
       const uint32_t true_count = counts.at( i ).at( j ).second;
 
-      const uint32_t prob = Encoder::calc_prob( false_count, false_count + true_count );
+      const uint32_t prob = ( Encoder::calc_prob( false_count, false_count + true_count ) >> 1 ) << 1;
+      const Probability current = decoder_state_.probability_tables.motion_vector_probs.at( i ).at( j );
 
-      if ( prob > 1 and prob != decoder_state_.probability_tables.motion_vector_probs.at( i ).at( j ) ) {
-        frame.mutable_header().mv_prob_update.at( i ).at( j ) = MVProbUpdate( true, ( prob >> 1 ) << 1 );
+      if ( prob > 1 and prob != current
+           and probability_update_pays_off( counts.at( i ).at( j ), current, prob,
+                                            k_mv_entropy_update_probs.at( i ).at( j ), 7 ) ) {
+        frame.mutable_header().mv_prob_update.at( i ).at( j ) = MVProbUpdate( true, prob );
+      }
+      else {
+        frame.mutable_header().mv_prob_update.at( i ).at( j ) = MVProbUpdate();
       }
     }
   }
 }
 
+/*
+ * The token probability updates of an inter frame are chosen against the
+ * persistent tables, and whether they replace them (refresh_entropy_probs) is
+ * up to us. If the updates would also have paid off on the last inter frame,
+ * the statistics look stable and the updated tables are kept for the next
+ * frames, which won't have to send the same updates again. If they wouldn't
+ * have, the frame is more likely to be a one-off (a burst of intra macroblocks,
+ * say), and the updates only apply to it.
+ */
+bool Encoder::keep_probability_updates( const InterFrameHeader & header ) const
+{
+  if ( not last_token_branch_counts_ ) {
+    return true;
+  }
+
+  const TokenBranchCounts & counts = *last_token_branch_counts_;
+  int64_t savings = 0;
+
+  for ( unsigned int i = 0; i < BLOCK_TYPES; i++ ) {
+    for ( unsigned int j = 0; j < COEF_BANDS; j++ ) {
+      for ( unsigned int k = 0; k < PREV_COEF_CONTEXTS; k++ ) {
+        for ( unsigned int l = 0; l < ENTROPY_NODES; l++ ) {
+          const auto & update = header.token_prob_update.at( i ).at( j ).at( k ).at( l ).coeff_prob;
+
+          if ( update.initialized() ) {
+            const Probability current = decoder_state_.probability_tables.coeff_probs.at( i ).at( j ).at( k ).at( l );
+
+            savings += Costs::branch_cost( counts.at( i ).at( j ).at( k ).at( l ), current );
+            savings -= Costs::branch_cost( counts.at( i ).at( j ).at( k ).at( l ), update.get() );
+          }
+        }
+      }
+    }
+  }
+
+  return savings >= 0;
+}
+
 void Encoder::optimize_interframe_probs( InterFrame & frame )
 {
   array<pair<uint32_t, uint32_t>, 3> probs;
@@ -557,20 +1428,25 @@ void Encoder::optimize_interframe_probs( InterFrame & frame )
     }
   );
 
-  uint8_t prob_inter = Encoder::calc_prob( probs[ 0 ].first, probs[ 0 ].first + probs[ 0 ].second );
-  uint8_t prob_last  = Encoder::calc_prob( probs[ 1 ].first, probs[ 1 ].first + probs[ 1 ].second );
-  uint8_t prob_gf    = Encoder::calc_prob( probs[ 2 ].first, probs[ 2 ].first + probs[ 2 ].second );
+  /* a branch that was never taken still needs the lowest probability, not
+     whatever the previous frame happened to leave in the header; a node that
+     was never reached doesn't cost anything, so we leave it alone */
+  auto branch_prob =
+    [] ( const pair<uint32_t, uint32_t> & count ) -> uint8_t
+    {
+      return max( 1u, Encoder::calc_prob( count.first, count.first + count.second ) );
+    };
 
-  if ( prob_inter > 0 ) {
-    frame.mutable_header().prob_inter = prob_inter;
+  if ( probs[ 0 ].first + probs[ 0 ].second > 0 ) {
+    frame.mutable_header().prob_inter = branch_prob( probs[ 0 ] );
   }
 
-  if ( prob_last > 0 ) {
-    frame.mutable_header().prob_references_last = prob_last;
+  if ( probs[ 1 ].first + probs[ 1 ].second > 0 ) {
+    frame.mutable_header().prob_references_last = branch_prob( probs[ 1 ] );
   }
 
-  if ( prob_gf > 0 ) {
-    frame.mutable_header().prob_references_golden = prob_gf;
+  if ( probs[ 2 ].first + probs[ 2 ].second > 0 ) {
+    frame.mutable_header().prob_references_golden = branch_prob( probs[ 2 ] );
   }
 }
 
@@ -582,24 +1458,29 @@ pair<InterFrame &, double> Encoder::encode_raster<InterFrame>( const VP8Raster &
 {
   DecoderState decoder_state_copy = decoder_state_;
 
-  InterFrame & frame = inter_frame_;
+  InterFrame & frame = workspace_->inter_frame;
 
   frame.mutable_header().quant_indices = quant_indices;
   frame.mutable_header().refresh_entropy_probs = true;
   frame.mutable_header().refresh_last = true;
+  set_reference_updates( frame.mutable_header() );
 
   Quantizer quantizer( frame.header().quant_indices );
   MutableRasterHandle reconstructed_raster_handle { width(), height() };
 
+  const Optional<Segmentation> segmentation = segment_macroblocks( raster, frame );
+  const auto segment_quantizers = frame.calculate_segment_quantizers( segmentation );
+
   update_rd_multipliers( quantizer );
 
-  costs_.fill_token_costs( ProbabilityTables() );
+  costs().fill_token_costs( ProbabilityTables() );
+  MotionSearchContext search = prepare_motion_search( raster, frame.header() );
 
   TokenBranchCounts token_branch_counts;
   MVComponentCounts component_counts;
 
-  costs_.fill_mv_component_costs( decoder_state_.probability_tables.motion_vector_probs );
-  costs_.fill_mv_sad_costs();
+  costs().fill_mv_component_costs( decoder_state_.probability_tables.motion_vector_probs );
+  costs().fill_mv_sad_costs();
 
   raster.macroblocks_forall_ij(
     [&] ( VP8Raster::ConstMacroblock original_mb, unsigned int mb_column, unsigned int mb_row )
@@ -608,27 +1489,51 @@ pair<InterFrame &, double> Encoder::encode_raster<InterFrame>( const VP8Raster &
       auto temp_mb = temp_raster().macroblock( mb_column, mb_row );
       auto & frame_mb = frame.mutable_macroblocks().at( mb_column, mb_row );
 
-      // Process Y and Y2
-      luma_mb_inter_predict( original_mb.macroblock(), reconstructed_mb, temp_mb, frame_mb,
-                             quantizer, component_counts,
-                             frame.header().quant_indices.y_ac_qi, FIRST_PASS );
+      size_t y_ac_qi = frame.header().quant_indices.y_ac_qi;
 
-      if ( frame_mb.inter_coded() ) {
-        chroma_mb_inter_predict( original_mb.macroblock(), reconstructed_mb, temp_mb,
-                                 frame_mb, quantizer, FIRST_PASS );
+      if ( segmentation.initialized() ) {
+        y_ac_qi += segmentation.get().segment_quantizer_adjustments.at( frame_mb.segment_id() );
+        update_rd_multipliers( segment_quantizers.at( frame_mb.segment_id() ) );
+      }
+
+      const Quantizer & mb_quantizer = segmentation.initialized()
+                                       ? segment_quantizers.at( frame_mb.segment_id() )
+                                       : quantizer;
+
+      const bool refreshing = intra_refresh_column_.initialized()
+                              and mb_column >= intra_refresh_column_.get();
+
+      if ( refreshing and mb_column >= intra_refresh_column_.get() + intra_refresh_width_ ) {
+        keep_unrefreshed_macroblock( frame_mb );
       }
       else {
-        chroma_mb_intra_predict( original_mb.macroblock(), reconstructed_mb, temp_mb,
-                                 frame_mb, quantizer, FIRST_PASS );
+        // Process Y and Y2
+        if ( refreshing ) {
+          luma_mb_intra_refresh( original_mb.macroblock(), reconstructed_mb, temp_mb, frame_mb,
+                                 mb_quantizer );
+        }
+        else {
+          luma_mb_inter_predict( original_mb.macroblock(), reconstructed_mb, temp_mb, frame_mb,
+                                 mb_quantizer, component_counts, search, y_ac_qi, FIRST_PASS );
+        }
+
+        if ( frame_mb.inter_coded() ) {
+          chroma_mb_inter_predict( original_mb.macroblock(), reconstructed_mb, temp_mb,
+                                   frame_mb, mb_quantizer, FIRST_PASS );
+        }
+        else {
+          chroma_mb_intra_predict( original_mb.macroblock(), reconstructed_mb, temp_mb,
+                                   frame_mb, mb_quantizer, FIRST_PASS );
+        }
       }
 
       frame_mb.calculate_has_nonzero();
 
       if ( frame_mb.inter_coded() ) {
-        frame_mb.reconstruct_inter( quantizer, references_, reconstructed_mb );
+        frame_mb.reconstruct_inter( mb_quantizer, references_, reconstructed_mb );
       }
       else {
-        frame_mb.reconstruct_intra( quantizer, reconstructed_mb );
+        frame_mb.reconstruct_intra( mb_quantizer, reconstructed_mb );
       }
 
       frame_mb.accumulate_token_branches( token_branch_counts );
@@ -636,10 +1541,21 @@ pair<InterFrame &, double> Encoder::encode_raster<InterFrame>( const VP8Raster &
   );
 
   frame.relink_y2_blocks();
+  finish_motion_search( search );
+
+  if ( search.macroblocks > 0 ) {
+    encode_stats_.sad_evaluations_per_mb.reset( static_cast<double>( search.sad_evaluations )
+                                                / search.macroblocks );
+  }
+  else {
+    /* the whole frame went to an intra refresh */
+    encode_stats_.sad_evaluations_per_mb.clear();
+  }
 
   optimize_prob_skip( frame );
   optimize_interframe_probs( frame );
   optimize_probability_tables( frame, token_branch_counts );
+  frame.mutable_header().refresh_entropy_probs = keep_probability_updates( frame.header() );
   apply_best_loopfilter_settings( raster, reconstructed_raster_handle.get(), frame );
 
   RasterHandle immutable_raster( move( reconstructed_raster_handle ) );
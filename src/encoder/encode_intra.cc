@@ -26,10 +26,12 @@
    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
+#include <algorithm>
 #include <limits>
 #include <typeinfo>
 
 #include "encoder.hh"
+#include "residual.hh"
 
 using namespace std;
 
@@ -39,6 +41,12 @@ void Encoder::update_decoder_state( const KeyFrame & frame )
   // this is a keyframe! reset the decoder state
   decoder_state_ = DecoderState( frame.header(), width(), height() );
   references_ = References( width(), height() );
+  frames_since_golden_refresh_ = 0;
+  motion_field_.reset();
+  newmv_sads_.reset();
+  last_token_branch_counts_.reset();
+  intra_refresh_column_.clear();
+  update_segmentation_map( frame );
 
   if ( frame.header().refresh_entropy_probs ) {
     decoder_state_.probability_tables.coeff_prob_update( frame.header() );
@@ -95,8 +103,8 @@ Encoder::MBPredictionData Encoder::luma_mb_best_prediction_mode( const VP8Raster
 
   unsigned int total_modes = B_PRED;
 
-  if ( encode_quality_ == REALTIME_QUALITY and typeid( frame_mb ) == typeid( InterFrameMacroblock ) ) {
-    // When running the real time mode, we don't consider B_PRED for inter-frames
+  if ( not speed_.inter_b_pred and typeid( frame_mb ) == typeid( InterFrameMacroblock ) ) {
+    // In the faster presets, we don't consider B_PRED for inter-frames
     // macroblocks.
     total_modes = B_PRED - 1;
   }
@@ -110,14 +118,13 @@ Encoder::MBPredictionData Encoder::luma_mb_best_prediction_mode( const VP8Raster
 
     if ( prediction_mode == B_PRED ) {
       pred.cost = 0;
-      pred.rate = costs_.mbmode_costs.at( interframe ? 1 : 0 ).at( B_PRED );
+      pred.rate = costs().mbmode_costs.at( interframe ? 1 : 0 ).at( B_PRED );
       pred.distortion = 0;
 
       reconstructed_mb.Y_sub_forall_ij(
         [&] ( VP8Raster::Block4 & reconstructed_sb, unsigned int sb_column, unsigned int sb_row )
         {
           auto & original_sb = original_mb.Y_sub_at( sb_column, sb_row );
-          auto & temp_sb = temp_mb.Y_sub_at( sb_column, sb_row );
           auto & frame_sb = frame_mb.Y().at( sb_column, sb_row );
 
           const auto above_mode = frame_sb.context().above.initialized()
@@ -125,10 +132,17 @@ Encoder::MBPredictionData Encoder::luma_mb_best_prediction_mode( const VP8Raster
           const auto left_mode = frame_sb.context().left.initialized()
             ? frame_sb.context().left.get()->prediction_mode() : B_DC_PRED;
 
+          /* interframes don't code the subblock modes by their neighbours,
+             which might be SPLITMV partitions (LEFT4X4 & co.) or whatever an
+             earlier frame left in the workspace */
+          const auto & mode_costs = interframe
+            ? costs().inter_bmode_costs
+            : costs().bmode_costs.at( above_mode ).at( left_mode );
+
           bmode sb_prediction_mode = luma_sb_intra_predict( original_sb,
-            reconstructed_sb, temp_sb, costs_.bmode_costs.at( above_mode ).at( left_mode ) );
+            reconstructed_sb, mode_costs );
 
-          pred.rate += costs_.bmode_costs.at( above_mode ).at( left_mode ).at( sb_prediction_mode );
+          pred.rate += mode_costs.at( sb_prediction_mode );
           pred.distortion += sse( original_sb, reconstructed_sb.contents() );
 
           luma_sb_apply_intra_prediction( original_sb, reconstructed_sb, frame_sb,
@@ -146,7 +160,7 @@ Encoder::MBPredictionData Encoder::luma_mb_best_prediction_mode( const VP8Raster
        * the average will be taken out from Y2 block into the Y2 block. */
       pred.distortion = variance( original_mb.Y, prediction );
 
-      pred.rate = costs_.mbmode_costs.at( interframe ? 1 : 0 ).at( prediction_mode );
+      pred.rate = costs().mbmode_costs.at( interframe ? 1 : 0 ).at( prediction_mode );
       pred.cost = rdcost( pred.rate, pred.distortion, RATE_MULTIPLIER,
                           DISTORTION_MULTIPLIER );
     }
@@ -181,13 +195,28 @@ void Encoder::luma_mb_apply_intra_prediction( const VP8Raster::Macroblock & orig
     return;
   }
 
+  frame_mb.Y().forall(
+    [&] ( YBlock & frame_sb )
+    {
+      frame_sb.set_prediction_mode( KeyFrameMacroblock::implied_subblock_mode( min_prediction_mode ) );
+    }
+  );
+
+  frame_mb.Y2().set_coded( true );
+
+  if ( encoder_pass == FIRST_PASS ) {
+    MacroblockResidual residual;
+    MacroblockTransform( quantizer ).luma( original_mb, reconstructed_mb, true, residual );
+    residual.copy_luma( frame_mb.Y(), frame_mb.Y2(), true );
+    return;
+  }
+
   SafeArray<int16_t, 16> walsh_input;
 
   frame_mb.Y().forall_ij(
     [&] ( YBlock & frame_sb, unsigned int sb_column, unsigned int sb_row )
     {
       auto & original_sb = original_mb.Y_sub_at( sb_column, sb_row );
-      frame_sb.set_prediction_mode( KeyFrameMacroblock::implied_subblock_mode( min_prediction_mode ) );
 
       frame_sb.mutable_coefficients().subtract_dct( original_sb,
         reconstructed_mb.Y_sub_at( sb_column, sb_row ).contents() );
@@ -196,27 +225,15 @@ void Encoder::luma_mb_apply_intra_prediction( const VP8Raster::Macroblock & orig
       frame_sb.set_dc_coefficient( 0 );
       frame_sb.set_Y_after_Y2();
 
-      if ( encoder_pass == FIRST_PASS ) {
-        frame_sb.mutable_coefficients() = YBlock::quantize( quantizer, frame_sb.coefficients() );
-      }
-      else {
-        trellis_quantize( frame_sb, quantizer );
-      }
-
+      trellis_quantize( frame_sb, quantizer );
       frame_sb.calculate_has_nonzero();
     }
   );
 
-  frame_mb.Y2().set_coded( true );
   frame_mb.Y2().mutable_coefficients().wht( walsh_input );
 
-  if ( encoder_pass == FIRST_PASS ) {
-    frame_mb.Y2().mutable_coefficients() = Y2Block::quantize( quantizer, frame_mb.Y2().coefficients() );
-  }
-  else {
-    check_reset_y2( frame_mb.Y2(), quantizer );
-    trellis_quantize( frame_mb.Y2(), quantizer );
-  }
+  check_reset_y2( frame_mb.Y2(), quantizer );
+  trellis_quantize( frame_mb.Y2(), quantizer );
 
   frame_mb.Y2().calculate_has_nonzero();
 }
@@ -268,7 +285,7 @@ Encoder::MBPredictionData Encoder::chroma_mb_best_prediction_mode( const VP8Rast
     pred.distortion = sse( original_mb.U, u_prediction )
                     + sse( original_mb.V, v_prediction );
 
-    pred.rate = costs_.intra_uv_mode_costs.at( interframe ).at( prediction_mode );
+    pred.rate = costs().intra_uv_mode_costs.at( interframe ).at( prediction_mode );
     pred.cost = rdcost( pred.rate, pred.distortion, RATE_MULTIPLIER,
                         DISTORTION_MULTIPLIER );
 
@@ -294,6 +311,13 @@ void Encoder::chroma_mb_apply_intra_prediction( const VP8Raster::Macroblock & or
 {
   frame_mb.U().at( 0, 0 ).set_prediction_mode( min_prediction_mode );
 
+  if ( encoder_pass == FIRST_PASS ) {
+    MacroblockResidual residual;
+    MacroblockTransform( quantizer ).chroma( original_mb, reconstructed_mb, residual );
+    residual.copy_chroma( frame_mb.U(), frame_mb.V() );
+    return;
+  }
+
   frame_mb.U().forall_ij(
     [&] ( UVBlock & frame_sb, unsigned int sb_column, unsigned int sb_row )
     {
@@ -302,13 +326,7 @@ void Encoder::chroma_mb_apply_intra_prediction( const VP8Raster::Macroblock & or
       frame_sb.mutable_coefficients().subtract_dct( original_sb,
         reconstructed_mb.U_sub_at( sb_column, sb_row ).contents() );
 
-      if ( encoder_pass == FIRST_PASS ) {
-        frame_sb.mutable_coefficients() = UVBlock::quantize( quantizer, frame_sb.coefficients() );
-      }
-      else {
-        trellis_quantize( frame_sb, quantizer );
-      }
-
+      trellis_quantize( frame_sb, quantizer );
       frame_sb.calculate_has_nonzero();
     }
   );
@@ -321,13 +339,7 @@ void Encoder::chroma_mb_apply_intra_prediction( const VP8Raster::Macroblock & or
       frame_sb.mutable_coefficients().subtract_dct( original_sb,
         reconstructed_mb.V_sub_at( sb_column, sb_row ).contents() );
 
-      if ( encoder_pass == FIRST_PASS ) {
-        frame_sb.mutable_coefficients() = UVBlock::quantize( quantizer, frame_sb.coefficients() );
-      }
-      else {
-        trellis_quantize( frame_sb, quantizer );
-      }
-
+      trellis_quantize( frame_sb, quantizer );
       frame_sb.calculate_has_nonzero();
     }
   );
@@ -354,34 +366,118 @@ void Encoder::chroma_mb_intra_predict( const VP8Raster::Macroblock & original_mb
                                     best_pred.prediction_mode, encoder_pass );
 }
 
+/*
+ * The second pass of a key frame. The macroblock keeps the luma and chroma
+ * modes of the first pass, which depend on the mode costs and distortions
+ * only, not on the token costs. The coefficients have to be computed again:
+ * the neighbours they are predicted from are now reconstructed from the
+ * trellis-quantized ones. For the same reason, B_PRED subblock modes are
+ * searched again, which is cheap next to trying B_PRED on every macroblock.
+ */
+void Encoder::keyframe_mb_reapply_intra_prediction( const VP8Raster::Macroblock & original_mb,
+                                                    VP8Raster::Macroblock & reconstructed_mb,
+                                                    VP8Raster::Macroblock & temp_mb,
+                                                    KeyFrameMacroblock & frame_mb,
+                                                    const Quantizer & quantizer ) const
+{
+  const mbmode luma_prediction_mode = frame_mb.Y2().prediction_mode();
+
+  if ( luma_prediction_mode == B_PRED ) {
+    reconstructed_mb.Y_sub_forall_ij(
+      [&] ( VP8Raster::Block4 & reconstructed_sb, unsigned int sb_column, unsigned int sb_row )
+      {
+        auto & original_sb = original_mb.Y_sub_at( sb_column, sb_row );
+        auto & frame_sb = frame_mb.Y().at( sb_column, sb_row );
+
+        const auto above_mode = frame_sb.context().above.initialized()
+          ? frame_sb.context().above.get()->prediction_mode() : B_DC_PRED;
+        const auto left_mode = frame_sb.context().left.initialized()
+          ? frame_sb.context().left.get()->prediction_mode() : B_DC_PRED;
+
+        const bmode sb_prediction_mode = luma_sb_intra_predict( original_sb,
+          reconstructed_sb, costs().bmode_costs.at( above_mode ).at( left_mode ) );
+
+        luma_sb_apply_intra_prediction( original_sb, reconstructed_sb, frame_sb,
+                                        quantizer, sb_prediction_mode, SECOND_PASS );
+      }
+    );
+  }
+  else {
+    reconstructed_mb.Y.intra_predict( luma_prediction_mode );
+  }
+
+  luma_mb_apply_intra_prediction( original_mb, reconstructed_mb, temp_mb,
+                                  frame_mb, quantizer, luma_prediction_mode,
+                                  SECOND_PASS );
+
+  const mbmode chroma_prediction_mode = frame_mb.U().at( 0, 0 ).prediction_mode();
+
+  reconstructed_mb.U.intra_predict( chroma_prediction_mode );
+  reconstructed_mb.V.intra_predict( chroma_prediction_mode );
+
+  chroma_mb_apply_intra_prediction( original_mb, reconstructed_mb, temp_mb,
+                                    frame_mb, quantizer, chroma_prediction_mode,
+                                    SECOND_PASS );
+}
+
 /* This function outputs the prediction values to 'reconstructed_sb'
  * and returns the prediction mode.
  */
 bmode Encoder::luma_sb_intra_predict( const VP8Raster::Block4 & original_sb,
                                       VP8Raster::Block4 & reconstructed_sb,
-                                      VP8Raster::Block4 & temp_sb,
                                       const SafeArray<uint16_t, num_intra_b_modes> & mode_costs ) const
 {
-  uint32_t min_error = numeric_limits<uint32_t>::max();
-  bmode min_prediction_mode = B_DC_PRED;
-  TwoDSubRange<uint8_t, 4, 4> & prediction = temp_sb.mutable_contents();
+  VP8Raster::Block4::IntraPredictions predictions;
+  reconstructed_sb.intra_predict_all( reconstructed_sb.predictors(), predictions );
 
-  auto predictors = reconstructed_sb.predictors();
+  SafeArray<uint8_t, num_intra_b_modes> candidates;
+  unsigned int candidate_count = speed_.intra_b_modes;
 
   for ( unsigned int prediction_mode = 0; prediction_mode < num_intra_b_modes; prediction_mode++ ) {
-    reconstructed_sb.intra_predict( ( bmode )prediction_mode, predictors, prediction );
+    candidates.at( prediction_mode ) = prediction_mode;
+  }
+
+  if ( speed_.intra_b_mode_candidates < speed_.intra_b_modes ) {
+    /* the SSE of a prediction is about SAD^2 / 16 */
+    const auto sads = intra_b_mode_sads( original_sb, predictions );
+    SafeArray<uint32_t, num_intra_b_modes> estimates;
 
-    uint32_t distortion = sse( original_sb, prediction );
+    for ( unsigned int prediction_mode = 0; prediction_mode < num_intra_b_modes; prediction_mode++ ) {
+      estimates.at( prediction_mode ) = rdcost( mode_costs.at( prediction_mode ),
+                                                sads.at( prediction_mode ) * sads.at( prediction_mode ) / 16,
+                                                RATE_MULTIPLIER, DISTORTION_MULTIPLIER );
+    }
+
+    candidate_count = speed_.intra_b_mode_candidates;
+
+    partial_sort( &candidates.at( 0 ), &candidates.at( 0 ) + candidate_count,
+                  &candidates.at( 0 ) + speed_.intra_b_modes,
+                  [&] ( const uint8_t a, const uint8_t b )
+                  { return estimates.at( a ) < estimates.at( b ); } );
+  }
+
+  uint32_t min_error = numeric_limits<uint32_t>::max();
+  bmode min_prediction_mode = B_DC_PRED;
+
+  for ( unsigned int i = 0; i < candidate_count; i++ ) {
+    const unsigned int prediction_mode = candidates.at( i );
+
+    uint32_t distortion = sse( original_sb, predictions.at( prediction_mode ) );
     uint32_t error_val = rdcost( mode_costs.at( prediction_mode ), distortion,
                                  RATE_MULTIPLIER, DISTORTION_MULTIPLIER );
 
     if ( error_val < min_error ) {
-      reconstructed_sb.mutable_contents().copy_from( prediction );
       min_prediction_mode = ( bmode )prediction_mode;
       min_error = error_val;
     }
   }
 
+  const auto & best_prediction = predictions.at( min_prediction_mode );
+
+  for ( unsigned int row = 0; row < 4; row++ ) {
+    memcpy( &reconstructed_sb.at( 0, row ), &best_prediction.at( 4 * row ), 4 );
+  }
+
   return min_prediction_mode;
 }
 
@@ -394,7 +490,7 @@ pair<KeyFrame &, double> Encoder::encode_raster<KeyFrame>( const VP8Raster & ras
   DecoderState decoder_state_copy = decoder_state_;
   decoder_state_ = DecoderState( width(), height() );
 
-  KeyFrame & frame = key_frame_;
+  KeyFrame & frame = workspace_->key_frame;
 
   frame.mutable_header().quant_indices = quant_indices;
   frame.mutable_header().refresh_entropy_probs = true;
@@ -402,16 +498,19 @@ pair<KeyFrame &, double> Encoder::encode_raster<KeyFrame>( const VP8Raster & ras
   Quantizer quantizer( frame.header().quant_indices );
   MutableRasterHandle reconstructed_raster_handle { width(), height() };
 
+  const Optional<Segmentation> segmentation = segment_macroblocks( raster, frame );
+  const auto segment_quantizers = frame.calculate_segment_quantizers( segmentation );
+
   update_rd_multipliers( quantizer );
 
   TokenBranchCounts token_branch_counts;
 
   for ( size_t pass = FIRST_PASS;
-        pass <= ( two_pass_encoder_ ? SECOND_PASS : FIRST_PASS );
+        pass <= ( speed_.two_pass ? SECOND_PASS : FIRST_PASS );
         pass++ ) {
 
     if ( pass == SECOND_PASS ) {
-      costs_.fill_token_costs( decoder_state_.probability_tables );
+      costs().fill_token_costs( decoder_state_.probability_tables );
       token_branch_counts = TokenBranchCounts();
     }
 
@@ -422,14 +521,28 @@ pair<KeyFrame &, double> Encoder::encode_raster<KeyFrame>( const VP8Raster & ras
         auto temp_mb = temp_raster().macroblock( mb_column, mb_row );
         auto & frame_mb = frame.mutable_macroblocks().at( mb_column, mb_row );
 
-        // Process Y and Y2
-        luma_mb_intra_predict( original_mb.macroblock(), reconstructed_mb, temp_mb,
-                               frame_mb, quantizer, (EncoderPass)pass );
-        chroma_mb_intra_predict( original_mb.macroblock(), reconstructed_mb, temp_mb,
-                                 frame_mb, quantizer, (EncoderPass)pass );
+        if ( segmentation.initialized() ) {
+          update_rd_multipliers( segment_quantizers.at( frame_mb.segment_id() ) );
+        }
+
+        const Quantizer & mb_quantizer = segmentation.initialized()
+                                         ? segment_quantizers.at( frame_mb.segment_id() )
+                                         : quantizer;
+
+        if ( pass == FIRST_PASS ) {
+          // Process Y and Y2
+          luma_mb_intra_predict( original_mb.macroblock(), reconstructed_mb, temp_mb,
+                                 frame_mb, mb_quantizer, FIRST_PASS );
+          chroma_mb_intra_predict( original_mb.macroblock(), reconstructed_mb, temp_mb,
+                                   frame_mb, mb_quantizer, FIRST_PASS );
+        }
+        else {
+          keyframe_mb_reapply_intra_prediction( original_mb.macroblock(), reconstructed_mb,
+                                                temp_mb, frame_mb, mb_quantizer );
+        }
 
         frame_mb.calculate_has_nonzero();
-        frame_mb.reconstruct_intra( quantizer, reconstructed_mb );
+        frame_mb.reconstruct_intra( mb_quantizer, reconstructed_mb );
 
         frame_mb.accumulate_token_branches( token_branch_counts );
       }
@@ -32,6 +32,7 @@
 #include <limits>
 #include <utility>
 #include <chrono>
+#include <mutex>
 
 #include "block.hh"
 #include "encoder.hh"
@@ -44,6 +45,7 @@ using namespace std;
 #include "encode_intra.cc"
 #include "reencode.cc"
 #include "size_estimation.cc"
+#include "segmentation.cc"
 
 unsigned Encoder::calc_prob( unsigned false_count, unsigned total )
 {
@@ -54,6 +56,16 @@ unsigned Encoder::calc_prob( unsigned false_count, unsigned total )
   }
 }
 
+bool Encoder::probability_update_pays_off( const pair<uint32_t, uint32_t> & counts,
+                                          const Probability current,
+                                          const Probability updated,
+                                          const Probability update_prob,
+                                          const unsigned int value_bits )
+{
+  return Costs::branch_cost( counts, updated ) + Costs::update_cost( update_prob, true, value_bits )
+         < Costs::branch_cost( counts, current ) + Costs::update_cost( update_prob, false, value_bits );
+}
+
 QuantIndices::QuantIndices()
   : y_ac_qi(), y_dc(), y2_dc(), y2_ac(), uv_dc(), uv_ac()
 {}
@@ -67,37 +79,156 @@ void VP8Raster::Block<size>::inter_predict( const MotionVector & mv,
   inter_predict( mv, reference, subrange );
 }
 
+/* SpeedPreset */
+SpeedPreset::SpeedPreset( const uint8_t speed )
+  : two_pass( speed == 0 ),
+    intra_b_modes( speed <= 6 ? num_intra_b_modes : ( speed == 7 ? 6 : 4 ) ),
+    intra_b_mode_candidates( speed <= 1 ? num_intra_b_modes : ( speed <= 6 ? 4 : 3 ) ),
+    inter_b_pred( speed <= 5 ),
+    pyramid_search_range( speed <= 2 ? 8 : ( speed <= 5 ? 6 : ( speed == 6 ? 4 : 2 ) ) ),
+    predictor_search( true ),
+    subpixel_search_iterations( speed <= 2 ? 3 : ( speed <= 5 ? 2 : ( speed <= 7 ? 1 : 0 ) ) ),
+    refine_early_termination( speed <= 5 ),
+    long_term_new_mvs( speed <= 2 ),
+    split_mv_partitionings( speed <= 1 ? SPLITMV_ALL
+                            : ( speed <= 3 ? SPLITMV_16X8 | SPLITMV_8X16 | SPLITMV_8X8
+                                : ( speed <= 6 ? SPLITMV_8X8 : 0 ) ) ),
+    split_mv_refinement( speed <= 3 ),
+    static_skip( speed >= REALTIME ),
+    scene_cut_detection( true ),
+    loop_filter_search_range( speed <= 4 ? MAX_LOOP_FILTER_LEVEL : ( speed <= 7 ? 1 : 0 ) ),
+    narrow_quantizer_search( speed >= 6 )
+{
+  if ( speed > FASTEST ) {
+    throw runtime_error( "invalid speed preset" );
+  }
+}
+
+SpeedPreset::SpeedPreset( const EncoderQuality quality )
+  : SpeedPreset( quality == REALTIME_QUALITY ? REALTIME : SLOWEST )
+{}
+
+EncoderWorkspace::EncoderWorkspace( const uint16_t width, const uint16_t height )
+  : key_frame( width, height ),
+    subsampled_key_frame( width / WIDTH_SAMPLE_DIMENSION_FACTOR,
+                          height / HEIGHT_SAMPLE_DIMENSION_FACTOR ),
+    inter_frame( width, height ),
+    subsampled_inter_frame( width / WIDTH_SAMPLE_DIMENSION_FACTOR,
+                            height / HEIGHT_SAMPLE_DIMENSION_FACTOR ),
+    temp_raster( width, height )
+{
+  costs.fill_mode_costs();
+}
+
+/* the workspaces that aren't lent to any encoder at the moment */
+static mutex workspace_pool_mutex;
+static vector<unique_ptr<EncoderWorkspace>> workspace_pool;
+
+Encoder::WorkspaceLease::WorkspaceLease( Encoder & encoder )
+  : encoder_( encoder ), lent_( not encoder.workspace_ )
+{
+  if ( not lent_ ) {
+    return;
+  }
+
+  {
+    unique_lock<mutex> lock { workspace_pool_mutex };
+
+    auto pooled = find_if( workspace_pool.begin(), workspace_pool.end(),
+                           [&] ( const unique_ptr<EncoderWorkspace> & workspace )
+                           {
+                             return workspace->width() == encoder.width()
+                                    and workspace->height() == encoder.height();
+                           } );
+
+    if ( pooled != workspace_pool.end() ) {
+      encoder.workspace_ = move( *pooled );
+      workspace_pool.erase( pooled );
+    }
+  }
+
+  if ( not encoder.workspace_ ) {
+    encoder.workspace_.reset( new EncoderWorkspace( encoder.width(), encoder.height() ) );
+  }
+
+  /* whatever the last encoder left in the cost tables that aren't filled for
+     every frame, and in the frame headers, this one starts from the same
+     place. the only thing an inter frame header carries over from one frame
+     to the next is the reference probabilities, and those are the encoder's */
+  encoder.costs().fill_token_costs( ProbabilityTables() );
+  encoder.costs().fill_mv_component_costs( encoder.decoder_state_.probability_tables.motion_vector_probs );
+  encoder.costs().fill_mv_sad_costs();
+
+  encoder.workspace_->key_frame.mutable_header() = KeyFrameHeader( BoolDecoder::zero_decoder() );
+  encoder.workspace_->inter_frame.mutable_header() = InterFrameHeader( BoolDecoder::zero_decoder() );
+  encoder.workspace_->subsampled_inter_frame.mutable_header() = InterFrameHeader( BoolDecoder::zero_decoder() );
+
+  encoder.restore_reference_probs( encoder.workspace_->inter_frame.mutable_header() );
+  encoder.restore_reference_probs( encoder.workspace_->subsampled_inter_frame.mutable_header() );
+}
+
+Encoder::WorkspaceLease::~WorkspaceLease()
+{
+  if ( lent_ and encoder_.workspace_ ) {
+    unique_lock<mutex> lock { workspace_pool_mutex };
+    workspace_pool.push_back( move( encoder_.workspace_ ) );
+  }
+}
+
 /* Encoder */
 Encoder::Encoder( const uint16_t s_width,
                   const uint16_t s_height,
-                  const bool two_pass,
-                  const EncoderQuality quality )
+                  const SpeedPreset & speed )
   : decoder_state_( s_width, s_height ),
     references_( width(), height() ),
-    safe_references_( references_ ), has_state_( false ), costs_(),
-    two_pass_encoder_( two_pass ), encode_quality_( quality )
+    safe_references_( references_ ), has_state_( false ),
+    speed_( speed )
+{}
+
+Encoder::Encoder( const Decoder & decoder, const SpeedPreset & speed )
+  : decoder_state_( decoder.get_state() ), references_( decoder.get_references() ),
+    safe_references_( references_ ), has_state_( true ),
+    speed_( speed )
+{}
+
+Encoder::Encoder( const uint16_t s_width,
+                  const uint16_t s_height,
+                  const bool two_pass,
+                  const EncoderQuality quality )
+  : Encoder( s_width, s_height, quality )
 {
-  costs_.fill_mode_costs();
+  speed_.two_pass = two_pass;
 }
 
 Encoder::Encoder( const Decoder & decoder, const bool two_pass,
                   const EncoderQuality quality )
-  : decoder_state_( decoder.get_state() ), references_( decoder.get_references() ),
-    safe_references_( references_ ), has_state_( true ), costs_(),
-    two_pass_encoder_( two_pass ), encode_quality_( quality )
+  : Encoder( decoder, quality )
 {
-  costs_.fill_mode_costs();
+  speed_.two_pass = two_pass;
 }
 
 Encoder::Encoder( const Encoder & encoder )
   : decoder_state_( encoder.decoder_state_ ),
     references_( encoder.references_ ),
     safe_references_( encoder.safe_references_ ),
-    has_state_( encoder.has_state_ ), costs_( encoder.costs_ ),
-    two_pass_encoder_( encoder.two_pass_encoder_ ),
-    encode_quality_( encoder.encode_quality_ ),
+    has_state_( encoder.has_state_ ),
+    speed_( encoder.speed_ ),
+    golden_refresh_interval_( encoder.golden_refresh_interval_ ),
+    frames_since_golden_refresh_( encoder.frames_since_golden_refresh_ ),
+    motion_field_( encoder.motion_field_ ),
+    analysis_( encoder.analysis_ ),
+    newmv_sads_( encoder.newmv_sads_ ),
+    last_token_branch_counts_( encoder.last_token_branch_counts_ ),
     loop_filter_level_( encoder.loop_filter_level_ ),
     last_y_ac_qi_( encoder.last_y_ac_qi_ ),
+    reference_probs_( encoder.reference_probs_ ),
+    rate_model_( encoder.rate_model_ ),
+    aq_strength_( encoder.aq_strength_ ),
+    regions_of_interest_( encoder.regions_of_interest_ ),
+    intra_refresh_size_( encoder.intra_refresh_size_ ),
+    intra_refresh_column_( encoder.intra_refresh_column_ ),
+    intra_refresh_width_( encoder.intra_refresh_width_ ),
+    reencode_threads_( encoder.reencode_threads_ ),
     encode_stats_( encoder.encode_stats_ )
 {}
 
@@ -105,15 +236,24 @@ Encoder::Encoder( Encoder && encoder )
   : decoder_state_( move( encoder.decoder_state_ ) ),
     references_( move( encoder.references_ ) ),
     safe_references_( move( encoder.safe_references_ ) ),
-    has_state_( encoder.has_state_ ), costs_( move( encoder.costs_ ) ),
-    two_pass_encoder_( encoder.two_pass_encoder_ ),
-    encode_quality_( encoder.encode_quality_ ),
-    key_frame_( move( encoder.key_frame_ ) ),
-    subsampled_key_frame_( move( encoder.subsampled_key_frame_ ) ),
-    inter_frame_( move( encoder.inter_frame_ ) ),
-    subsampled_inter_frame_( move( encoder.subsampled_inter_frame_ ) ),
+    has_state_( encoder.has_state_ ), workspace_( move( encoder.workspace_ ) ),
+    speed_( encoder.speed_ ),
+    golden_refresh_interval_( encoder.golden_refresh_interval_ ),
+    frames_since_golden_refresh_( encoder.frames_since_golden_refresh_ ),
+    motion_field_( move( encoder.motion_field_ ) ),
+    analysis_( move( encoder.analysis_ ) ),
+    newmv_sads_( move( encoder.newmv_sads_ ) ),
+    last_token_branch_counts_( move( encoder.last_token_branch_counts_ ) ),
     loop_filter_level_( move( encoder.loop_filter_level_ ) ),
     last_y_ac_qi_( move( encoder.last_y_ac_qi_ ) ),
+    reference_probs_( encoder.reference_probs_ ),
+    rate_model_( move( encoder.rate_model_ ) ),
+    aq_strength_( encoder.aq_strength_ ),
+    regions_of_interest_( move( encoder.regions_of_interest_ ) ),
+    intra_refresh_size_( encoder.intra_refresh_size_ ),
+    intra_refresh_column_( move( encoder.intra_refresh_column_ ) ),
+    intra_refresh_width_( encoder.intra_refresh_width_ ),
+    reencode_threads_( encoder.reencode_threads_ ),
     encode_stats_( move( encoder.encode_stats_ ) )
 {}
 
@@ -123,15 +263,24 @@ Encoder & Encoder::operator=( Encoder && encoder )
   references_ = move( encoder.references_ );
   safe_references_ = move( encoder.safe_references_ );
   has_state_ = encoder.has_state_;
-  costs_ = move( encoder.costs_ );
-  two_pass_encoder_ = encoder.two_pass_encoder_;
-  encode_quality_ = encoder.encode_quality_;
-  key_frame_ = move( encoder.key_frame_ );
-  subsampled_key_frame_ = move( encoder.subsampled_key_frame_ );
-  inter_frame_ = move( encoder.inter_frame_ );
-  subsampled_inter_frame_ = move( encoder.subsampled_inter_frame_ );
+  workspace_ = move( encoder.workspace_ );
+  speed_ = encoder.speed_;
+  golden_refresh_interval_ = encoder.golden_refresh_interval_;
+  frames_since_golden_refresh_ = encoder.frames_since_golden_refresh_;
+  motion_field_ = move( encoder.motion_field_ );
+  analysis_ = move( encoder.analysis_ );
+  newmv_sads_ = move( encoder.newmv_sads_ );
+  last_token_branch_counts_ = move( encoder.last_token_branch_counts_ );
   loop_filter_level_ = move( encoder.loop_filter_level_ );
   last_y_ac_qi_ = move( encoder.last_y_ac_qi_ );
+  reference_probs_ = encoder.reference_probs_;
+  rate_model_ = move( encoder.rate_model_ );
+  aq_strength_ = encoder.aq_strength_;
+  regions_of_interest_ = move( encoder.regions_of_interest_ );
+  intra_refresh_size_ = encoder.intra_refresh_size_;
+  intra_refresh_column_ = move( encoder.intra_refresh_column_ );
+  intra_refresh_width_ = encoder.intra_refresh_width_;
+  reencode_threads_ = encoder.reencode_threads_;
   encode_stats_ = move( encoder.encode_stats_ );
 
   return *this;
@@ -143,6 +292,17 @@ uint32_t Encoder::minihash() const
                                 references_.golden.hash(), references_.alternative.hash() ).hash() );
 }
 
+/* the analysis is for a raster, not for whatever frame comes next, so that
+   one that's left over (or that's given with the wrong frame) is ignored */
+const FrameAnalysis * Encoder::analysis_of( const VP8Raster & raster ) const
+{
+  if ( analysis_ and &analysis_->raster.get() == &raster ) {
+    return analysis_.get();
+  }
+
+  return nullptr;
+}
+
 template<class FrameType>
 vector<uint8_t> Encoder::write_frame( const FrameType & frame,
                                       const ProbabilityTables & prob_tables )
@@ -157,15 +317,14 @@ vector<uint8_t> Encoder::write_frame( const FrameType & frame,
   RasterHandle immutable_raster( move( raster ) );
   frame.copy_to( immutable_raster, references_ );
 
-  safe_references_.last = move( SafeReferences::load( references_.last ) );
-  safe_references_.golden = move( SafeReferences::load( references_.golden ) );
-  safe_references_.alternative = move( SafeReferences::load( references_.alternative ) );
+  safe_references_.update( references_ );
 
-  if ( encode_quality_ == REALTIME_QUALITY ) {
+  if ( speed_.loop_filter_search_range < SpeedPreset::MAX_LOOP_FILTER_LEVEL ) {
     loop_filter_level_.reset( frame.header().loop_filter_level );
-    last_y_ac_qi_.reset( frame.header().quant_indices.y_ac_qi );
   }
 
+  last_y_ac_qi_.reset( frame.header().quant_indices.y_ac_qi );
+
   return frame.serialize( prob_tables );
 }
 
@@ -335,7 +494,7 @@ void Encoder::trellis_quantize( FrameSubblockType & frame_sb,
           size_t current_context = prev_token_class.at( current_node.token );
 
           // cost of the next token based on the *current* context
-          rates[ next ] += costs_.token_costs.at( frame_sb.type() )
+          rates[ next ] += costs().token_costs.at( frame_sb.type() )
                                              .at( next_band )
                                              .at( current_context )
                                              .at( next_node.token );
@@ -373,7 +532,7 @@ void Encoder::trellis_quantize( FrameSubblockType & frame_sb,
 
   for ( size_t i = 0; i < LEVELS; i++ ) {
     TrellisNode & node = trellis.at( first_index ).at( i );
-    node.rate += costs_.token_costs.at( frame_sb.type() )
+    node.rate += costs().token_costs.at( frame_sb.type() )
                                    .at( coefficient_to_band.at( first_index ) )
                                    .at( token_context )
                                    .at( node.token );
@@ -426,11 +585,22 @@ void Encoder::optimize_probability_tables( FrameType & frame, const TokenBranchC
           const unsigned int true_count = token_branch_counts.at( i ).at( j ).at( k ).at( l ).second;
 
           const unsigned int prob = Encoder::calc_prob( false_count, false_count + true_count );
+          const Probability current = decoder_state_.probability_tables.coeff_probs.at( i ).at( j ).at( k ).at( l );
 
           assert( prob <= 255 );
 
-          if ( prob > 0 and prob != decoder_state_.probability_tables.coeff_probs.at( i ).at( j ).at( k ).at( l ) ) {
-            frame.mutable_header().token_prob_update.at( i ).at( j ).at( k ).at( l ) = TokenProbUpdate( true, prob );
+          /* the frame header is reused, so an update that doesn't pay off
+             has to be taken out explicitly */
+          TokenProbUpdate & update = frame.mutable_header().token_prob_update.at( i ).at( j ).at( k ).at( l );
+
+          if ( prob > 0 and prob != current
+               and probability_update_pays_off( token_branch_counts.at( i ).at( j ).at( k ).at( l ),
+                                                current, prob,
+                                                k_coeff_entropy_update_probs.at( i ).at( j ).at( k ).at( l ), 8 ) ) {
+            update = TokenProbUpdate( true, prob );
+          }
+          else {
+            update = TokenProbUpdate();
           }
         }
       }
@@ -476,14 +646,16 @@ void Encoder::apply_best_loopfilter_settings( const VP8Raster & original,
   uint8_t max_lf_level = 63;
 
   if ( loop_filter_level_.initialized() ) {
-    if ( loop_filter_level_.get() > 0 ) {
-      min_lf_level = loop_filter_level_.get() - 1;
+    const uint8_t range = speed_.loop_filter_search_range;
+
+    if ( loop_filter_level_.get() > range ) {
+      min_lf_level = loop_filter_level_.get() - range;
     }
     else {
       min_lf_level = 0;
     }
 
-    max_lf_level = min( 63u, loop_filter_level_.get() + 1u );
+    max_lf_level = min( 63u, unsigned( loop_filter_level_.get() ) + range );
   }
 
   for ( uint8_t lf_level = min_lf_level; lf_level <= max_lf_level; lf_level++ ) {
@@ -556,16 +728,43 @@ FrameType & Encoder::encode_with_quantizer_search( const VP8Raster & raster,
   return encode_raster<FrameType>( raster, quant_indices, false ).first;
 }
 
+/* a frame is a key frame if there's nothing to predict it from, or nothing
+   in it that could be; with intra refresh on, a refresh cycle starts instead,
+   its bands sized for `y_ac_qi` (see intra_refresh_width) */
+bool Encoder::needs_key_frame( const VP8Raster & raster, const uint8_t y_ac_qi )
+{
+  if ( has_state_ and not scene_cut( raster ) ) {
+    return false;
+  }
+
+  if ( intra_refresh_size_ > 0 ) {
+    has_state_ = true;
+    intra_refresh_column_.reset( 0 );
+    intra_refresh_width_ = intra_refresh_width( raster, y_ac_qi );
+    return false;
+  }
+
+  return true;
+}
+
 vector<uint8_t> Encoder::encode_with_quantizer( const VP8Raster & raster, const uint8_t y_ac_qi )
 {
+  const WorkspaceLease lease { *this };
+
   if ( width() != raster.display_width() or height() != raster.display_height() ) {
     throw runtime_error( "scaling is not supported" );
   }
 
+  return encode_with_quantizer( raster, y_ac_qi, needs_key_frame( raster, y_ac_qi ) );
+}
+
+vector<uint8_t> Encoder::encode_with_quantizer( const VP8Raster & raster, const uint8_t y_ac_qi,
+                                                const bool key_frame )
+{
   QuantIndices quant_indices;
   quant_indices.y_ac_qi = y_ac_qi;
 
-  if ( not has_state_ ) {
+  if ( key_frame ) {
     has_state_ = true;
     return write_frame( encode_raster<KeyFrame>( raster, quant_indices ).first );
   }
@@ -576,11 +775,14 @@ vector<uint8_t> Encoder::encode_with_quantizer( const VP8Raster & raster, const
 
 vector<uint8_t> Encoder::encode_with_minimum_ssim( const VP8Raster & raster, const double minimum_ssim )
 {
+  const WorkspaceLease lease { *this };
+
   if ( width() != raster.display_width() or height() != raster.display_height() ) {
     throw runtime_error( "scaling is not supported" );
   }
 
-  if ( not has_state_ ) {
+  /* the quantizer search starts halfway */
+  if ( needs_key_frame( raster, 63 ) ) {
     has_state_ = true;
     return write_frame( encode_with_quantizer_search<KeyFrame>( raster, minimum_ssim ) );
   }
@@ -590,6 +792,8 @@ vector<uint8_t> Encoder::encode_with_minimum_ssim( const VP8Raster & raster, con
 }
 
 vector<uint8_t> Encoder::encode_with_target_size( const VP8Raster & raster, const size_t target_size ) {
+  const WorkspaceLease lease { *this };
+
   if ( width() != raster.display_width() or height() != raster.display_height() ) {
     throw runtime_error( "scaling is not supported" );
   }
@@ -597,7 +801,7 @@ vector<uint8_t> Encoder::encode_with_target_size( const VP8Raster & raster, cons
   int y_qi_min = 4;
   int y_qi_max = 127;
 
-  if ( last_y_ac_qi_.initialized() ) {
+  if ( speed_.narrow_quantizer_search and last_y_ac_qi_.initialized() ) {
     const int radius = 16;
 
     if ( last_y_ac_qi_.get() - radius >= y_qi_min ) {
@@ -607,25 +811,44 @@ vector<uint8_t> Encoder::encode_with_target_size( const VP8Raster & raster, cons
     y_qi_max = min( y_qi_max, last_y_ac_qi_.get() + radius );
   }
 
-  uint8_t best_y_qi = numeric_limits<uint8_t>::max();
+  /* the frame is analyzed where the last one ended up, which is usually
+     close enough for the model to pick the quantizer by itself */
+  const int probe_y_qi = max( y_qi_min,
+                              min( y_qi_max,
+                                   static_cast<int>( last_y_ac_qi_.get_or( ( y_qi_min + y_qi_max ) / 2 ) ) ) );
 
-  size_t estimated_size = target_size;
+  const bool key_frame = needs_key_frame( raster, probe_y_qi );
 
-  while ( y_qi_min <= y_qi_max ) {
-    size_t y_qi = ( y_qi_min + y_qi_max ) / 2;
-    estimated_size = estimate_frame_size( raster, y_qi );
+  /* analyzes the frame at `analysis_y_qi` and returns the best quantizer
+     that the rate model thinks will fit, with the size it expects */
+  auto choose_quantizer =
+    [&] ( const int analysis_y_qi ) -> pair<uint8_t, size_t>
+    {
+      CoefficientHistogram histogram;
+      const size_t analysis_size = estimate_frame_size( raster, analysis_y_qi, histogram, key_frame );
 
-    if ( estimated_size <= target_size or ( y_qi_min == y_qi_max and best_y_qi == numeric_limits<uint8_t>::max() ) ) {
-      best_y_qi = y_qi;
+      const auto predicted_sizes = rate_model_.predict( histogram, decoder_state_.probability_tables,
+                                                        analysis_y_qi, analysis_size );
 
-      y_qi_max = y_qi - 1;
-    }
-    else if ( estimated_size > target_size ) {
-      y_qi_min = y_qi + 1;
-    }
+      for ( int y_qi = y_qi_min; y_qi < y_qi_max; y_qi++ ) {
+        if ( rate_model_.fits( predicted_sizes.at( y_qi ), target_size ) ) {
+          return { y_qi, predicted_sizes.at( y_qi ) };
+        }
+      }
+
+      return { y_qi_max, predicted_sizes.at( y_qi_max ) };
+    };
+
+  pair<uint8_t, size_t> choice = choose_quantizer( probe_y_qi );
+
+  if ( abs( choice.first - probe_y_qi ) > MAX_RATE_MODEL_EXTRAPOLATION ) {
+    choice = choose_quantizer( choice.first );
   }
 
-  return encode_with_quantizer( raster, best_y_qi );
+  vector<uint8_t> output = encode_with_quantizer( raster, choice.first, key_frame );
+  rate_model_.update( choice.second, output.size() );
+
+  return output;
 }
 
 template <class FrameHeaderType, class MacroblockHeaderType>
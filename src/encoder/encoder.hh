@@ -31,6 +31,8 @@
 
 #include <vector>
 #include <string>
+#include <memory>
+#include <mutex>
 #include <tuple>
 #include <limits>
 
@@ -38,14 +40,18 @@
 #include "frame.hh"
 #include "frame_input.hh"
 #include "vp8_raster.hh"
+#include "ivf.hh"
 #include "ivf_writer.hh"
 #include "costs.hh"
 #include "enc_state_serializer.hh"
 #include "file_descriptor.hh"
 #include "block.hh"
-#include "frame_pool.hh"
+#include "pyramid.hh"
+#include "lookahead.hh"
+#include "rate_model.hh"
 
 const uint8_t DEFAULT_QUANTIZER = 64;
+const uint32_t DEFAULT_GOLDEN_REFRESH_INTERVAL = 16;
 
 enum EncoderPass
 {
@@ -59,6 +65,82 @@ enum EncoderQuality
   REALTIME_QUALITY
 };
 
+/* SPLITMV partitionings that the encoder tries; bit i stands for the partition
+   id i in mv_partitions */
+enum SplitMVPartitioning
+{
+  SPLITMV_16X8 = 1 << 0,
+  SPLITMV_8X16 = 1 << 1,
+  SPLITMV_8X8  = 1 << 2,
+  SPLITMV_4X4  = 1 << 3,
+  SPLITMV_ALL  = SPLITMV_16X8 | SPLITMV_8X16 | SPLITMV_8X8 | SPLITMV_4X4
+};
+
+/* Everything that trades compression efficiency for encoding speed, graded
+   from 0 (slowest, same as BEST_QUALITY) to 8 (fastest). REALTIME_QUALITY is
+   preset 6. The knobs can still be changed one by one after that. */
+struct SpeedPreset
+{
+  static constexpr uint8_t SLOWEST = 0;
+  static constexpr uint8_t REALTIME = 6;
+  static constexpr uint8_t FASTEST = 8;
+
+  /* key frames: encode a second time with the token costs of the first pass,
+     and use trellis quantization on that pass */
+  bool two_pass;
+
+  /* how many of the subblock intra modes are tried, in bmode order (which is
+     roughly from the most to the least likely) */
+  uint8_t intra_b_modes;
+
+  /* how many of those get their rate-distortion cost computed, after ranking
+     them by SAD (all of them if it's intra_b_modes or more) */
+  uint8_t intra_b_mode_candidates;
+
+  /* whether B_PRED is tried in inter frames at all */
+  bool inter_b_pred;
+
+  /* motion search: pyramid range (quarter-resolution pixels), predictor set
+     with early termination, and sub-pixel iterations; see Encoder */
+  uint8_t pyramid_search_range;
+  bool predictor_search;
+  uint8_t subpixel_search_iterations;
+
+  /* refine the predictor that stopped the search early at sub-pixel level */
+  bool refine_early_termination;
+
+  /* search new motion vectors (NEWMV and SPLITMV) in GOLDEN and ALTREF too,
+     rather than only trying the ones we already know about */
+  bool long_term_new_mvs;
+
+  /* a mask of SplitMVPartitioning values, and whether NEW4X4 vectors are
+     refined with a diamond search */
+  uint8_t split_mv_partitionings;
+  bool split_mv_refinement;
+
+  /* inter frames: a macroblock that ZEROMV from LAST_FRAME predicts well
+     enough to leave no residual is skipped right away, without trying the
+     other modes or references */
+  bool static_skip;
+
+  /* a frame that has little in common with the last one is encoded as a key
+     frame, without any motion search */
+  bool scene_cut_detection;
+
+  /* the loop filter level is searched within this distance from the one of
+     the previous frame (MAX_LOOP_FILTER_LEVEL searches all of them) */
+  uint8_t loop_filter_search_range;
+
+  /* with a target frame size, only look at the quantizers around the one of
+     the previous frame */
+  bool narrow_quantizer_search;
+
+  static constexpr uint8_t MAX_LOOP_FILTER_LEVEL = 63;
+
+  explicit SpeedPreset( const uint8_t speed );
+  SpeedPreset( const EncoderQuality quality );
+};
+
 enum EncoderMode
 {
   MINIMUM_SSIM,
@@ -67,30 +149,83 @@ enum EncoderMode
   REENCODE
 };
 
-class SafeReferences
+/* the edge-extended Y plane of a reference (so that motion vectors can point
+   outside of it) and its downscaled versions. Both are only built the first
+   time a search asks for them, and encoders (and their copies) that have the
+   same raster as a reference share them. */
+class SafeReference
 {
+private:
+  RasterHandle source_;
+
+  mutable std::once_flag raster_built_ {};
+  mutable Optional<SafeRasterHandle> raster_ {};
+
+  mutable std::once_flag pyramid_built_ {};
+  mutable Optional<LumaPyramid> pyramid_ {};
+
 public:
+  SafeReference( const RasterHandle & source );
+
+  const VP8Raster & source() const { return source_.get(); }
+
+  const SafeRaster & raster() const;
+  const LumaPyramid & pyramid() const;
+};
+
+class SafeReferences
+{
+private:
   /* For now, we only need the Y planes to do the diamond search, so we only
      keep them in our safe references. */
-  SafeRasterHandle last, golden, alternative;
+  std::shared_ptr<const SafeReference> last_, golden_, alternative_;
 
-private:
-  SafeReferences( const uint16_t width, const uint16_t height );
+  const SafeReference & reference( reference_frame reference_id ) const;
 
 public:
   SafeReferences( const References & references );
 
+  /* after the references have changed, keeps what's still there and shares
+     what one reference took over from another */
+  void update( const References & references );
+
   const SafeRaster & get( reference_frame reference_id ) const;
+  const LumaPyramid & pyramid( reference_frame reference_id ) const;
 
   static MutableSafeRasterHandle load( const VP8Raster & source );
 };
 
-template<class FrameType>
-static FramePool<FrameType> & subsampled_frame_pool()
+/* a part of the frame (in pixels) that should look better than the rest, such
+   as a face; see Encoder::segment_macroblocks */
+struct RegionOfInterest
+{
+  unsigned int x, y, width, height;
+};
+
+/* what an encoder needs only while it's encoding: the frames it fills in, a
+   scratch raster and the cost tables. Workspaces are pooled by frame size and
+   lent to an encoder for the duration of an encoding call (see
+   Encoder::WorkspaceLease), so that a stored or copied encoder is not much
+   more than its decoder state and references. */
+struct EncoderWorkspace
 {
-  static FramePool<FrameType> pool;
-  return pool;
-}
+  static const size_t WIDTH_SAMPLE_DIMENSION_FACTOR { 4 };
+  static const size_t HEIGHT_SAMPLE_DIMENSION_FACTOR { 4 };
+
+  KeyFrame key_frame;
+  KeyFrame subsampled_key_frame;
+  InterFrame inter_frame;
+  InterFrame subsampled_inter_frame;
+
+  MutableRasterHandle temp_raster;
+
+  Costs costs {};
+
+  EncoderWorkspace( const uint16_t width, const uint16_t height );
+
+  uint16_t width() const { return key_frame.display_width(); }
+  uint16_t height() const { return key_frame.display_height(); }
+};
 
 class Encoder
 {
@@ -109,10 +244,22 @@ private:
   {
     MotionVector mv;
     size_t first_step;
+    uint32_t distortion; /* SAD at `mv` */
+    size_t sad_evaluations;
   };
 
-  static const size_t WIDTH_SAMPLE_DIMENSION_FACTOR { 4 };
-  static const size_t HEIGHT_SAMPLE_DIMENSION_FACTOR { 4 };
+  struct SplitMVSearchResult
+  {
+    MBPredictionData pred {};
+    uint8_t partition_id { 0 };
+
+    /* indexed by [ sb_row ][ sb_column ] */
+    SafeArray<SafeArray<bmode, 4>, 4> modes {};
+    SafeArray<SafeArray<MotionVector, 4>, 4> motion_vectors {};
+  };
+
+  static const size_t WIDTH_SAMPLE_DIMENSION_FACTOR { EncoderWorkspace::WIDTH_SAMPLE_DIMENSION_FACTOR };
+  static const size_t HEIGHT_SAMPLE_DIMENSION_FACTOR { EncoderWorkspace::HEIGHT_SAMPLE_DIMENSION_FACTOR };
 
   typedef SafeArray<SafeArray<std::pair<uint32_t, uint32_t>,
                               MV_PROB_CNT>,
@@ -121,33 +268,114 @@ private:
   DecoderState decoder_state_;
   uint16_t width() const { return decoder_state_.width; }
   uint16_t height() const { return decoder_state_.height; }
-  MutableRasterHandle temp_raster_handle_ { width(), height() };
   References references_;
   SafeReferences safe_references_;
 
   bool has_state_;
 
-  Costs costs_;
+  /* only there while an encoding call runs */
+  std::unique_ptr<EncoderWorkspace> workspace_ {};
+
+  /* lends a workspace from the pool to the encoder until it goes out of
+     scope, unless the encoder already has one */
+  class WorkspaceLease
+  {
+  private:
+    Encoder & encoder_;
+    bool lent_;
+
+  public:
+    WorkspaceLease( Encoder & encoder );
+    ~WorkspaceLease();
+
+    WorkspaceLease( const WorkspaceLease & ) = delete;
+    WorkspaceLease & operator=( const WorkspaceLease & ) = delete;
+  };
+
+  Costs & costs() { return workspace_->costs; }
+  const Costs & costs() const { return workspace_->costs; }
 
-  bool two_pass_encoder_;
-  EncoderQuality encode_quality_;
+  SpeedPreset speed_;
 
-  KeyFrameHandle key_frame_ { width(), height() };
-  KeyFrameHandle subsampled_key_frame_ { uint16_t( width() / WIDTH_SAMPLE_DIMENSION_FACTOR ),
-      uint16_t( height() / HEIGHT_SAMPLE_DIMENSION_FACTOR ),
-      subsampled_frame_pool<KeyFrame>() };
-  InterFrameHandle inter_frame_ { width(), height() };
-  InterFrameHandle subsampled_inter_frame_ { uint16_t( width() / WIDTH_SAMPLE_DIMENSION_FACTOR ),
-      uint16_t( height() / HEIGHT_SAMPLE_DIMENSION_FACTOR ),
-      subsampled_frame_pool<InterFrame>() };
+  /* every this many frames, the golden reference is refreshed with the
+     current frame and its previous content is moved to the altref
+     (0 keeps the key frame in both for good) */
+  uint32_t golden_refresh_interval_ { DEFAULT_GOLDEN_REFRESH_INTERVAL };
+  uint32_t frames_since_golden_refresh_ { 0 };
+
+  /* the base motion vector of every macroblock in the last encoded frame
+     (zero for intra macroblocks), used as a starting point for the search;
+     it's replaced, never modified, so copies of the encoder share it */
+  std::shared_ptr<const std::vector<MotionVector>> motion_field_ {};
+
+  /* what the lookahead found out about the frame, if it was given one and
+     this is the raster it's for (see analysis_of) */
+  std::shared_ptr<const FrameAnalysis> analysis_ {};
+
+  const FrameAnalysis * analysis_of( const VP8Raster & raster ) const;
+
+  /* the SAD of the new motion vector found for every macroblock (from LAST),
+     which is what decides what "good enough" is for its neighbours; a search
+     works on its own copy (see MotionSearchContext), which replaces this one
+     when the frame is done */
+  std::shared_ptr<const std::vector<uint32_t>> newmv_sads_ {};
+
+  /* the token branch counts of the last inter frame, to tell whether the
+     statistics of the stream are stable (see keep_probability_updates);
+     it's never modified, so copies of the encoder share it */
+  std::shared_ptr<const TokenBranchCounts> last_token_branch_counts_ {};
+
+  static constexpr uint32_t MIN_EARLY_TERMINATION_SAD = 256;
+  static constexpr uint32_t MAX_EARLY_TERMINATION_SAD = 2048;
 
   Optional<uint8_t> loop_filter_level_ {};
 
-  /* if set, while encoding with max target size, the search scope for the
-     proper quantizer will be:
+  /* the quantizer of the last frame that was written. encoding with a target
+     size analyzes the next frame there first and, with
+     narrow_quantizer_search, only looks at the quantizers
      last_y_ac_qi_ - a <= y_ac_qi <= last_y_ac_qi_ + a */
   Optional<uint8_t> last_y_ac_qi_ {};
 
+  /* prob_inter, prob_references_last and prob_references_golden of the last
+     inter frame that was written (0 until there's one), which is where the
+     reference costs of the next one start from; the frame headers of the
+     workspace can't keep them, since it's lent to other encoders in between */
+  SafeArray<uint8_t, 3> reference_probs_ {};
+
+  void restore_reference_probs( InterFrameHeader & header ) const;
+
+  /* predicts the size of a frame at every quantizer, for encoding with a
+     target size */
+  RateModel rate_model_ {};
+
+  /* if the rate model picks a quantizer further than this from the one the
+     frame was analyzed at, the frame is analyzed once more at the new one */
+  static constexpr int MAX_RATE_MODEL_EXTRAPOLATION = 12;
+
+  /* adaptive quantization: the y_ac_qi step between the segments (0 turns it
+     off), the regions that get a segment of their own, how far (1 /
+     AQ_HYSTERESIS) out of the activity range of its segment a macroblock can
+     go before it's moved to another one, and the share (1 / AQ_MAP_REFRESH)
+     of the macroblocks that have to move for the map to be sent again */
+  uint8_t aq_strength_ { 0 };
+  std::vector<RegionOfInterest> regions_of_interest_ {};
+  static constexpr uint32_t AQ_HYSTERESIS = 4;
+  static constexpr size_t AQ_MAP_REFRESH = 8;
+
+  /* intra refresh: where a key frame would be sent, the macroblock columns are
+     intra-coded a band at a time over a run of inter frames instead, each band
+     as wide as what would fit in intra_refresh_size_ bytes (0 turns it off).
+     while a cycle runs, intra_refresh_column_ is the first column that hasn't
+     been refreshed yet, and intra_refresh_width_ the width of its bands, which
+     is worked out once when the cycle starts */
+  size_t intra_refresh_size_ { 0 };
+  Optional<unsigned int> intra_refresh_column_ {};
+  unsigned int intra_refresh_width_ { 0 };
+
+  /* how many threads update the residues of a re-encoded frame (0: one per
+     core); see update_residues */
+  unsigned int reencode_threads_ { 0 };
+
   // TODO: Where did these come from?
   uint32_t RATE_MULTIPLIER { 300 };
   uint32_t DISTORTION_MULTIPLIER { 1 };
@@ -156,8 +384,35 @@ private:
   struct EncodeStats
   {
     Optional<double> ssim;
+
+    /* average number of full-resolution SADs per inter-frame macroblock
+       spent looking for new motion vectors */
+    Optional<double> sad_evaluations_per_mb;
+
+    /* whether the frame was made a key frame because of a scene cut (only
+       for frames that could have been inter frames) */
+    Optional<bool> scene_cut;
   } encode_stats_ {};
 
+  /* what the motion search needs to know about the frame being encoded */
+  struct MotionSearchContext
+  {
+    std::vector<reference_frame> references;
+    std::shared_ptr<const LumaPyramid> pyramid;
+
+    /* from the lookahead, if there was one (or empty) */
+    std::vector<MotionVector> source_motion_field;
+
+    /* full-resolution SADs computed while searching for new motion vectors */
+    size_t sad_evaluations;
+    size_t macroblocks;
+
+    /* newmv_sads_, as it's updated during this search */
+    std::vector<uint32_t> newmv_sads;
+  };
+
+  void finish_motion_search( MotionSearchContext & search );
+
   static uint32_t rdcost( uint32_t rate, uint32_t distortion,
                           uint32_t rate_multiplier,
                           uint32_t distortion_multiplier );
@@ -174,25 +429,104 @@ private:
   static uint32_t variance( const VP8Raster::Block<size> & block,
                             const TwoDSubRange<uint8_t, size, size> & prediction );
 
+  /* the SAD of a subblock against every one of its intra predictions, and
+     the SSE against one of them (see VP8Raster::Block4::intra_predict_all) */
+  static SafeArray<uint32_t, num_intra_b_modes>
+  intra_b_mode_sads( const VP8Raster::Block4 & block,
+                     const VP8Raster::Block4::IntraPredictions & predictions );
+
+  static uint32_t sse( const VP8Raster::Block4 & block,
+                       const SafeArray<uint8_t, 16> & prediction );
+
+  /* these compare `block` against its (interpolated) prediction from
+     `reference` displaced by `mv`, without going through a raster */
+  template<unsigned int size>
+  static uint32_t subpixel_sad( const VP8Raster::Block<size> & block,
+                                const SafeRaster & reference,
+                                const MotionVector & mv );
+
+  template<unsigned int size>
+  static uint32_t subpixel_variance( const VP8Raster::Block<size> & block,
+                                     const SafeRaster & reference,
+                                     const MotionVector & mv );
+
+  /* subpixel_sad against the first `count` (up to four) of `mvs`; if they're
+     all full-pixel vectors, it's one pass over the block (see sad.hh) */
+  static SafeArray<uint32_t, 4> subpixel_sad_x4( const VP8Raster::Block<16> & block,
+                                                 const SafeRaster & reference,
+                                                 const SafeArray<MotionVector, 4> & mvs,
+                                                 const unsigned int count );
+
   MVSearchResult diamond_search( const VP8Raster::Macroblock & original_mb,
-                                 VP8Raster::Macroblock & temp_mb,
                                  InterFrameMacroblock & frame_mb,
-                                 const VP8Raster & reference,
                                  const SafeRaster & safe_reference,
                                  MotionVector base_mv,
                                  MotionVector origin,
                                  size_t step_size,
                                  const size_t y_ac_qi ) const;
 
+  MotionVector pyramid_search( const LumaPyramid & source,
+                               const LumaPyramid & reference,
+                               const unsigned int mb_column,
+                               const unsigned int mb_row,
+                               const std::vector<MotionVector> & seeds,
+                               const MotionVector & base_mv,
+                               const size_t y_ac_qi ) const;
+
+  MotionVector subpixel_search( const VP8Raster::Macroblock & original_mb,
+                                InterFrameMacroblock & frame_mb,
+                                const SafeRaster & safe_reference,
+                                const MotionVector & base_mv,
+                                MotionVector origin ) const;
+
+  SplitMVSearchResult split_mv_search( const VP8Raster::Macroblock & original_mb,
+                                       VP8Raster::Macroblock & temp_mb,
+                                       InterFrameMacroblock & frame_mb,
+                                       const SafeRaster & safe_reference,
+                                       const MotionVector & best_ref,
+                                       const MotionVector & new_mv );
+
+  /* ZEROMV from LAST_FRAME leaves nothing to code, in luma or chroma */
+  bool static_macroblock( const VP8Raster::Macroblock & original_mb,
+                          const Quantizer & quantizer ) const;
+
   void luma_mb_inter_predict( const VP8Raster::Macroblock & original_mb,
                               VP8Raster::Macroblock & constructed_mb,
                               VP8Raster::Macroblock & temp_mb,
                               InterFrameMacroblock & frame_mb,
                               const Quantizer & quantizer,
                               MVComponentCounts & component_counts,
+                              MotionSearchContext & search,
                               const size_t y_ac_qi,
                               const EncoderPass encoder_pass );
 
+  /* adaptive quantization (see segmentation.cc) */
+  bool in_region_of_interest( const unsigned int mb_column, const unsigned int mb_row ) const;
+
+  template<class FrameType>
+  Optional<Segmentation> segment_macroblocks( const VP8Raster & raster, FrameType & frame ) const;
+
+  template<class FrameType>
+  void update_segmentation_map( const FrameType & frame );
+
+  /* intra refresh */
+  bool needs_key_frame( const VP8Raster & raster, const uint8_t y_ac_qi );
+  unsigned int intra_refresh_width( const VP8Raster & raster, const size_t y_ac_qi );
+
+  void luma_mb_intra_refresh( const VP8Raster::Macroblock & original_mb,
+                              VP8Raster::Macroblock & reconstructed_mb,
+                              VP8Raster::Macroblock & temp_mb,
+                              InterFrameMacroblock & frame_mb,
+                              const Quantizer & quantizer );
+
+  void keep_unrefreshed_macroblock( InterFrameMacroblock & frame_mb ) const;
+
+  /* frame-level reference policy */
+  void set_reference_updates( InterFrameHeader & header ) const;
+  bool scene_cut( const VP8Raster & raster );
+  MotionSearchContext prepare_motion_search( const VP8Raster & raster,
+                                             const InterFrameHeader & header );
+
   void luma_mb_apply_inter_prediction( const VP8Raster::Macroblock & original_mb,
                                        VP8Raster::Macroblock & reconstructed_mb,
                                        InterFrameMacroblock & frame_mb,
@@ -259,7 +593,6 @@ private:
 
   bmode luma_sb_intra_predict( const VP8Raster::Block4 & original_sb,
                                VP8Raster::Block4 & constructed_sb,
-                               VP8Raster::Block4 & temp_sb,
                                const SafeArray<uint16_t, num_intra_b_modes> & mode_costs ) const;
 
   void luma_sb_apply_intra_prediction( const VP8Raster::Block4 & original_sb,
@@ -269,13 +602,19 @@ private:
                                        bmode sb_prediction_mode,
                                        const EncoderPass encoder_pass ) const;
 
+  void keyframe_mb_reapply_intra_prediction( const VP8Raster::Macroblock & original_mb,
+                                             VP8Raster::Macroblock & reconstructed_mb,
+                                             VP8Raster::Macroblock & temp_mb,
+                                             KeyFrameMacroblock & frame_mb,
+                                             const Quantizer & quantizer ) const;
+
   template<class FrameSubblockType>
   void trellis_quantize( FrameSubblockType & frame_sb,
                          const Quantizer & quantizer ) const;
 
   void check_reset_y2( Y2Block & y2, const Quantizer & quantizer ) const;
 
-  VP8Raster & temp_raster() { return temp_raster_handle_.get(); }
+  VP8Raster & temp_raster() { return workspace_->temp_raster.get(); }
 
   /* this function returns the ssim value as the output */
   template<class FrameType>
@@ -298,6 +637,16 @@ private:
 
   static unsigned calc_prob( unsigned false_count, unsigned total );
 
+  /* whether going from `current` to `updated` saves more bits on the branch
+     `counts` than it takes to signal the update (see Costs::update_cost) */
+  static bool probability_update_pays_off( const std::pair<uint32_t, uint32_t> & counts,
+                                           const Probability current,
+                                           const Probability updated,
+                                           const Probability update_prob,
+                                           const unsigned int value_bits );
+
+  bool keep_probability_updates( const InterFrameHeader & header ) const;
+
   template<class FrameType>
   std::vector<uint8_t> write_frame( const FrameType & frame );
 
@@ -305,9 +654,14 @@ private:
   std::vector<uint8_t> write_frame( const FrameType & frame, const ProbabilityTables & prob_tables );
 
 
-  /* Encoded frame size estimation */
+  /* Encoded frame size estimation. The residual of every analyzed
+     macroblock goes into `histogram`, for the rate model. */
   template<class FrameType>
-  size_t estimate_size( const VP8Raster & raster, const size_t y_ac_qi );
+  size_t estimate_size( const VP8Raster & raster, const size_t y_ac_qi,
+                        CoefficientHistogram & histogram );
+
+  size_t estimate_frame_size( const VP8Raster & raster, const size_t y_ac_qi,
+                              CoefficientHistogram & histogram, const bool key_frame );
 
   /* Convergence-related stuff */
   template<class FrameType>
@@ -340,6 +694,10 @@ private:
   FrameType & encode_with_quantizer_search( const VP8Raster & raster,
                                             const double minimum_ssim );
 
+  std::vector<uint8_t> encode_with_quantizer( const VP8Raster & raster,
+                                              const uint8_t y_ac_qi,
+                                              const bool key_frame );
+
   void update_rd_multipliers( const Quantizer & quantizer );
 
 public:
@@ -350,6 +708,11 @@ public:
   Encoder( const Decoder & decoder, const bool two_pass,
            const EncoderQuality quality );
 
+  Encoder( const uint16_t s_width, const uint16_t s_height,
+           const SpeedPreset & speed );
+
+  Encoder( const Decoder & decoder, const SpeedPreset & speed );
+
   Encoder( const Encoder & encoder );
 
   Encoder( Encoder && encoder );
@@ -367,14 +730,46 @@ public:
   std::vector<uint8_t> encode_with_target_size( const VP8Raster & raster,
                                                 const size_t target_size );
 
-  void reencode( const std::vector<RasterHandle> & original_rasters,
-                 const std::vector<std::pair<Optional<KeyFrame>, Optional<InterFrame> > > & prediction_frames,
+  /* Re-encodes the originals with the prediction modes of prediction_ivf,
+   * which is decoded starting from prediction_decoder. Both are read a frame
+   * ahead, on another thread, so that only a few frames are held at once. */
+  void reencode( FrameInput & original_rasters,
+                 const IVF & prediction_ivf,
+                 Decoder prediction_decoder,
                  const double kf_q_weight,
                  const bool extra_frame_chunk,
                  IVFWriter & ivf_writer );
 
   size_t estimate_frame_size( const VP8Raster & raster, const size_t y_ac_qi );
 
+  void set_subpixel_search_iterations( const uint8_t iterations ) { speed_.subpixel_search_iterations = iterations; }
+  void set_golden_refresh_interval( const uint32_t interval ) { golden_refresh_interval_ = interval; }
+  void set_split_mv_partitionings( const uint8_t partitionings ) { speed_.split_mv_partitionings = partitionings; }
+  void set_pyramid_search_range( const uint8_t range ) { speed_.pyramid_search_range = range; }
+  void set_predictor_search( const bool enabled ) { speed_.predictor_search = enabled; }
+  void set_scene_cut_detection( const bool enabled ) { speed_.scene_cut_detection = enabled; }
+
+  /* past this, the regions of interest would get a quantizer update that
+     doesn't fit in the segment header */
+  static constexpr uint8_t MAX_AQ_STRENGTH = 63;
+
+  void set_adaptive_quantization( const uint8_t strength ) { aq_strength_ = strength; }
+  void set_regions_of_interest( const std::vector<RegionOfInterest> & regions ) { regions_of_interest_ = regions; }
+
+  /* the lookahead's analysis of the next frame, which is only used to encode
+     the raster that's in it */
+  void set_frame_analysis( const std::shared_ptr<const FrameAnalysis> & analysis ) { analysis_ = analysis; }
+
+  /* the decoder has to start from the same state as the encoder (as it does in
+     salsify), since the first frame isn't a key frame anymore */
+  void set_intra_refresh( const size_t frame_size ) { intra_refresh_size_ = frame_size; }
+
+  /* a caller that runs several encoders at once should give each its share */
+  void set_reencode_threads( const unsigned int threads ) { reencode_threads_ = threads; }
+
+  const SpeedPreset & speed_preset() const { return speed_; }
+  void set_speed_preset( const SpeedPreset & speed ) { speed_ = speed; }
+
   Decoder export_decoder() const { return { decoder_state_, references_ }; }
 
   EncodeStats stats() { return encode_stats_; }
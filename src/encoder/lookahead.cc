@@ -0,0 +1,278 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <algorithm>
+#include <cstdlib>
+#include <limits>
+#include <utility>
+
+#include "lookahead.hh"
+
+using namespace std;
+
+uint32_t luma_activity( const VP8Raster::Block16 & block )
+{
+  uint32_t sum = 0;
+  uint64_t sum_of_squares = 0;
+
+  for ( unsigned int row = 0; row < 16; row++ ) {
+    for ( unsigned int column = 0; column < 16; column++ ) {
+      const uint32_t pixel = block.at( column, row );
+      sum += pixel;
+      sum_of_squares += pixel * pixel;
+    }
+  }
+
+  return sum_of_squares - ( static_cast<uint64_t>( sum ) * sum ) / 256;
+}
+
+FrameComparison::FrameComparison( const LumaPyramid & source, const LumaPyramid & other,
+                                  const unsigned int plane_width )
+{
+  const TwoD<uint8_t> & plane = source.level( 2 );
+
+  for ( unsigned int row = 0; row + 4 <= plane.height(); row += 4 ) {
+    for ( unsigned int column = 0; column + 4 <= min( plane.width(), plane_width ); column += 4 ) {
+      uint32_t sum = 0;
+
+      for ( unsigned int i = 0; i < 4; i++ ) {
+        for ( unsigned int j = 0; j < 4; j++ ) {
+          sum += plane.at( column + j, row + i );
+        }
+      }
+
+      const int mean = ( sum + 8 ) / 16;
+      uint32_t block_intra_sad = 0;
+
+      for ( unsigned int i = 0; i < 4; i++ ) {
+        for ( unsigned int j = 0; j < 4; j++ ) {
+          block_intra_sad += abs( plane.at( column + j, row + i ) - mean );
+        }
+      }
+
+      uint32_t block_inter_sad = numeric_limits<uint32_t>::max();
+
+      for ( int dy = -SEARCH_RANGE; dy <= SEARCH_RANGE; dy++ ) {
+        for ( int dx = -SEARCH_RANGE; dx <= SEARCH_RANGE; dx++ ) {
+          const Optional<uint32_t> sad = source.sad( other, 2, 4, column, row, dx, dy );
+
+          if ( sad.initialized() and sad.get() < block_inter_sad ) {
+            block_inter_sad = sad.get();
+          }
+        }
+      }
+
+      macroblocks++;
+      intra_sad += block_intra_sad;
+      inter_sad += block_inter_sad;
+
+      if ( block_intra_sad < block_inter_sad ) {
+        intra_macroblocks++;
+      }
+    }
+  }
+}
+
+/*
+ * Every vector within FrameComparison::SEARCH_RANGE quarter-resolution pixels
+ * of zero, of the vector that this macroblock had in the previous frame and of
+ * the one that was just found for the macroblock to its left is tried at
+ * quarter resolution, and the best one is refined by a pixel in each direction
+ * at half resolution, by SAD alone.
+ */
+static MotionVector source_motion( const LumaPyramid & source, const LumaPyramid & previous,
+                                   const unsigned int mb_column, const unsigned int mb_row,
+                                   const vector<MotionVector> & seeds )
+{
+  /* (x, y) in pixels of the given level */
+  typedef pair<int, int> Displacement;
+
+  auto search =
+    [&] ( const unsigned int level, const Displacement & center, const int range,
+          Displacement & best, uint32_t & best_sad )
+    {
+      const unsigned int size = 16 >> level;
+      const int scale = 8 << level;
+
+      for ( int dy = center.second - range; dy <= center.second + range; dy++ ) {
+        for ( int dx = center.first - range; dx <= center.first + range; dx++ ) {
+          if ( abs( dx * scale ) > 1023 or abs( dy * scale ) > 1023 ) {
+            continue;
+          }
+
+          const Optional<uint32_t> sad =
+            source.sad( previous, level, size, mb_column * size, mb_row * size, dx, dy );
+
+          if ( sad.initialized() and sad.get() < best_sad ) {
+            best_sad = sad.get();
+            best = { dx, dy };
+          }
+        }
+      }
+    };
+
+  auto to_quarter_pixels =
+    [] ( const int16_t v ) -> int { return ( v + ( v < 0 ? -16 : 16 ) ) / 32; };
+
+  vector<Displacement> centers;
+
+  for ( const MotionVector & seed : seeds ) {
+    const Displacement center { to_quarter_pixels( seed.x() ), to_quarter_pixels( seed.y() ) };
+
+    if ( find( centers.begin(), centers.end(), center ) == centers.end() ) {
+      centers.push_back( center );
+    }
+  }
+
+  Displacement best { 0, 0 };
+  uint32_t best_sad = numeric_limits<uint32_t>::max();
+
+  for ( const Displacement & center : centers ) {
+    search( 2, center, FrameComparison::SEARCH_RANGE, best, best_sad );
+  }
+
+  const Displacement half_center { 2 * best.first, 2 * best.second };
+
+  best = half_center;
+  best_sad = numeric_limits<uint32_t>::max();
+  search( 1, half_center, 1, best, best_sad );
+
+  return MotionVector( best.first * 16, best.second * 16 );
+}
+
+FrameAnalysis::FrameAnalysis( const RasterHandle & s_raster, const FrameAnalysis * previous )
+  : raster( s_raster ), pyramid( raster.get().Y() ), activities(), comparison(), motion_field()
+{
+  const VP8Raster & frame = raster.get();
+
+  activities.reserve( frame.width() / 16 * ( frame.height() / 16 ) );
+
+  frame.macroblocks_forall_ij(
+    [&] ( VP8Raster::ConstMacroblock original_mb, unsigned int, unsigned int )
+    {
+      activities.push_back( luma_activity( original_mb.Y() ) );
+    }
+  );
+
+  if ( not previous ) {
+    return;
+  }
+
+  comparison.initialize( pyramid, previous->pyramid, pyramid.level( 2 ).width() );
+
+  const unsigned int mb_width = frame.width() / 16;
+  const unsigned int mb_height = frame.height() / 16;
+
+  motion_field.reserve( mb_width * mb_height );
+
+  for ( unsigned int mb_row = 0; mb_row < mb_height; mb_row++ ) {
+    for ( unsigned int mb_column = 0; mb_column < mb_width; mb_column++ ) {
+      vector<MotionVector> seeds { MotionVector() };
+
+      if ( not previous->motion_field.empty() ) {
+        seeds.push_back( previous->motion_field.at( motion_field.size() ) );
+      }
+
+      if ( mb_column > 0 ) {
+        seeds.push_back( motion_field.back() );
+      }
+
+      motion_field.push_back( source_motion( pyramid, previous->pyramid, mb_column, mb_row, seeds ) );
+    }
+  }
+}
+
+Lookahead::Lookahead( FrameInput & input, const size_t depth )
+  : input_( input ), depth_( max<size_t>( depth, 1 ) )
+{
+  worker_ = async( launch::async, [this] { analyze_frames(); } );
+}
+
+Lookahead::~Lookahead()
+{
+  {
+    unique_lock<mutex> lock { mutex_ };
+    stopping_ = true;
+  }
+
+  changed_.notify_all();
+  worker_.wait();
+}
+
+void Lookahead::analyze_frames()
+{
+  shared_ptr<const FrameAnalysis> previous;
+
+  try {
+    for ( Optional<RasterHandle> raster = input_.get_next_frame(); raster.initialized();
+          raster = input_.get_next_frame() ) {
+      shared_ptr<const FrameAnalysis> analysis = make_shared<const FrameAnalysis>( raster.get(),
+                                                                                     previous.get() );
+
+      unique_lock<mutex> lock { mutex_ };
+      changed_.wait( lock, [this] { return analyzed_.size() < depth_ or stopping_; } );
+
+      if ( stopping_ ) {
+        return;
+      }
+
+      analyzed_.push_back( analysis );
+      changed_.notify_all();
+
+      previous = move( analysis );
+    }
+  }
+  catch ( ... ) {
+    unique_lock<mutex> lock { mutex_ };
+    error_ = current_exception();
+  }
+
+  unique_lock<mutex> lock { mutex_ };
+  input_done_ = true;
+  changed_.notify_all();
+}
+
+shared_ptr<const FrameAnalysis> Lookahead::next_frame()
+{
+  unique_lock<mutex> lock { mutex_ };
+  changed_.wait( lock, [this] { return not analyzed_.empty() or input_done_; } );
+
+  if ( analyzed_.empty() ) {
+    if ( error_ ) {
+      rethrow_exception( error_ );
+    }
+
+    return {};
+  }
+
+  shared_ptr<const FrameAnalysis> analysis = move( analyzed_.front() );
+  analyzed_.pop_front();
+  changed_.notify_all();
+
+  return analysis;
+}
@@ -0,0 +1,136 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#ifndef LOOKAHEAD_HH
+#define LOOKAHEAD_HH
+
+/* Analysis of the frames to encode, done on a thread of its own a few frames
+   ahead of the encoder. Each frame is compared with the original before it,
+   rather than with what the encoder reconstructed, so that none of this has
+   to wait for the frame before it to be encoded. */
+
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "frame_input.hh"
+#include "optional.hh"
+#include "pyramid.hh"
+#include "raster_handle.hh"
+#include "vp8_header_structures.hh"
+#include "vp8_raster.hh"
+
+/* 256 times the variance of the luma of a macroblock */
+uint32_t luma_activity( const VP8Raster::Block16 & block );
+
+/* Compares a frame with another one at quarter resolution, where each
+   macroblock is a 4x4 block: it's better off intra-coded if its SAD against
+   its own mean is lower than the best SAD it gets from the other frame within
+   SEARCH_RANGE. Only the blocks left of plane_width (in quarter-resolution
+   pixels) are looked at. */
+struct FrameComparison
+{
+  static constexpr int SEARCH_RANGE = 4;
+
+  /* the share of the macroblocks that must be better off intra-coded for the
+     frame to be a scene cut */
+  static constexpr unsigned int SCENE_CUT_INTRA_PERCENT = 75;
+
+  size_t macroblocks { 0 };
+  size_t intra_macroblocks { 0 };
+
+  /* the sums of the SADs above: how busy the frame is, and how much of it
+     can't be predicted from the other one */
+  uint64_t intra_sad { 0 };
+  uint64_t inter_sad { 0 };
+
+  FrameComparison( const LumaPyramid & source, const LumaPyramid & other,
+                   const unsigned int plane_width );
+
+  bool scene_cut() const { return intra_macroblocks * 100 > macroblocks * SCENE_CUT_INTRA_PERCENT; }
+};
+
+struct FrameAnalysis
+{
+  RasterHandle raster;
+  LumaPyramid pyramid;
+
+  /* the luma_activity of every macroblock, in raster order */
+  std::vector<uint32_t> activities;
+
+  /* with the previous original (nothing for the first frame) */
+  Optional<FrameComparison> comparison;
+
+  /* where each macroblock was in the previous original, found on the
+     downscaled planes (full-pixel vectors, in raster order; empty for the
+     first frame) */
+  std::vector<MotionVector> motion_field;
+
+  FrameAnalysis( const RasterHandle & raster, const FrameAnalysis * previous );
+};
+
+class Lookahead
+{
+private:
+  FrameInput & input_;
+  size_t depth_;
+
+  std::mutex mutex_ {};
+  std::condition_variable changed_ {};
+  std::deque<std::shared_ptr<const FrameAnalysis>> analyzed_ {};
+  bool input_done_ { false };
+  bool stopping_ { false };
+  std::exception_ptr error_ {};
+
+  std::future<void> worker_ {};
+
+  void analyze_frames();
+
+public:
+  /* every analyzed frame keeps its raster, so the depth is bounded */
+  static constexpr size_t MAX_DEPTH = 63;
+
+  /* reads from `input` (which nothing else should) on another thread, and
+     analyzes up to `depth` frames before they are asked for */
+  Lookahead( FrameInput & input, const size_t depth );
+  ~Lookahead();
+
+  /* the analysis of the next frame, which has the raster in it, or nothing
+     at the end of the input */
+  std::shared_ptr<const FrameAnalysis> next_frame();
+
+  Lookahead( const Lookahead & ) = delete;
+  Lookahead & operator=( const Lookahead & ) = delete;
+};
+
+#endif /* LOOKAHEAD_HH */
@@ -0,0 +1,91 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include "pyramid.hh"
+#include "exception.hh"
+
+using namespace std;
+
+static void downscale( const TwoD<uint8_t> & source, TwoD<uint8_t> & target )
+{
+  target.forall_ij(
+    [&] ( uint8_t & pixel, unsigned int column, unsigned int row )
+    {
+      pixel = ( source.at( 2 * column,     2 * row )
+              + source.at( 2 * column + 1, 2 * row )
+              + source.at( 2 * column,     2 * row + 1 )
+              + source.at( 2 * column + 1, 2 * row + 1 ) + 2 ) >> 2;
+    }
+  );
+}
+
+LumaPyramid::LumaPyramid( const TwoD<uint8_t> & Y )
+  : half_( Y.width() / 2, Y.height() / 2 ),
+    quarter_( Y.width() / 4, Y.height() / 4 )
+{
+  downscale( Y, half_ );
+  downscale( half_, quarter_ );
+}
+
+const TwoD<uint8_t> & LumaPyramid::level( const unsigned int level ) const
+{
+  switch ( level ) {
+  case 1: return half_;
+  case 2: return quarter_;
+  default: throw LogicError();
+  }
+}
+
+Optional<uint32_t> LumaPyramid::sad( const LumaPyramid & reference, const unsigned int level,
+                                     const unsigned int size,
+                                     const unsigned int column, const unsigned int row,
+                                     const int dx, const int dy ) const
+{
+  const TwoD<uint8_t> & source_plane = this->level( level );
+  const TwoD<uint8_t> & reference_plane = reference.level( level );
+
+  const int reference_column = column + dx;
+  const int reference_row = row + dy;
+
+  if ( reference_column < 0 or reference_row < 0
+       or reference_column + size > reference_plane.width()
+       or reference_row + size > reference_plane.height() ) {
+    return {};
+  }
+
+  uint32_t res = 0;
+
+  for ( unsigned int i = 0; i < size; i++ ) {
+    for ( unsigned int j = 0; j < size; j++ ) {
+      res += abs( source_plane.at( column + j, row + i )
+                  - reference_plane.at( reference_column + j, reference_row + i ) );
+    }
+  }
+
+  return res;
+}
@@ -0,0 +1,61 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+#ifndef PYRAMID_HH
+#define PYRAMID_HH
+
+#include "2d.hh"
+#include "raster.hh"
+
+/* Downscaled copies (1/2 and 1/4) of a luma plane. The motion search uses
+   them to get a rough idea of where each macroblock moved before searching
+   the full-resolution plane. */
+class LumaPyramid
+{
+public:
+  /* level 0 is the full-resolution plane, which we don't keep a copy of */
+  static constexpr unsigned int LEVELS = 3;
+
+private:
+  TwoD<uint8_t> half_;
+  TwoD<uint8_t> quarter_;
+
+public:
+  LumaPyramid( const TwoD<uint8_t> & Y );
+
+  const TwoD<uint8_t> & level( const unsigned int level ) const;
+
+  /* SAD between the size x size block at (column, row) in the given level of
+     this pyramid and the one at (column + dx, row + dy) in `reference`, or
+     nothing if the latter doesn't fit inside the plane */
+  Optional<uint32_t> sad( const LumaPyramid & reference, const unsigned int level,
+                          const unsigned int size,
+                          const unsigned int column, const unsigned int row,
+                          const int dx, const int dy ) const;
+};
+
+#endif /* PYRAMID_HH */
@@ -0,0 +1,270 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <algorithm>
+#include <cmath>
+
+#include "rate_model.hh"
+#include "frame.hh"
+#include "costs.hh"
+#include "exception.hh"
+
+using namespace std;
+
+CoefficientHistogram::CoefficientHistogram()
+  : counts_( BLOCK_TYPES * 2 * ( MAX_MAGNITUDE + 1 ), 0 )
+{}
+
+size_t CoefficientHistogram::bin( const BlockType type, const bool ac, const unsigned int magnitude )
+{
+  return ( type * 2 + ac ) * ( MAX_MAGNITUDE + 1 ) + min( magnitude, MAX_MAGNITUDE );
+}
+
+void CoefficientHistogram::add( const BlockType type, const DCTCoefficients & coefficients,
+                                const unsigned int first, const uint32_t weight )
+{
+  for ( unsigned int i = first; i < 16; i++ ) {
+    counts_.at( bin( type, i != 0, abs( coefficients.at( i ) ) ) ) += weight;
+  }
+}
+
+template<class MacroblockType>
+void CoefficientHistogram::add( const VP8Raster::Macroblock & original_mb,
+                                const VP8Raster::Macroblock & predicted_mb,
+                                const MacroblockType & frame_mb,
+                                const Quantizer & quantizer,
+                                const uint32_t weight )
+{
+  const bool reconstructed_luma = frame_mb.Y2().prediction_mode() == B_PRED;
+
+  SafeArray<int16_t, 16> walsh_input;
+
+  frame_mb.Y().forall_ij(
+    [&] ( const YBlock & frame_sb, unsigned int sb_column, unsigned int sb_row )
+    {
+      DCTCoefficients residual;
+      residual.subtract_dct( original_mb.Y_sub_at( sb_column, sb_row ),
+                             predicted_mb.Y_sub_at( sb_column, sb_row ).contents() );
+
+      if ( reconstructed_luma ) {
+        residual = residual + frame_sb.dequantize( quantizer );
+      }
+
+      if ( frame_mb.Y2().coded() ) {
+        /* the DC goes through Y2 */
+        walsh_input.at( sb_column + 4 * sb_row ) = residual.at( 0 );
+        add( Y_after_Y2, residual, 1, weight );
+      }
+      else {
+        add( Y_without_Y2, residual, 0, weight );
+      }
+    }
+  );
+
+  if ( frame_mb.Y2().coded() ) {
+    DCTCoefficients y2_residual;
+    y2_residual.wht( walsh_input );
+    add( Y2, y2_residual, 0, weight );
+  }
+
+  frame_mb.U().forall_ij(
+    [&] ( const UVBlock &, unsigned int sb_column, unsigned int sb_row )
+    {
+      DCTCoefficients residual;
+      residual.subtract_dct( original_mb.U_sub_at( sb_column, sb_row ),
+                             predicted_mb.U_sub_at( sb_column, sb_row ).contents() );
+      add( UV, residual, 0, weight );
+    }
+  );
+
+  frame_mb.V().forall_ij(
+    [&] ( const UVBlock &, unsigned int sb_column, unsigned int sb_row )
+    {
+      DCTCoefficients residual;
+      residual.subtract_dct( original_mb.V_sub_at( sb_column, sb_row ),
+                             predicted_mb.V_sub_at( sb_column, sb_row ).contents() );
+      add( UV, residual, 0, weight );
+    }
+  );
+}
+
+template void CoefficientHistogram::add<KeyFrameMacroblock>( const VP8Raster::Macroblock &,
+                                                             const VP8Raster::Macroblock &,
+                                                             const KeyFrameMacroblock &,
+                                                             const Quantizer &, const uint32_t );
+
+template void CoefficientHistogram::add<InterFrameMacroblock>( const VP8Raster::Macroblock &,
+                                                               const VP8Raster::Macroblock &,
+                                                               const InterFrameMacroblock &,
+                                                               const Quantizer &, const uint32_t );
+
+/* the quantizer factor used for the DC or AC coefficients of a block type */
+static uint16_t quantizer_factor( const Quantizer & quantizer, const BlockType type, const bool ac )
+{
+  switch ( type ) {
+  case Y_after_Y2:
+  case Y_without_Y2: return ac ? quantizer.y_ac : quantizer.y_dc;
+  case Y2: return ac ? quantizer.y2_ac : quantizer.y2_dc;
+  case UV: return ac ? quantizer.uv_ac : quantizer.uv_dc;
+  }
+
+  throw LogicError();
+}
+
+SafeArray<size_t, RateModel::QUANTIZER_INDICES>
+RateModel::predict( const CoefficientHistogram & histogram,
+                    const ProbabilityTables & probability_tables,
+                    const uint8_t probe_y_ac_qi,
+                    const size_t probe_size ) const
+{
+  constexpr unsigned int BINS = CoefficientHistogram::MAX_MAGNITUDE + 1;
+
+  Costs costs;
+  costs.fill_token_costs( probability_tables );
+
+  /* the cost of every level, in 1/256 bits. We don't know where in the block a
+     coefficient is or what came before it, so the token is priced as the
+     average over the bands and contexts it could be coded in */
+  SafeArray<SafeArray<vector<uint32_t>, 2>, BLOCK_TYPES> level_costs;
+
+  /* cumulative counts, so that how many coefficients quantize to a given
+     level is a subtraction */
+  SafeArray<SafeArray<vector<uint64_t>, 2>, BLOCK_TYPES> cumulative;
+
+  for ( unsigned int type = 0; type < BLOCK_TYPES; type++ ) {
+    for ( unsigned int ac = 0; ac < 2; ac++ ) {
+      SafeArray<uint32_t, MAX_ENTROPY_TOKENS> token_costs;
+
+      for ( unsigned int token = 0; token < MAX_ENTROPY_TOKENS; token++ ) {
+        const unsigned int first_band = ac ? 1 : 0;
+        const unsigned int last_band = ac ? COEF_BANDS - 1 : 0;
+
+        uint32_t total = 0;
+        for ( unsigned int band = first_band; band <= last_band; band++ ) {
+          for ( unsigned int context = 0; context < PREV_COEF_CONTEXTS; context++ ) {
+            total += costs.token_costs.at( type ).at( band ).at( context ).at( token );
+          }
+        }
+
+        token_costs.at( token ) = total / ( ( last_band - first_band + 1 ) * PREV_COEF_CONTEXTS );
+      }
+
+      vector<uint32_t> & levels = level_costs.at( type ).at( ac );
+      levels.resize( BINS );
+
+      for ( unsigned int level = 1; level < BINS; level++ ) {
+        levels.at( level ) = token_costs.at( Costs::token_for_coeff( level ) )
+                           + Costs::coeff_base_cost( level );
+      }
+
+      vector<uint64_t> & sums = cumulative.at( type ).at( ac );
+      sums.resize( BINS + 1 );
+      sums.at( 0 ) = 0;
+
+      for ( unsigned int magnitude = 0; magnitude < BINS; magnitude++ ) {
+        sums.at( magnitude + 1 ) = sums.at( magnitude )
+                                 + histogram.count( static_cast<BlockType>( type ), ac, magnitude );
+      }
+    }
+  }
+
+  /* bits spent on coefficients at every quantizer, as far as the token costs can tell */
+  SafeArray<double, QUANTIZER_INDICES> coefficient_bits;
+
+  for ( unsigned int y_ac_qi = 0; y_ac_qi < QUANTIZER_INDICES; y_ac_qi++ ) {
+    QuantIndices quant_indices;
+    quant_indices.y_ac_qi = y_ac_qi;
+    const Quantizer quantizer( quant_indices );
+
+    uint64_t cost = 0;
+
+    for ( unsigned int type = 0; type < BLOCK_TYPES; type++ ) {
+      for ( unsigned int ac = 0; ac < 2; ac++ ) {
+        const unsigned int factor = quantizer_factor( quantizer, static_cast<BlockType>( type ), ac );
+        const vector<uint64_t> & sums = cumulative.at( type ).at( ac );
+        const vector<uint32_t> & levels = level_costs.at( type ).at( ac );
+
+        /* quantization truncates, so |c| in [level * factor, (level + 1) * factor) becomes level */
+        for ( unsigned int level = 1; level * factor < BINS; level++ ) {
+          const unsigned int low = level * factor;
+          const unsigned int high = min( low + factor, BINS );
+
+          cost += ( sums.at( high ) - sums.at( low ) ) * levels.at( level );
+        }
+      }
+    }
+
+    coefficient_bits.at( y_ac_qi ) = cost / 256.0;
+  }
+
+  /* the token costs leave out the zeros, the EOBs and the probability
+     updates, and don't see the actual contexts, so they don't add up to the
+     real size; we only trust how they change with the quantizer. Whatever
+     the analysis pass spent beyond them is taken to be overhead that doesn't
+     depend on the quantizer, but it can't be everything. */
+  const double probe_bits = probe_size * 8.0;
+  const double probe_coefficient_bits = coefficient_bits.at( probe_y_ac_qi );
+
+  double overhead = probe_bits - probe_coefficient_bits;
+  double scale = 1.0;
+
+  if ( overhead < probe_bits * MIN_OVERHEAD_FRACTION ) {
+    overhead = probe_bits * MIN_OVERHEAD_FRACTION;
+    scale = ( probe_bits - overhead ) / probe_coefficient_bits;
+  }
+
+  SafeArray<size_t, QUANTIZER_INDICES> sizes;
+
+  for ( unsigned int y_ac_qi = 0; y_ac_qi < QUANTIZER_INDICES; y_ac_qi++ ) {
+    sizes.at( y_ac_qi ) = lrint( correction_ * ( overhead + scale * coefficient_bits.at( y_ac_qi ) ) / 8.0 );
+  }
+
+  return sizes;
+}
+
+void RateModel::update( const size_t predicted_size, const size_t actual_size )
+{
+  if ( predicted_size == 0 ) {
+    return;
+  }
+
+  const double error = abs( static_cast<double>( actual_size ) - predicted_size ) / predicted_size;
+  typical_error_ += ( error - typical_error_ ) * ERROR_UPDATE_WEIGHT / 16.0;
+
+  /* what the correction should have been for this frame */
+  const double observed = correction_ * actual_size / predicted_size;
+
+  correction_ += ( observed - correction_ ) * CORRECTION_UPDATE_WEIGHT / 16.0;
+
+  if ( correction_ < MIN_CORRECTION ) {
+    correction_ = MIN_CORRECTION;
+  }
+  else if ( correction_ > MAX_CORRECTION ) {
+    correction_ = MAX_CORRECTION;
+  }
+}
@@ -0,0 +1,134 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+#ifndef RATE_MODEL_HH
+#define RATE_MODEL_HH
+
+#include <vector>
+
+#include "safe_array.hh"
+#include "vp8_raster.hh"
+#include "block.hh"
+#include "quantization.hh"
+#include "decoder.hh"
+
+/* Magnitudes of the residual DCT coefficients of a frame, before quantization,
+   split by block type and by DC / AC position (which use different quantizer
+   factors). */
+class CoefficientHistogram
+{
+public:
+  static constexpr unsigned int MAX_MAGNITUDE = 2047;
+
+private:
+  /* indexed by bin( type, ac, magnitude ) */
+  std::vector<uint32_t> counts_;
+
+  static size_t bin( const BlockType type, const bool ac, const unsigned int magnitude );
+
+  void add( const BlockType type, const DCTCoefficients & coefficients,
+            const unsigned int first, const uint32_t weight );
+
+public:
+  CoefficientHistogram();
+
+  /* Adds the residual of a macroblock whose modes have been decided, but
+     that hasn't been reconstructed yet: `predicted_mb` holds its prediction,
+     except for the luma of B_PRED, where every subblock is reconstructed as
+     soon as it's coded (the next one is predicted from it). The residual of
+     those is recovered by adding the dequantized coefficients back.
+     `weight` is how many macroblocks of the full frame this one stands for. */
+  template<class MacroblockType>
+  void add( const VP8Raster::Macroblock & original_mb,
+            const VP8Raster::Macroblock & predicted_mb,
+            const MacroblockType & frame_mb,
+            const Quantizer & quantizer,
+            const uint32_t weight );
+
+  uint32_t count( const BlockType type, const bool ac, const unsigned int magnitude ) const
+  {
+    return counts_.at( bin( type, ac, magnitude ) );
+  }
+};
+
+/* Predicts the size of a frame at every quantizer from one analysis pass.
+
+   The coefficient bits at quantizer q are estimated by quantizing the
+   histogram with q and pricing every nonzero level with the token costs; the
+   rest of the frame (headers, modes, motion vectors, zeros and EOBs) is
+   assumed not to depend on q. The analysis pass gives the size of the frame
+   at one quantizer, which pins down that overhead. What's left of the error
+   (mostly from the subsampling done by the analysis pass) is corrected
+   online, from the sizes of the frames that actually got encoded. */
+class RateModel
+{
+public:
+  static constexpr unsigned int QUANTIZER_INDICES = 128;
+
+  /* the smallest part of the frame that is assumed not to be coefficients */
+  static constexpr double MIN_OVERHEAD_FRACTION = 0.125;
+
+  /* how much each new observation moves the correction factor, in 1/16 */
+  static constexpr unsigned int CORRECTION_UPDATE_WEIGHT = 8;
+
+  static constexpr double MIN_CORRECTION = 0.25;
+  static constexpr double MAX_CORRECTION = 4.0;
+
+  /* same for the typical error, in 1/16 */
+  static constexpr unsigned int ERROR_UPDATE_WEIGHT = 4;
+
+private:
+  double correction_ { 1.0 };
+
+  /* how far off the predictions usually are, relative to the prediction */
+  double typical_error_ { 0.1 };
+
+public:
+  /* predicted size, in bytes, of the frame for every y_ac_qi, given the
+     histogram collected while analyzing it at probe_y_ac_qi and the size
+     the analysis came up with; the tokens are priced with the probabilities
+     the frame is going to be coded with */
+  SafeArray<size_t, QUANTIZER_INDICES> predict( const CoefficientHistogram & histogram,
+                                                const ProbabilityTables & probability_tables,
+                                                const uint8_t probe_y_ac_qi,
+                                                const size_t probe_size ) const;
+
+  /* called after encoding a frame whose size was predicted to be
+     `predicted_size` but turned out to be `actual_size` */
+  void update( const size_t predicted_size, const size_t actual_size );
+
+  double correction() const { return correction_; }
+
+  /* whether a frame predicted to be `predicted_size` is likely to fit in
+     `target_size`, leaving room for the usual error */
+  bool fits( const size_t predicted_size, const size_t target_size ) const
+  {
+    return predicted_size * ( 1.0 + typical_error_ ) <= target_size;
+  }
+};
+
+#endif /* RATE_MODEL_HH */
@@ -28,6 +28,11 @@
 
 #include <limits>
 #include <cmath>
+#include <atomic>
+#include <condition_variable>
+#include <future>
+#include <mutex>
+#include <thread>
 
 #include "encoder.hh"
 #include "scorer.hh"
@@ -81,7 +86,9 @@ InterFrame Encoder::reencode_as_interframe( const VP8Raster & original_raster,
 
   ProbabilityTables temp_tables = decoder_state_.probability_tables;
   temp_tables.update( if_header );
-  costs_.fill_mv_component_costs( temp_tables.motion_vector_probs );
+  costs().fill_mv_component_costs( temp_tables.motion_vector_probs );
+
+  MotionSearchContext search = prepare_motion_search( original_raster, if_header );
 
   original_raster.macroblocks_forall_ij(
     [&] ( VP8Raster::ConstMacroblock original_mb, unsigned int mb_column, unsigned int mb_row )
@@ -92,7 +99,7 @@ InterFrame Encoder::reencode_as_interframe( const VP8Raster & original_raster,
 
       // Process Y and Y2
       luma_mb_inter_predict( original_mb.macroblock(), reconstructed_mb, temp_mb,
-                             frame_mb, quantizer, component_counts,
+                             frame_mb, quantizer, component_counts, search,
                              frame.header().quant_indices.y_ac_qi, FIRST_PASS );
 
       if ( frame_mb.inter_coded() ) {
@@ -118,6 +125,7 @@ InterFrame Encoder::reencode_as_interframe( const VP8Raster & original_raster,
   );
 
   frame.relink_y2_blocks();
+  finish_motion_search( search );
 
   optimize_prob_skip( frame );
   optimize_interframe_probs( frame );
@@ -275,23 +283,126 @@ InterFrame Encoder::update_residues( const VP8Raster & original_raster,
   MutableRasterHandle reconstructed_raster_handle { width(), height() };
   VP8Raster & reconstructed_raster = reconstructed_raster_handle.get();
 
-  TokenBranchCounts token_branch_counts;
+  /* The macroblocks are updated on several threads, a row at a time, with
+     the rows handed out in order. An inter macroblock only reads the
+     references, but an intra one reads what has been reconstructed to its
+     left, above-left, above and above-right, so it sleeps until the row
+     above has got past it. Counting the token branches needs the macroblocks
+     to the left and above to be done too (for the contexts), and every
+     thread counts its own. */
+  const unsigned int mb_width = original_raster.width() / 16;
+  const unsigned int mb_height = original_raster.height() / 16;
+
+  atomic<unsigned int> next_row { 0 };
+
+  /* how many macroblocks of each row are done, and whether a thread has
+     failed, under progress_mutex */
+  mutex progress_mutex;
+  condition_variable progress_made;
+  vector<unsigned int> rows_done( mb_height, 0 );
+  bool failed = false;
+
+  /* false if another thread has failed */
+  auto wait_for_row_above =
+    [&] ( const unsigned int mb_row, const unsigned int columns )
+    {
+      unique_lock<mutex> lock( progress_mutex );
 
-  original_raster.macroblocks_forall_ij(
-    [&] ( VP8Raster::ConstMacroblock original_mb, unsigned int mb_column, unsigned int mb_row )
+      progress_made.wait( lock,
+        [&] { return failed or mb_row == 0 or rows_done.at( mb_row - 1 ) >= columns; } );
+
+      return not failed;
+    };
+
+  auto report_progress =
+    [&] ( const unsigned int mb_row, const unsigned int columns )
     {
-      auto reconstructed_mb = reconstructed_raster.macroblock( mb_column, mb_row );
-      auto temp_mb = temp_raster().macroblock( mb_column, mb_row );
-      auto & original_fmb = original_frame.macroblocks().at( mb_column, mb_row );
-      auto & frame_mb = frame.mutable_macroblocks().at( mb_column, mb_row );
+      {
+        unique_lock<mutex> lock( progress_mutex );
+        rows_done.at( mb_row ) = columns;
+      }
 
-      update_macroblock( original_mb.macroblock(), reconstructed_mb, temp_mb, frame_mb,
-                         original_fmb, quantizer );
+      progress_made.notify_all();
+    };
 
-      frame_mb.calculate_has_nonzero();
-      frame_mb.accumulate_token_branches( token_branch_counts );
+  auto give_up =
+    [&] ()
+    {
+      {
+        unique_lock<mutex> lock( progress_mutex );
+        failed = true;
+      }
+
+      progress_made.notify_all();
+    };
+
+  auto update_rows =
+    [&] () -> TokenBranchCounts
+    {
+      TokenBranchCounts counts;
+
+      try {
+        for ( unsigned int mb_row = next_row++; mb_row < mb_height; mb_row = next_row++ ) {
+          for ( unsigned int mb_column = 0; mb_column < mb_width; mb_column++ ) {
+            auto & original_fmb = original_frame.macroblocks().at( mb_column, mb_row );
+
+            if ( not original_fmb.inter_coded() and not wait_for_row_above( mb_row, min( mb_column + 2, mb_width ) ) ) {
+              return counts;
+            }
+
+            auto original_mb = original_raster.macroblock( mb_column, mb_row );
+            auto reconstructed_mb = reconstructed_raster.macroblock( mb_column, mb_row );
+            auto temp_mb = temp_raster().macroblock( mb_column, mb_row );
+            auto & frame_mb = frame.mutable_macroblocks().at( mb_column, mb_row );
+
+            update_macroblock( original_mb.macroblock(), reconstructed_mb, temp_mb, frame_mb,
+                               original_fmb, quantizer );
+
+            frame_mb.calculate_has_nonzero();
+
+            if ( not wait_for_row_above( mb_row, mb_column + 1 ) ) {
+              return counts;
+            }
+
+            frame_mb.accumulate_token_branches( counts );
+
+            report_progress( mb_row, mb_column + 1 );
+          }
+        }
+      }
+      catch ( ... ) {
+        give_up();
+        throw;
+      }
+
+      return counts;
+    };
+
+  const unsigned int threads = reencode_threads_ ? reencode_threads_ : thread::hardware_concurrency();
+  const unsigned int thread_count = max( 1u, min( threads, mb_height ) );
+
+  vector<future<TokenBranchCounts>> helpers;
+  for ( unsigned int i = 1; i < thread_count; i++ ) {
+    helpers.push_back( async( launch::async, update_rows ) );
+  }
+
+  TokenBranchCounts token_branch_counts = update_rows();
+
+  /* the sums don't depend on which thread counted what */
+  for ( auto & helper : helpers ) {
+    const TokenBranchCounts counts = helper.get();
+
+    for ( unsigned int i = 0; i < BLOCK_TYPES; i++ ) {
+      for ( unsigned int j = 0; j < COEF_BANDS; j++ ) {
+        for ( unsigned int k = 0; k < PREV_COEF_CONTEXTS; k++ ) {
+          for ( unsigned int l = 0; l < ENTROPY_NODES; l++ ) {
+            token_branch_counts.at( i ).at( j ).at( k ).at( l ).first += counts.at( i ).at( j ).at( k ).at( l ).first;
+            token_branch_counts.at( i ).at( j ).at( k ).at( l ).second += counts.at( i ).at( j ).at( k ).at( l ).second;
+          }
+        }
+      }
     }
-  );
+  }
 
   frame.relink_y2_blocks();
 
@@ -302,26 +413,92 @@ InterFrame Encoder::update_residues( const VP8Raster & original_raster,
   return frame;
 }
 
-void Encoder::reencode( const vector<RasterHandle> & original_rasters,
-                        const vector<pair<Optional<KeyFrame>, Optional<InterFrame>>> & prediction_frames,
+/* one frame of a re-encode: the original, and how it was predicted */
+struct ReencodeInput
+{
+  RasterHandle original;
+  Optional<KeyFrame> key_frame;
+  Optional<InterFrame> inter_frame;
+};
+
+void Encoder::reencode( FrameInput & original_rasters,
+                        const IVF & prediction_ivf,
+                        Decoder prediction_decoder,
                         const double kf_q_weight,
                         const bool extra_frame_chunk,
                         IVFWriter & ivf_writer )
 {
-  if ( original_rasters.empty() ) {
+  unsigned int frames_read = 0;
+
+  /* reads the next original, and parses and decodes the next prediction frame */
+  auto read_frame =
+    [&original_rasters, &prediction_ivf, &prediction_decoder, &frames_read] () -> Optional<ReencodeInput>
+    {
+      Optional<RasterHandle> original = original_rasters.get_next_frame();
+
+      if ( frames_read == prediction_ivf.frame_count() ) {
+        if ( original.initialized() ) {
+          throw runtime_error( "prediction/original_rasters mismatch" );
+        }
+
+        return {};
+      }
+      else if ( not original.initialized() ) {
+        throw runtime_error( "prediction/original_rasters mismatch" );
+      }
+
+      UncompressedChunk unch { prediction_ivf.frame( frames_read++ ),
+                               prediction_ivf.width(), prediction_ivf.height(), false };
+
+      if ( unch.key_frame() ) {
+        KeyFrame frame = prediction_decoder.parse_frame<KeyFrame>( unch );
+        prediction_decoder.decode_frame( frame );
+
+        return Optional<ReencodeInput>( true, ReencodeInput { original.get(), move( frame ), {} } );
+      } else {
+        InterFrame frame = prediction_decoder.parse_frame<InterFrame>( unch );
+        prediction_decoder.decode_frame( frame );
+
+        return Optional<ReencodeInput>( true, ReencodeInput { original.get(), {}, move( frame ) } );
+      }
+    };
+
+  Optional<ReencodeInput> current = read_frame();
+
+  if ( not current.initialized() ) {
     throw runtime_error( "no rasters to re-encode" );
-  } else if ( original_rasters.size() != prediction_frames.size() ) {
-    throw runtime_error( "prediction/original_rasters mismatch" );
   }
 
-  unsigned int start_frame_index = ( extra_frame_chunk ? 1 : 0 );
+  /* the frame after the current one is read (on another thread) while the
+     current one is re-encoded; only the first frame is needed a second time,
+     and only its quantizer */
+  future<Optional<ReencodeInput>> upcoming = async( launch::async, read_frame );
+  Optional<QuantIndices> first_key_frame_quantizer;
+
+  const WorkspaceLease lease { *this };
+
+  const unsigned int start_frame_index = ( extra_frame_chunk ? 1 : 0 );
+
+  for ( unsigned int frame_index = 0; current.initialized(); frame_index++ ) {
+    Optional<ReencodeInput> next = upcoming.get();
+
+    if ( next.initialized() ) {
+      upcoming = async( launch::async, read_frame );
+    }
+
+    const ReencodeInput & prediction_frame_ref = current.get();
+    const VP8Raster & target_output = prediction_frame_ref.original.get();
 
-  for ( unsigned int frame_index = start_frame_index;
-        frame_index < original_rasters.size();
-        frame_index++ ) {
-    const VP8Raster & target_output = original_rasters.at( frame_index ).get();
+    const bool last_frame = not next.initialized();
 
-    bool last_frame = ( frame_index == prediction_frames.size() - 1 );
+    if ( frame_index == 0 and prediction_frame_ref.key_frame.initialized() ) {
+      first_key_frame_quantizer.initialize( prediction_frame_ref.key_frame.get().header().quant_indices );
+    }
+
+    if ( frame_index < start_frame_index ) {
+      current = move( next );
+      continue;
+    }
 
     if ( target_output.display_width() != width()
          or target_output.display_height() != height()
@@ -330,52 +507,47 @@ void Encoder::reencode( const vector<RasterHandle> & original_rasters,
       throw runtime_error( "raster size mismatch" );
     }
 
-    const auto & prediction_frame_ref = prediction_frames.at( frame_index );
-
     /* Option 1: Is this an initial KeyFrame that should be re-encoded as an InterFrame? */
-    if ( (frame_index == start_frame_index) and prediction_frame_ref.first.initialized() ) {
-      QuantIndices new_quantizer = prediction_frame_ref.first.get().header().quant_indices;
+    if ( (frame_index == start_frame_index) and prediction_frame_ref.key_frame.initialized() ) {
+      QuantIndices new_quantizer = prediction_frame_ref.key_frame.get().header().quant_indices;
 
       /* try to steal the quantizer from the next frame (if it's an interframe */
-      if ( frame_index + 1 < prediction_frames.size() ) {
-        const auto & next_frame_ref = prediction_frames.at( frame_index + 1 );
-        if ( next_frame_ref.second.initialized() ) {
-          /* it's an InterFrame */
+      if ( next.initialized() and next.get().inter_frame.initialized() ) {
+        /* it's an InterFrame */
 
-          new_quantizer.y_ac_qi = lrint( kf_q_weight * prediction_frame_ref.first.get().header().quant_indices.y_ac_qi
-                                         + ( 1 - kf_q_weight ) * next_frame_ref.second.get().header().quant_indices.y_ac_qi );
-        }
+        new_quantizer.y_ac_qi = lrint( kf_q_weight * prediction_frame_ref.key_frame.get().header().quant_indices.y_ac_qi
+                                       + ( 1 - kf_q_weight ) * next.get().inter_frame.get().header().quant_indices.y_ac_qi );
       }
 
-      ivf_writer.append_frame( write_frame( reencode_as_interframe( target_output, prediction_frame_ref.first.get(), new_quantizer ) ) );
-
-      continue;
+      ivf_writer.append_frame( write_frame( reencode_as_interframe( target_output, prediction_frame_ref.key_frame.get(), new_quantizer ) ) );
     } else if ( frame_index == start_frame_index and extra_frame_chunk ) {
       /* Option 2: Is this the first interframe of an extra-frame chunk?
          Then update the quantizer. */
 
-      if ( not prediction_frames.at( 0 ).first.initialized() ) {
+      if ( not first_key_frame_quantizer.initialized() ) {
         throw runtime_error( "extra-frame chunks must start with a keyframe." );
       }
 
-      QuantIndices new_quantizer = prediction_frame_ref.second.get().header().quant_indices;
-      new_quantizer.y_ac_qi = lrint( kf_q_weight *  prediction_frames.at( 0 ).first.get().header().quant_indices.y_ac_qi
-                                     + ( 1 - kf_q_weight ) * prediction_frame_ref.second.get().header().quant_indices.y_ac_qi );
+      QuantIndices new_quantizer = prediction_frame_ref.inter_frame.get().header().quant_indices;
+      new_quantizer.y_ac_qi = lrint( kf_q_weight * first_key_frame_quantizer.get().y_ac_qi
+                                     + ( 1 - kf_q_weight ) * prediction_frame_ref.inter_frame.get().header().quant_indices.y_ac_qi );
 
       ivf_writer.append_frame( write_frame( update_residues( target_output,
-                                                             prediction_frame_ref.second.get(),
+                                                             prediction_frame_ref.inter_frame.get(),
                                                              new_quantizer, last_frame ) ) );
-    } else if ( prediction_frame_ref.first.initialized() ) {
+    } else if ( prediction_frame_ref.key_frame.initialized() ) {
       /* Option 3: Is this another KeyFrame? Then preserve it. */
-      ivf_writer.append_frame( write_frame( prediction_frame_ref.first.get() ) );
-    } else if ( prediction_frame_ref.second.initialized() ) {
+      ivf_writer.append_frame( write_frame( prediction_frame_ref.key_frame.get() ) );
+    } else if ( prediction_frame_ref.inter_frame.initialized() ) {
       /* Option 4: Is this an InterFrame? Then update residues. */
       ivf_writer.append_frame( write_frame( update_residues( target_output,
-                                                             prediction_frame_ref.second.get(),
-                                                             prediction_frame_ref.second.get().header().quant_indices,
+                                                             prediction_frame_ref.inter_frame.get(),
+                                                             prediction_frame_ref.inter_frame.get().header().quant_indices,
                                                              last_frame ) ) );
     } else {
       throw runtime_error( "prediction_frames contained two undefined values" );
     }
+
+    current = move( next );
   }
 }
@@ -0,0 +1,350 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <algorithm>
+#include <cstdlib>
+
+#include "residual.hh"
+#include "dct_sse.hh"
+
+#ifdef HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+using namespace std;
+
+static bool reciprocal( const uint16_t factor, uint16_t & multiplier, uint16_t & shift )
+{
+  unsigned int l = 0;
+  while ( ( 1u << l ) < factor ) {
+    l++;
+  }
+
+  if ( l < 2 ) {
+    return false;
+  }
+
+  multiplier = ( ( 1u << 16 ) * ( ( 1u << l ) - factor ) ) / factor + 1;
+  shift = 1u << ( 17 - l );
+
+  return true;
+}
+
+/* the smallest SAD for which 7/8 * SAD + 4 can reach `factor` */
+static uint32_t sad_limit( const uint16_t factor )
+{
+  return ( factor > 4 ) ? ( 8 * factor - 26 ) / 7 : 0;
+}
+
+BlockQuantizer::BlockQuantizer( const pair<uint16_t, uint16_t> & factors )
+  : factors_( factors ), exact_( true ),
+    zero_sad_limit_( sad_limit( min( factors.first, factors.second ) ) ),
+    zero_ac_sad_limit_( sad_limit( factors.second ) )
+{
+  uint16_t ac_multiplier = 0, ac_shift = 0;
+
+  exact_ = reciprocal( factors.first, multipliers_.at( 0 ), shifts_.at( 0 ) )
+       and reciprocal( factors.second, ac_multiplier, ac_shift );
+
+  for ( unsigned int i = 1; i < 16; i++ ) {
+    multipliers_.at( i ) = ac_multiplier;
+    shifts_.at( i ) = ac_shift;
+  }
+}
+
+uint16_t BlockQuantizer::quantize( DCTCoefficients & coefficients ) const
+{
+#ifdef HAVE_SSE2
+
+  if ( exact_ ) {
+    __m128i zero[ 2 ];
+
+    for ( unsigned int half = 0; half < 2; half++ ) {
+      __m128i * data = reinterpret_cast<__m128i *>( &coefficients.at( 8 * half ) );
+
+      const __m128i x = _mm_loadu_si128( data );
+      const __m128i sign = _mm_srai_epi16( x, 15 );
+      const __m128i magnitude = _mm_sub_epi16( _mm_xor_si128( x, sign ), sign );
+
+      const __m128i t = _mm_mulhi_epu16( magnitude,
+        _mm_load_si128( reinterpret_cast<const __m128i *>( &multipliers_.at( 8 * half ) ) ) );
+
+      __m128i q = _mm_add_epi16( t, _mm_srli_epi16( _mm_sub_epi16( magnitude, t ), 1 ) );
+      q = _mm_mulhi_epu16( q,
+        _mm_load_si128( reinterpret_cast<const __m128i *>( &shifts_.at( 8 * half ) ) ) );
+      q = _mm_sub_epi16( _mm_xor_si128( q, sign ), sign );
+
+      _mm_storeu_si128( data, q );
+      zero[ half ] = _mm_cmpeq_epi16( q, _mm_setzero_si128() );
+    }
+
+    return ~_mm_movemask_epi8( _mm_packs_epi16( zero[ 0 ], zero[ 1 ] ) ) & 0xffff;
+  }
+
+#endif
+
+  uint16_t nonzero = 0;
+
+  for ( unsigned int i = 0; i < 16; i++ ) {
+    coefficients.at( i ) /= ( i == 0 ) ? factors_.first : factors_.second;
+
+    if ( coefficients.at( i ) ) {
+      nonzero |= 1 << i;
+    }
+  }
+
+  return nonzero;
+}
+
+/* Picks the blocks whose residual has a SAD below `limit`. Their DC, if
+   they need one, is ( 8 * sum + 7 ) >> 4 (which is what the DCT comes to). */
+template<unsigned int size>
+static uint16_t small_blocks( const SafeArray<VP8Raster::Block4, size> & original_sub,
+                              const SafeArray<VP8Raster::Block4, size> & prediction_sub,
+                              const uint32_t limit,
+                              SafeArray<int16_t, size> & dc )
+{
+  uint16_t small = 0;
+
+  for ( unsigned int i = 0; i < size; i++ ) {
+    const auto & original = original_sub.at( i ).contents();
+    const auto & prediction = prediction_sub.at( i ).contents();
+
+    uint32_t sad = 0;
+    int32_t sum = 0;
+
+    for ( unsigned int row = 0; row < 4; row++ ) {
+      for ( unsigned int column = 0; column < 4; column++ ) {
+        const int difference = original.at( column, row ) - prediction.at( column, row );
+        sad += abs( difference );
+        sum += difference;
+      }
+    }
+
+    if ( sad < limit ) {
+      small |= 1 << i;
+      dc.at( i ) = ( 8 * sum + 7 ) >> 4;
+    }
+  }
+
+  return small;
+}
+
+MacroblockTransform::MacroblockTransform( const Quantizer & quantizer )
+  : y_( quantizer.y() ), y2_( quantizer.y2() ), uv_( quantizer.uv() )
+{}
+
+void MacroblockTransform::luma( const VP8Raster::Macroblock & original_mb,
+                                const VP8Raster::Macroblock & prediction_mb,
+                                const bool with_y2,
+                                MacroblockResidual & residual ) const
+{
+  SafeArray<int16_t, 16> dc;
+  const uint16_t small = small_blocks( original_mb.Y_sub, prediction_mb.Y_sub,
+                                       y_.zero_sad_limit( not with_y2 ), dc );
+
+#ifdef HAVE_SSE2
+
+  if ( small != 0xffff ) {
+    alignas( 16 ) SafeArray<int16_t, 16 * 16> difference;
+
+    vpx_subtract_block_sse2( 16, 16, &difference.at( 0 ), 16,
+                             &original_mb.Y.contents().at( 0, 0 ), original_mb.Y.contents().stride(),
+                             &prediction_mb.Y.contents().at( 0, 0 ), prediction_mb.Y.contents().stride() );
+
+    /* two blocks side by side at a time */
+    for ( unsigned int row = 0; row < 4; row++ ) {
+      for ( unsigned int column = 0; column < 4; column += 2 ) {
+        if ( ( ( small >> ( 4 * row + column ) ) & 3 ) != 3 ) {
+          vp8_short_fdct8x4_sse2( &difference.at( 64 * row + 4 * column ),
+                                  &residual.Y.at( 4 * row + column ).at( 0 ), 32 );
+        }
+      }
+    }
+  }
+
+#else
+
+  for ( unsigned int row = 0; row < 4; row++ ) {
+    for ( unsigned int column = 0; column < 4; column++ ) {
+      if ( not ( small & ( 1 << ( 4 * row + column ) ) ) ) {
+        residual.Y.at( 4 * row + column ).subtract_dct( original_mb.Y_sub_at( column, row ),
+                                                        prediction_mb.Y_sub_at( column, row ).contents() );
+      }
+    }
+  }
+
+#endif
+
+  SafeArray<int16_t, 16> walsh_input;
+  residual.Y_nonzero = 0;
+
+  for ( unsigned int i = 0; i < 16; i++ ) {
+    DCTCoefficients & block = residual.Y.at( i );
+
+    if ( small & ( 1 << i ) ) {
+      block.zero_out();
+
+      if ( with_y2 ) {
+        walsh_input.at( i ) = dc.at( i );
+      }
+
+      continue;
+    }
+
+    if ( with_y2 ) {
+      walsh_input.at( i ) = block.at( 0 );
+      block.at( 0 ) = 0;
+    }
+
+    if ( y_.quantize( block ) ) {
+      residual.Y_nonzero |= 1 << i;
+    }
+  }
+
+  if ( with_y2 ) {
+    residual.Y2.wht( walsh_input );
+
+    residual.Y2_nonzero = ( y2_.quantize( residual.Y2 ) != 0 );
+  }
+  else {
+    residual.Y2.zero_out();
+    residual.Y2_nonzero = false;
+  }
+}
+
+void MacroblockTransform::chroma( const VP8Raster::Macroblock & original_mb,
+                                  const VP8Raster::Macroblock & prediction_mb,
+                                  MacroblockResidual & residual ) const
+{
+  auto plane =
+    [&] ( const SafeArray<VP8Raster::Block4, 4> & original_sub,
+          const SafeArray<VP8Raster::Block4, 4> & prediction_sub,
+          SafeArray<DCTCoefficients, 4> & blocks, uint8_t & nonzero_mask )
+    {
+      SafeArray<int16_t, 4> unused_dc;
+      const uint16_t small = small_blocks( original_sub, prediction_sub,
+                                           uv_.zero_sad_limit( true ), unused_dc );
+
+#ifdef HAVE_SSE2
+
+      if ( small != 0xf ) {
+        alignas( 16 ) SafeArray<int16_t, 8 * 8> difference;
+
+        /* the top-left subblock starts where the plane does, with the same stride */
+        const auto & original = original_sub.at( 0 ).contents();
+        const auto & prediction = prediction_sub.at( 0 ).contents();
+
+        vpx_subtract_block_sse2( 8, 8, &difference.at( 0 ), 8,
+                                 &original.at( 0, 0 ), original.stride(),
+                                 &prediction.at( 0, 0 ), prediction.stride() );
+
+        for ( unsigned int row = 0; row < 2; row++ ) {
+          if ( ( ( small >> ( 2 * row ) ) & 3 ) != 3 ) {
+            vp8_short_fdct8x4_sse2( &difference.at( 32 * row ), &blocks.at( 2 * row ).at( 0 ), 16 );
+          }
+        }
+      }
+
+#else
+
+      for ( unsigned int i = 0; i < 4; i++ ) {
+        if ( not ( small & ( 1 << i ) ) ) {
+          blocks.at( i ).subtract_dct( original_sub.at( i ), prediction_sub.at( i ).contents() );
+        }
+      }
+
+#endif
+
+      nonzero_mask = 0;
+
+      for ( unsigned int i = 0; i < 4; i++ ) {
+        if ( small & ( 1 << i ) ) {
+          blocks.at( i ).zero_out();
+          continue;
+        }
+
+        if ( uv_.quantize( blocks.at( i ) ) ) {
+          nonzero_mask |= 1 << i;
+        }
+      }
+    };
+
+  plane( original_mb.U_sub, prediction_mb.U_sub, residual.U, residual.U_nonzero );
+  plane( original_mb.V_sub, prediction_mb.V_sub, residual.V, residual.V_nonzero );
+}
+
+void MacroblockResidual::copy_luma( TwoDSubRange<YBlock, 4, 4> & frame_Y, Y2Block & frame_Y2,
+                                   const bool with_y2 ) const
+{
+  frame_Y.forall_ij(
+    [&] ( YBlock & frame_sb, const unsigned int sb_column, const unsigned int sb_row )
+    {
+      const unsigned int i = sb_column + 4 * sb_row;
+
+      frame_sb.mutable_coefficients() = Y.at( i );
+      frame_sb.set_has_nonzero( Y_nonzero & ( 1 << i ) );
+
+      if ( with_y2 ) {
+        frame_sb.set_Y_after_Y2();
+      }
+      else {
+        frame_sb.set_Y_without_Y2();
+      }
+    }
+  );
+
+  if ( with_y2 ) {
+    frame_Y2.mutable_coefficients() = Y2;
+    frame_Y2.set_has_nonzero( Y2_nonzero );
+  }
+}
+
+void MacroblockResidual::copy_chroma( TwoDSubRange<UVBlock, 2, 2> & frame_U,
+                                     TwoDSubRange<UVBlock, 2, 2> & frame_V ) const
+{
+  frame_U.forall_ij(
+    [&] ( UVBlock & frame_sb, const unsigned int sb_column, const unsigned int sb_row )
+    {
+      const unsigned int i = sb_column + 2 * sb_row;
+
+      frame_sb.mutable_coefficients() = U.at( i );
+      frame_sb.set_has_nonzero( U_nonzero & ( 1 << i ) );
+    }
+  );
+
+  frame_V.forall_ij(
+    [&] ( UVBlock & frame_sb, const unsigned int sb_column, const unsigned int sb_row )
+    {
+      const unsigned int i = sb_column + 2 * sb_row;
+
+      frame_sb.mutable_coefficients() = V.at( i );
+      frame_sb.set_has_nonzero( V_nonzero & ( 1 << i ) );
+    }
+  );
+}
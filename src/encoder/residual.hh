@@ -0,0 +1,127 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+#ifndef RESIDUAL_HH
+#define RESIDUAL_HH
+
+#include <utility>
+
+#include "safe_array.hh"
+#include "vp8_raster.hh"
+#include "block.hh"
+#include "quantization.hh"
+
+/* A (DC, AC) pair of quantizer factors, ready to quantize a whole block with
+   multiplications instead of divisions. VP8 quantization truncates, and for
+   every 16-bit x,
+
+     x / d = ( t + ( ( x - t ) >> 1 ) ) >> ( l - 1 ), with t = ( m * x ) >> 16,
+
+   where l = ceil( log2( d ) ) and m = 2^16 * ( 2^l - d ) / d + 1 (Granlund
+   and Montgomery, "Division by invariant integers using multiplication").
+   The last shift is a multiplication by 2^( 17 - l ) as well, so that the DC
+   and the AC coefficients can go through the same instructions. */
+class BlockQuantizer
+{
+private:
+  std::pair<uint16_t, uint16_t> factors_;
+
+  /* m and 2^( 17 - l ) for every coefficient of a block */
+  alignas( 16 ) SafeArray<uint16_t, 16> multipliers_ {};
+  alignas( 16 ) SafeArray<uint16_t, 16> shifts_ {};
+
+  /* the multiplications need 2^( 17 - l ) to fit in 16 bits */
+  bool exact_;
+
+  /* see zero_sad_limit */
+  uint32_t zero_sad_limit_;
+  uint32_t zero_ac_sad_limit_;
+
+public:
+  BlockQuantizer( const std::pair<uint16_t, uint16_t> & factors );
+
+  /* same as coefficients = coefficients.quantize( factors ); returns which
+     coefficients are left nonzero (bit i for coefficient i) */
+  uint16_t quantize( DCTCoefficients & coefficients ) const;
+
+  /* A residual block with a SAD below this is certain to quantize to all
+     zeros (or to a lone DC, if with_dc is false), so it doesn't need to be
+     transformed. No coefficient of the forward DCT gets past 7/8 * SAD + 4. */
+  uint32_t zero_sad_limit( const bool with_dc ) const
+  {
+    return with_dc ? zero_sad_limit_ : zero_ac_sad_limit_;
+  }
+};
+
+/* The quantized residual of a macroblock, with enough bookkeeping that the
+   callers don't have to look into the blocks that came out empty. */
+struct MacroblockResidual
+{
+  alignas( 16 ) SafeArray<DCTCoefficients, 16> Y {};
+  alignas( 16 ) DCTCoefficients Y2 {};
+  alignas( 16 ) SafeArray<DCTCoefficients, 4> U {};
+  alignas( 16 ) SafeArray<DCTCoefficients, 4> V {};
+
+  /* bit i is set if block i (in raster order) has a nonzero coefficient */
+  uint16_t Y_nonzero { 0 };
+  bool Y2_nonzero { false };
+  uint8_t U_nonzero { 0 };
+  uint8_t V_nonzero { 0 };
+
+  /* copy the coefficients into the blocks of a macroblock, with the block
+     types and the has_nonzero flags that go with them (Y2 only if with_y2) */
+  void copy_luma( TwoDSubRange<YBlock, 4, 4> & frame_Y, Y2Block & frame_Y2,
+                  const bool with_y2 ) const;
+  void copy_chroma( TwoDSubRange<UVBlock, 2, 2> & frame_U,
+                    TwoDSubRange<UVBlock, 2, 2> & frame_V ) const;
+};
+
+/* Subtracts the prediction from a macroblock, transforms it and quantizes it,
+   a whole plane at a time. The blocks whose residual is too small to survive
+   quantization are left out of the transform (see
+   BlockQuantizer::zero_sad_limit). */
+class MacroblockTransform
+{
+private:
+  BlockQuantizer y_, y2_, uv_;
+
+public:
+  MacroblockTransform( const Quantizer & quantizer );
+
+  /* with_y2: the DC of every luma block is taken out and goes through the
+     WHT into Y2 (every mode but B_PRED and SPLITMV) */
+  void luma( const VP8Raster::Macroblock & original_mb,
+             const VP8Raster::Macroblock & prediction_mb,
+             const bool with_y2,
+             MacroblockResidual & residual ) const;
+
+  void chroma( const VP8Raster::Macroblock & original_mb,
+               const VP8Raster::Macroblock & prediction_mb,
+               MacroblockResidual & residual ) const;
+};
+
+#endif /* RESIDUAL_HH */
@@ -0,0 +1,162 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <cstdlib>
+
+#include "config.h"
+#include "sad.hh"
+
+#ifdef HAVE_SSE2
+#include <immintrin.h>
+#endif
+
+using namespace std;
+
+void sad16x16x4_c( const uint8_t * src, const unsigned int src_stride,
+                   const SafeArray<const uint8_t *, 4> & refs, const unsigned int ref_stride,
+                   SafeArray<uint32_t, 4> & sads )
+{
+  for ( unsigned int i = 0; i < 4; i++ ) {
+    sads.at( i ) = 0;
+
+    for ( unsigned int row = 0; row < 16; row++ ) {
+      for ( unsigned int column = 0; column < 16; column++ ) {
+        sads.at( i ) += abs( src[ row * src_stride + column ]
+                             - refs.at( i )[ row * ref_stride + column ] );
+      }
+    }
+  }
+}
+
+#ifdef HAVE_SSE2
+
+static inline uint32_t sum_halves( const __m128i sad )
+{
+  return _mm_cvtsi128_si32( sad ) + _mm_cvtsi128_si32( _mm_srli_si128( sad, 8 ) );
+}
+
+void sad16x16x4_sse2( const uint8_t * src, const unsigned int src_stride,
+                      const SafeArray<const uint8_t *, 4> & refs, const unsigned int ref_stride,
+                      SafeArray<uint32_t, 4> & sads )
+{
+  __m128i sum0 = _mm_setzero_si128(), sum1 = _mm_setzero_si128();
+  __m128i sum2 = _mm_setzero_si128(), sum3 = _mm_setzero_si128();
+
+  const uint8_t * ref0 = refs.at( 0 ), * ref1 = refs.at( 1 );
+  const uint8_t * ref2 = refs.at( 2 ), * ref3 = refs.at( 3 );
+
+  for ( unsigned int row = 0; row < 16; row++ ) {
+    const __m128i source = _mm_loadu_si128( reinterpret_cast<const __m128i *>( src ) );
+
+    sum0 = _mm_add_epi32( sum0, _mm_sad_epu8( source, _mm_loadu_si128( reinterpret_cast<const __m128i *>( ref0 ) ) ) );
+    sum1 = _mm_add_epi32( sum1, _mm_sad_epu8( source, _mm_loadu_si128( reinterpret_cast<const __m128i *>( ref1 ) ) ) );
+    sum2 = _mm_add_epi32( sum2, _mm_sad_epu8( source, _mm_loadu_si128( reinterpret_cast<const __m128i *>( ref2 ) ) ) );
+    sum3 = _mm_add_epi32( sum3, _mm_sad_epu8( source, _mm_loadu_si128( reinterpret_cast<const __m128i *>( ref3 ) ) ) );
+
+    src += src_stride;
+    ref0 += ref_stride; ref1 += ref_stride; ref2 += ref_stride; ref3 += ref_stride;
+  }
+
+  sads.at( 0 ) = sum_halves( sum0 );
+  sads.at( 1 ) = sum_halves( sum1 );
+  sads.at( 2 ) = sum_halves( sum2 );
+  sads.at( 3 ) = sum_halves( sum3 );
+}
+
+/* two rows per instruction: the low lane has the even rows, the high lane
+   the odd ones */
+__attribute__((target("avx2")))
+static inline __m256i load_two_rows( const uint8_t * p, const unsigned int stride )
+{
+  return _mm256_inserti128_si256( _mm256_castsi128_si256( _mm_loadu_si128( reinterpret_cast<const __m128i *>( p ) ) ),
+                                  _mm_loadu_si128( reinterpret_cast<const __m128i *>( p + stride ) ), 1 );
+}
+
+__attribute__((target("avx2")))
+static inline uint32_t sum_quarters( const __m256i sad )
+{
+  return sum_halves( _mm_add_epi32( _mm256_castsi256_si128( sad ), _mm256_extracti128_si256( sad, 1 ) ) );
+}
+
+__attribute__((target("avx2")))
+void sad16x16x4_avx2( const uint8_t * src, const unsigned int src_stride,
+                      const SafeArray<const uint8_t *, 4> & refs, const unsigned int ref_stride,
+                      SafeArray<uint32_t, 4> & sads )
+{
+  __m256i sum0 = _mm256_setzero_si256(), sum1 = _mm256_setzero_si256();
+  __m256i sum2 = _mm256_setzero_si256(), sum3 = _mm256_setzero_si256();
+
+  const uint8_t * ref0 = refs.at( 0 ), * ref1 = refs.at( 1 );
+  const uint8_t * ref2 = refs.at( 2 ), * ref3 = refs.at( 3 );
+
+  for ( unsigned int row = 0; row < 16; row += 2 ) {
+    const __m256i source = load_two_rows( src, src_stride );
+
+    sum0 = _mm256_add_epi32( sum0, _mm256_sad_epu8( source, load_two_rows( ref0, ref_stride ) ) );
+    sum1 = _mm256_add_epi32( sum1, _mm256_sad_epu8( source, load_two_rows( ref1, ref_stride ) ) );
+    sum2 = _mm256_add_epi32( sum2, _mm256_sad_epu8( source, load_two_rows( ref2, ref_stride ) ) );
+    sum3 = _mm256_add_epi32( sum3, _mm256_sad_epu8( source, load_two_rows( ref3, ref_stride ) ) );
+
+    src += 2 * src_stride;
+    ref0 += 2 * ref_stride; ref1 += 2 * ref_stride; ref2 += 2 * ref_stride; ref3 += 2 * ref_stride;
+  }
+
+  sads.at( 0 ) = sum_quarters( sum0 );
+  sads.at( 1 ) = sum_quarters( sum1 );
+  sads.at( 2 ) = sum_quarters( sum2 );
+  sads.at( 3 ) = sum_quarters( sum3 );
+}
+
+bool have_avx2()
+{
+  static const bool supported = __builtin_cpu_supports( "avx2" );
+  return supported;
+}
+
+void sad16x16x4( const uint8_t * src, const unsigned int src_stride,
+                 const SafeArray<const uint8_t *, 4> & refs, const unsigned int ref_stride,
+                 SafeArray<uint32_t, 4> & sads )
+{
+  if ( have_avx2() ) {
+    sad16x16x4_avx2( src, src_stride, refs, ref_stride, sads );
+  }
+  else {
+    sad16x16x4_sse2( src, src_stride, refs, ref_stride, sads );
+  }
+}
+
+#else
+
+void sad16x16x4( const uint8_t * src, const unsigned int src_stride,
+                 const SafeArray<const uint8_t *, 4> & refs, const unsigned int ref_stride,
+                 SafeArray<uint32_t, 4> & sads )
+{
+  sad16x16x4_c( src, src_stride, refs, ref_stride, sads );
+}
+
+#endif
@@ -0,0 +1,61 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+#ifndef SAD_HH
+#define SAD_HH
+
+#include <cstdint>
+
+#include "config.h"
+#include "safe_array.hh"
+
+/* SADs of a 16x16 block against four others that share a stride, in one pass
+   over the block (as libvpx's sad16x16x4d). The diamond search hands its
+   candidates over four at a time. */
+void sad16x16x4( const uint8_t * src, const unsigned int src_stride,
+                 const SafeArray<const uint8_t *, 4> & refs, const unsigned int ref_stride,
+                 SafeArray<uint32_t, 4> & sads );
+
+/* the implementations sad16x16x4 picks from, for benchmarks */
+void sad16x16x4_c( const uint8_t * src, const unsigned int src_stride,
+                   const SafeArray<const uint8_t *, 4> & refs, const unsigned int ref_stride,
+                   SafeArray<uint32_t, 4> & sads );
+
+#ifdef HAVE_SSE2
+void sad16x16x4_sse2( const uint8_t * src, const unsigned int src_stride,
+                      const SafeArray<const uint8_t *, 4> & refs, const unsigned int ref_stride,
+                      SafeArray<uint32_t, 4> & sads );
+
+void sad16x16x4_avx2( const uint8_t * src, const unsigned int src_stride,
+                      const SafeArray<const uint8_t *, 4> & refs, const unsigned int ref_stride,
+                      SafeArray<uint32_t, 4> & sads );
+
+/* whether this CPU can run sad16x16x4_avx2 */
+bool have_avx2();
+#endif
+
+#endif /* SAD_HH */
@@ -26,34 +26,87 @@
    (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
+#include <array>
+#include <mutex>
+
 #include "vp8_raster.hh"
 #include "decoder.hh"
 #include "encoder.hh"
 
 using namespace std;
 
-SafeReferences::SafeReferences( const uint16_t width, const uint16_t height )
-  : last( move ( MutableSafeRasterHandle( width, height ) ) ),
-    golden( move ( MutableSafeRasterHandle( width, height ) ) ),
-    alternative( move ( MutableSafeRasterHandle( width, height ) ) )
+SafeReference::SafeReference( const RasterHandle & source )
+  : source_( source )
 {}
 
+const SafeRaster & SafeReference::raster() const
+{
+  call_once( raster_built_, [&] { raster_.initialize( SafeReferences::load( source_.get() ) ); } );
+  return raster_.get().get();
+}
+
+const LumaPyramid & SafeReference::pyramid() const
+{
+  call_once( pyramid_built_, [&] { pyramid_.initialize( source_.get().Y() ); } );
+  return pyramid_.get();
+}
+
 SafeReferences::SafeReferences( const References & references )
-  : last( move ( load( references.last ) ) ),
-    golden( move ( load( references.golden ) ) ),
-    alternative( move ( load( references.alternative ) ) )
+  : last_( make_shared<SafeReference>( references.last ) ),
+    golden_( &references.golden.get() == &references.last.get()
+             ? last_ : make_shared<SafeReference>( references.golden ) ),
+    alternative_( &references.alternative.get() == &references.last.get() ? last_
+                  : &references.alternative.get() == &references.golden.get() ? golden_
+                  : make_shared<SafeReference>( references.alternative ) )
 {}
 
-const SafeRaster & SafeReferences::get( reference_frame reference_id ) const
+void SafeReferences::update( const References & references )
+{
+  const array<shared_ptr<const SafeReference>, 3> previous { { last_, golden_, alternative_ } };
+
+  auto find_or_make =
+    [&] ( const RasterHandle & reference ) -> shared_ptr<const SafeReference>
+    {
+      for ( const auto & safe_reference : previous ) {
+        if ( &safe_reference->source() == &reference.get() ) {
+          return safe_reference;
+        }
+      }
+
+      for ( const auto & safe_reference : { last_, golden_ } ) {
+        if ( &safe_reference->source() == &reference.get() ) {
+          return safe_reference;
+        }
+      }
+
+      return make_shared<SafeReference>( reference );
+    };
+
+  last_ = find_or_make( references.last );
+  golden_ = find_or_make( references.golden );
+  alternative_ = find_or_make( references.alternative );
+}
+
+const SafeReference & SafeReferences::reference( reference_frame reference_id ) const
 {
   switch ( reference_id ) {
-  case LAST_FRAME: return last.get();
-  case GOLDEN_FRAME: return golden.get();
-  case ALTREF_FRAME: return alternative.get();
+  case LAST_FRAME: return *last_;
+  case GOLDEN_FRAME: return *golden_;
+  case ALTREF_FRAME: return *alternative_;
   default: throw LogicError();
   }
 }
 
+const SafeRaster & SafeReferences::get( reference_frame reference_id ) const
+{
+  return reference( reference_id ).raster();
+}
+
+const LumaPyramid & SafeReferences::pyramid( reference_frame reference_id ) const
+{
+  return reference( reference_id ).pyramid();
+}
+
 MutableSafeRasterHandle SafeReferences::load( const VP8Raster & source )
 {
   MutableSafeRasterHandle target( source.display_width(), source.display_height() );
@@ -0,0 +1,284 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <algorithm>
+#include <limits>
+#include <vector>
+
+#include "encoder.hh"
+#include "decoder_state.hh"
+
+using namespace std;
+
+bool Encoder::in_region_of_interest( const unsigned int mb_column, const unsigned int mb_row ) const
+{
+  for ( const RegionOfInterest & region : regions_of_interest_ ) {
+    if ( region.x < ( mb_column + 1 ) * 16 and mb_column * 16 < region.x + region.width
+         and region.y < ( mb_row + 1 ) * 16 and mb_row * 16 < region.y + region.height ) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+/*
+ * Adaptive quantization. The macroblocks outside the regions of interest are
+ * ranked by the variance of their luma and split into as many segments of the
+ * same size as there are left (four, or three if the regions of interest take
+ * one). Flat areas are where blocking shows the most, and busy ones hide it,
+ * so the segments go from aq_strength_ * 3/2 below the frame quantizer for
+ * the flattest to as much above it for the busiest; since they're equally
+ * populated, the frame size stays about the same. The regions of interest are
+ * a segment of their own, twice aq_strength_ below the frame quantizer.
+ *
+ * The map and the quantizers are only sent when they differ from the ones the
+ * decoder already has. A macroblock stays in its segment of the last frame
+ * unless its activity has moved clearly out of it, and the map is only sent
+ * again once enough of them have, since it costs about two bits for every
+ * macroblock each time.
+ *
+ * This fills in the frame header and the segment id of every macroblock, and
+ * returns the segmentation that the decoder will be using for this frame.
+ */
+template<class FrameType>
+Optional<Segmentation> Encoder::segment_macroblocks( const VP8Raster & raster, FrameType & frame ) const
+{
+  auto & header = frame.mutable_header();
+  auto & macroblocks = frame.mutable_macroblocks();
+
+  if ( aq_strength_ == 0 ) {
+    /* the frame is reused, so it might still have the segment ids of the last
+       one we encoded */
+    if ( header.update_segmentation.initialized() ) {
+      header.update_segmentation.clear();
+      macroblocks.forall( [] ( auto & frame_mb )
+                          { frame_mb.mutable_segment_id_update().clear(); } );
+    }
+
+    return {};
+  }
+
+  const unsigned int mb_width = macroblocks.width();
+  const Optional<Segmentation> & current = decoder_state_.segmentation;
+
+  /* (1) the activity of every macroblock, and where the classes start */
+  vector<uint32_t> activities;
+  vector<uint32_t> ranked;
+  vector<bool> of_interest;
+
+  const FrameAnalysis * analysis = analysis_of( raster );
+
+  raster.macroblocks_forall_ij(
+    [&] ( VP8Raster::ConstMacroblock original_mb, unsigned int mb_column, unsigned int mb_row )
+    {
+      activities.push_back( analysis ? analysis->activities.at( activities.size() )
+                                     : luma_activity( original_mb.Y() ) );
+      of_interest.push_back( in_region_of_interest( mb_column, mb_row ) );
+
+      if ( not of_interest.back() ) {
+        ranked.push_back( activities.back() );
+      }
+    }
+  );
+
+  const uint8_t first_segment = ( ranked.size() < activities.size() ) ? 1 : 0;
+  const unsigned int classes = num_segments - first_segment;
+
+  /* the activity that separates class i - 1 from class i */
+  SafeArray<uint32_t, num_segments> bounds {{}};
+  sort( ranked.begin(), ranked.end() );
+
+  for ( unsigned int i = 1; i < classes; i++ ) {
+    bounds.at( i ) = ranked.empty() ? 0 : ranked.at( ranked.size() * i / classes );
+  }
+
+  /* whether `activity` is in class i, or (with `margin`) close enough to it
+     for a macroblock that was there in the last frame to stay */
+  auto in_class = [&] ( const uint32_t activity, const unsigned int i, const bool margin )
+    {
+      uint64_t lower = ( i == 0 ) ? 0 : bounds.at( i );
+      uint64_t upper = ( i + 1 == classes ) ? numeric_limits<uint32_t>::max() : bounds.at( i + 1 );
+
+      if ( margin ) {
+        lower -= lower / AQ_HYSTERESIS;
+        upper += upper / AQ_HYSTERESIS;
+      }
+
+      return ( i == 0 or activity > lower ) and activity <= upper;
+    };
+
+  /* (2) the segment of every macroblock */
+  vector<uint8_t> segment_ids( activities.size() );
+  size_t moved = 0;
+  bool regions_moved = false;
+
+  for ( size_t i = 0; i < activities.size(); i++ ) {
+    uint8_t & segment_id = segment_ids.at( i );
+
+    if ( of_interest.at( i ) ) {
+      segment_id = 0;
+    }
+    else {
+      segment_id = first_segment;
+
+      while ( segment_id + 1u < num_segments
+              and not in_class( activities.at( i ), segment_id - first_segment, false ) ) {
+        segment_id++;
+      }
+    }
+
+    if ( current.initialized() ) {
+      const uint8_t last_segment_id = current.get().map.at( i % mb_width, i / mb_width );
+
+      if ( of_interest.at( i ) != ( first_segment == 1 and last_segment_id == 0 ) ) {
+        regions_moved = true;
+      }
+      else if ( not of_interest.at( i ) and last_segment_id >= first_segment
+                and in_class( activities.at( i ), last_segment_id - first_segment, true ) ) {
+        segment_id = last_segment_id;
+      }
+
+      if ( segment_id != last_segment_id ) {
+        moved++;
+      }
+    }
+  }
+
+  /* (3) the quantizer of every segment */
+  const int y_ac_qi = header.quant_indices.y_ac_qi;
+  SegmentFeatureData feature_data;
+  SafeArray<int8_t, num_segments> adjustments {{}};
+
+  for ( uint8_t i = 0; i < num_segments; i++ ) {
+    const int adjustment = ( i < first_segment )
+      ? -2 * aq_strength_
+      : ( 2 * ( i - first_segment ) - static_cast<int>( classes - 1 ) ) * aq_strength_ / 2;
+
+    adjustments.at( i ) = min( max( adjustment, -y_ac_qi ), 127 - y_ac_qi );
+    feature_data.quantizer_update.at( i ) = Flagged<Signed<7>>( adjustments.at( i ) != 0,
+                                                                adjustments.at( i ) );
+  }
+
+  const bool features_changed = not current.initialized()
+    or current.get().absolute_segment_adjustments
+    or current.get().segment_quantizer_adjustments != adjustments
+    or current.get().segment_filter_adjustments != SafeArray<int8_t, num_segments> {{}};
+
+  /* the whole map has to be sent again for any change to it, so unless the
+     segments mean something else now, a few macroblocks that would be better
+     off in another one are left where they are */
+  const bool map_changed = features_changed or regions_moved
+    or moved * AQ_MAP_REFRESH >= segment_ids.size();
+
+  if ( not map_changed ) {
+    for ( size_t i = 0; i < segment_ids.size(); i++ ) {
+      segment_ids.at( i ) = current.get().map.at( i % mb_width, i / mb_width );
+    }
+  }
+
+  SafeArray<uint32_t, num_segments> segment_counts {{}};
+
+  for ( const uint8_t segment_id : segment_ids ) {
+    segment_counts.at( segment_id )++;
+  }
+
+  /* (4) the header */
+  UpdateSegmentation update;
+  update.update_mb_segmentation_map = map_changed;
+
+  if ( features_changed ) {
+    update.segment_feature_data.initialize( feature_data );
+  }
+
+  if ( map_changed ) {
+    /* segment_id_tree: { 0, 1 } vs. { 2, 3 }, then 0 vs. 1 and 2 vs. 3 */
+    const SafeArray<pair<uint32_t, uint32_t>, 3> branches { {
+      { segment_counts.at( 0 ) + segment_counts.at( 1 ), segment_counts.at( 2 ) + segment_counts.at( 3 ) },
+      { segment_counts.at( 0 ), segment_counts.at( 1 ) },
+      { segment_counts.at( 2 ), segment_counts.at( 3 ) } } };
+
+    Array<Flagged<Unsigned<8>>, 3> tree_probs;
+
+    for ( unsigned int i = 0; i < 3; i++ ) {
+      const unsigned int total = branches.at( i ).first + branches.at( i ).second;
+      const uint8_t prob = ( total == 0 ) ? 255 : max( 1u, calc_prob( branches.at( i ).first, total ) );
+      tree_probs.at( i ) = Flagged<Unsigned<8>>( prob != 255, prob );
+    }
+
+    update.mb_segmentation_map.initialize( tree_probs );
+  }
+
+  header.update_segmentation.reset( update );
+
+  size_t i = 0;
+  macroblocks.forall(
+    [&] ( auto & frame_mb )
+    {
+      if ( map_changed ) {
+        frame_mb.mutable_segment_id_update().reset( segment_ids.at( i ) );
+      }
+      else {
+        frame_mb.mutable_segment_id_update().clear();
+      }
+
+      i++;
+    }
+  );
+
+  /* (5) what the decoder will make of it */
+  Optional<Segmentation> segmentation( current );
+
+  if ( segmentation.initialized() ) {
+    segmentation.get().update( header );
+  }
+  else {
+    segmentation.initialize( header, width(), height() );
+  }
+
+  frame.update_segmentation( segmentation.get().map );
+  return segmentation;
+}
+
+/* the segment ids of the frame go into the persistent map */
+template<class FrameType>
+void Encoder::update_segmentation_map( const FrameType & frame )
+{
+  if ( not decoder_state_.segmentation.initialized() ) {
+    return;
+  }
+
+  SegmentationMap & map = decoder_state_.segmentation.get().map;
+
+  frame.macroblocks().forall_ij(
+    [&] ( const auto & frame_mb, unsigned int mb_column, unsigned int mb_row )
+    {
+      map.at( mb_column, mb_row ) = frame_mb.segment_id();
+    }
+  );
+}
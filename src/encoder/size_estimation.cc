@@ -33,7 +33,8 @@
 using namespace std;
 
 template<>
-size_t Encoder::estimate_size<KeyFrame>( const VP8Raster & raster, const size_t y_ac_qi )
+size_t Encoder::estimate_size<KeyFrame>( const VP8Raster & raster, const size_t y_ac_qi,
+                                         CoefficientHistogram & histogram )
 {
   auto macroblock_mapper =
     [&]( const unsigned int column, const unsigned int row ) -> pair<unsigned int, unsigned int>
@@ -44,7 +45,7 @@ size_t Encoder::estimate_size<KeyFrame>( const VP8Raster & raster, const size_t
   DecoderState decoder_state_copy = decoder_state_;
   decoder_state_ = DecoderState( width(), height() );
 
-  KeyFrame & frame = subsampled_key_frame_;
+  KeyFrame & frame = workspace_->subsampled_key_frame;
 
   QuantIndices quant_indices;
   quant_indices.y_ac_qi = y_ac_qi;
@@ -79,6 +80,10 @@ size_t Encoder::estimate_size<KeyFrame>( const VP8Raster & raster, const size_t
                                 frame_mb, quantizer, FIRST_PASS );
 
       frame_mb.calculate_has_nonzero();
+
+      histogram.add( original_mb.macroblock(), reconstructed_mb, frame_mb, quantizer,
+                     WIDTH_SAMPLE_DIMENSION_FACTOR * HEIGHT_SAMPLE_DIMENSION_FACTOR );
+
       frame_mb.reconstruct_intra( quantizer, reconstructed_mb );
 
       //frame_mb.accumulate_token_branches( token_branch_counts );
@@ -96,7 +101,8 @@ size_t Encoder::estimate_size<KeyFrame>( const VP8Raster & raster, const size_t
 }
 
 template<>
-size_t Encoder::estimate_size<InterFrame>( const VP8Raster & raster, const size_t y_ac_qi )
+size_t Encoder::estimate_size<InterFrame>( const VP8Raster & raster, const size_t y_ac_qi,
+                                           CoefficientHistogram & histogram )
 {
   auto macroblock_mapper =
     [&]( const unsigned int column, const unsigned int row )
@@ -104,7 +110,7 @@ size_t Encoder::estimate_size<InterFrame>( const VP8Raster & raster, const size_
       return make_pair( column * WIDTH_SAMPLE_DIMENSION_FACTOR, row * HEIGHT_SAMPLE_DIMENSION_FACTOR );
     };
 
-  InterFrame & frame = subsampled_inter_frame_;
+  InterFrame & frame = workspace_->subsampled_inter_frame;
 
   DecoderState decoder_state_copy = decoder_state_;
 
@@ -114,6 +120,7 @@ size_t Encoder::estimate_size<InterFrame>( const VP8Raster & raster, const size_
   frame.mutable_header().quant_indices = quant_indices;
   frame.mutable_header().refresh_entropy_probs = true;
   frame.mutable_header().refresh_last = true;
+  set_reference_updates( frame.mutable_header() );
 
   Quantizer quantizer( frame.header().quant_indices );
   MutableRasterHandle reconstructed_raster_handle { width(), height() };
@@ -124,6 +131,8 @@ size_t Encoder::estimate_size<InterFrame>( const VP8Raster & raster, const size_
 
   update_rd_multipliers( quantizer );
 
+  MotionSearchContext search = prepare_motion_search( raster, frame.header() );
+
   frame.mutable_macroblocks().forall_ij(
   [&] ( InterFrameMacroblock & frame_mb, unsigned int mb_column, unsigned int mb_row )
     {
@@ -137,7 +146,7 @@ size_t Encoder::estimate_size<InterFrame>( const VP8Raster & raster, const size_
 
       // Process Y and Y2
       luma_mb_inter_predict( original_mb.macroblock(), reconstructed_mb, temp_mb, frame_mb,
-                             quantizer, component_counts,
+                             quantizer, component_counts, search,
                              frame.header().quant_indices.y_ac_qi, FIRST_PASS );
 
       if ( frame_mb.inter_coded() ) {
@@ -151,6 +160,9 @@ size_t Encoder::estimate_size<InterFrame>( const VP8Raster & raster, const size_
 
       frame_mb.calculate_has_nonzero();
 
+      histogram.add( original_mb.macroblock(), reconstructed_mb, frame_mb, quantizer,
+                     WIDTH_SAMPLE_DIMENSION_FACTOR * HEIGHT_SAMPLE_DIMENSION_FACTOR );
+
       if ( frame_mb.inter_coded() ) {
         frame_mb.reconstruct_inter( quantizer, references_, reconstructed_mb );
       }
@@ -161,6 +173,7 @@ size_t Encoder::estimate_size<InterFrame>( const VP8Raster & raster, const size_
   );
 
   frame.relink_y2_blocks();
+  finish_motion_search( search );
   optimize_prob_skip( frame );
   optimize_interframe_probs( frame );
 
@@ -170,12 +183,21 @@ size_t Encoder::estimate_size<InterFrame>( const VP8Raster & raster, const size_
   return size * WIDTH_SAMPLE_DIMENSION_FACTOR * HEIGHT_SAMPLE_DIMENSION_FACTOR;
 }
 
-size_t Encoder::estimate_frame_size( const VP8Raster & raster, const size_t y_ac_qi )
+size_t Encoder::estimate_frame_size( const VP8Raster & raster, const size_t y_ac_qi,
+                                     CoefficientHistogram & histogram, const bool key_frame )
 {
-  if ( not has_state_ ) {
-    return estimate_size<KeyFrame>( raster, y_ac_qi );
+  if ( key_frame ) {
+    return estimate_size<KeyFrame>( raster, y_ac_qi, histogram );
   }
   else {
-    return estimate_size<InterFrame>( raster, y_ac_qi );
+    return estimate_size<InterFrame>( raster, y_ac_qi, histogram );
   }
 }
+
+size_t Encoder::estimate_frame_size( const VP8Raster & raster, const size_t y_ac_qi )
+{
+  const WorkspaceLease lease { *this };
+
+  CoefficientHistogram histogram;
+  return estimate_frame_size( raster, y_ac_qi, histogram, not has_state_ );
+}
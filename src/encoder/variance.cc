@@ -28,6 +28,7 @@
 
 #include "encoder.hh"
 #include "sad_sse.hh"
+#include "sad.hh"
 
 #ifndef HAVE_SSE2
 
@@ -81,6 +82,132 @@ uint32_t Encoder::variance( const VP8Raster::Block<size> & block,
   return res - ( ( int64_t)sum * sum ) / ( size * size );
 }
 
+/* intra_b_mode_sads() */
+
+SafeArray<uint32_t, num_intra_b_modes>
+Encoder::intra_b_mode_sads( const VP8Raster::Block4 & block,
+                            const VP8Raster::Block4::IntraPredictions & predictions )
+{
+  SafeArray<uint32_t, num_intra_b_modes> sads;
+
+  for ( unsigned int mode = 0; mode < num_intra_b_modes; mode++ ) {
+    sads.at( mode ) = 0;
+
+    for ( size_t i = 0; i < 16; i++ ) {
+      sads.at( mode ) += abs( block.at( i % 4, i / 4 ) - predictions.at( mode ).at( i ) );
+    }
+  }
+
+  return sads;
+}
+
+uint32_t Encoder::sse( const VP8Raster::Block4 & block,
+                       const SafeArray<uint8_t, 16> & prediction )
+{
+  uint32_t res = 0;
+
+  for ( size_t i = 0; i < 16; i++ ) {
+    int16_t diff = ( block.at( i % 4, i / 4 ) - prediction.at( i ) );
+    res += diff * diff;
+  }
+
+  return res;
+}
+
+/* subpixel_*() */
+
+static constexpr SafeArray<SafeArray<int16_t, 6>, 8> sixtap_filters =
+  {{ { { 0,  0,  128,    0,   0,  0 } },
+     { { 0, -6,  123,   12,  -1,  0 } },
+     { { 2, -11, 108,   36,  -8,  1 } },
+     { { 0, -9,   93,   50,  -6,  0 } },
+     { { 3, -16,  77,   77, -16,  3 } },
+     { { 0, -6,   50,   93,  -9,  0 } },
+     { { 1, -8,   36,  108, -11,  2 } },
+     { { 0, -1,   12,  123,  -6,  0 } } }};
+
+template<unsigned int size>
+static void subpixel_predict( const VP8Raster::Block<size> & block,
+                              const SafeRaster & reference,
+                              const MotionVector & mv,
+                              SafeArray<SafeArray<uint8_t, size>, size> & output )
+{
+  const int source_column = block.column() * size + ( mv.x() >> 3 );
+  const int source_row = block.row() * size + ( mv.y() >> 3 );
+
+  const auto & horizontal_filter = sixtap_filters.at( mv.x() & 7 );
+  const auto & vertical_filter = sixtap_filters.at( mv.y() & 7 );
+
+  SafeArray<SafeArray<uint8_t, size>, size + 5> intermediate;
+
+  for ( unsigned int row = 0; row < size + 5; row++ ) {
+    for ( unsigned int column = 0; column < size; column++ ) {
+      int32_t val = 64;
+
+      for ( unsigned int tap = 0; tap < 6; tap++ ) {
+        val += reference.at( source_column + column + tap - 2, source_row + row - 2 )
+               * horizontal_filter.at( tap );
+      }
+
+      intermediate.at( row ).at( column ) = clamp255( val >> 7 );
+    }
+  }
+
+  for ( unsigned int row = 0; row < size; row++ ) {
+    for ( unsigned int column = 0; column < size; column++ ) {
+      int32_t val = 64;
+
+      for ( unsigned int tap = 0; tap < 6; tap++ ) {
+        val += intermediate.at( row + tap ).at( column ) * vertical_filter.at( tap );
+      }
+
+      output.at( row ).at( column ) = clamp255( val >> 7 );
+    }
+  }
+}
+
+template<unsigned int size>
+uint32_t Encoder::subpixel_sad( const VP8Raster::Block<size> & block,
+                                const SafeRaster & reference,
+                                const MotionVector & mv )
+{
+  SafeArray<SafeArray<uint8_t, size>, size> prediction;
+  subpixel_predict( block, reference, mv, prediction );
+
+  uint32_t res = 0;
+
+  for ( size_t i = 0; i < size; i++ ) {
+    for ( size_t j = 0; j < size; j++ ) {
+      res += abs( block.at( i, j ) - prediction.at( j ).at( i ) );
+    }
+  }
+
+  return res;
+}
+
+template<unsigned int size>
+uint32_t Encoder::subpixel_variance( const VP8Raster::Block<size> & block,
+                                     const SafeRaster & reference,
+                                     const MotionVector & mv )
+{
+  SafeArray<SafeArray<uint8_t, size>, size> prediction;
+  subpixel_predict( block, reference, mv, prediction );
+
+  uint32_t res = 0;
+  int32_t sum = 0;
+
+  for ( size_t i = 0; i < size; i++ ) {
+    for ( size_t j = 0; j < size; j++ ) {
+      int16_t diff = ( block.at( i, j ) - prediction.at( j ).at( i ) );
+
+      sum += diff;
+      res += diff * diff;
+    }
+  }
+
+  return res - ( ( int64_t)sum * sum ) / ( size * size );
+}
+
 #else // SSE2 is supported
 
 #include "variance_sse2.cc"
@@ -131,6 +258,16 @@ uint32_t Encoder::sse( const VP8Raster::Block<16> & block,
   return sse;
 }
 
+uint32_t Encoder::sse( const VP8Raster::Block4 & block,
+                       const SafeArray<uint8_t, 16> & prediction )
+{
+  unsigned int sse;
+  get4x4var_sse2( &block.contents().at( 0, 0 ), block.contents().stride(),
+                  &prediction.at( 0 ), 4, &sse, nullptr );
+
+  return sse;
+}
+
 /* VARIANCE() */
 
 template<>
@@ -163,4 +300,144 @@ uint32_t Encoder::variance( const VP8Raster::Block<16> & block,
                                  &sse );
 }
 
+/* intra_b_mode_sads() */
+
+SafeArray<uint32_t, num_intra_b_modes>
+Encoder::intra_b_mode_sads( const VP8Raster::Block4 & block,
+                            const VP8Raster::Block4::IntraPredictions & predictions )
+{
+  SafeArray<uint32_t, 4> rows;
+
+  for ( unsigned int row = 0; row < 4; row++ ) {
+    memcpy( &rows.at( row ), &block.at( 0, row ), 4 );
+  }
+
+  /* the subblock in one register, row by row like the predictions */
+  const __m128i source = _mm_loadu_si128( reinterpret_cast<const __m128i *>( &rows.at( 0 ) ) );
+
+  SafeArray<uint32_t, num_intra_b_modes> sads;
+
+  for ( unsigned int mode = 0; mode < num_intra_b_modes; mode++ ) {
+    const __m128i sad = _mm_sad_epu8( source,
+      _mm_loadu_si128( reinterpret_cast<const __m128i *>( &predictions.at( mode ).at( 0 ) ) ) );
+
+    sads.at( mode ) = _mm_cvtsi128_si32( sad ) + _mm_cvtsi128_si32( _mm_srli_si128( sad, 8 ) );
+  }
+
+  return sads;
+}
+
+/* subpixel_*() */
+
+/* Writes the prediction of `block` from `reference` at `mv` to `scratch` and
+   returns where it can be read from. For full-pixel vectors nothing needs to
+   be interpolated, and the returned pointer is into `reference` itself. */
+static const uint8_t * subpixel_predict( const VP8Raster::Block<16> & block,
+                                         const SafeRaster & reference,
+                                         const MotionVector & mv,
+                                         SafeArray<SafeArray<uint8_t, 16>, 16> & scratch,
+                                         unsigned int & stride )
+{
+  const int source_column = block.column() * 16 + ( mv.x() >> 3 );
+  const int source_row = block.row() * 16 + ( mv.y() >> 3 );
+
+  const unsigned int src_stride = reference.stride();
+  const uint8_t mx = mv.x() & 7, my = mv.y() & 7;
+  const uint8_t *src_ptr = &reference.at( source_column, source_row );
+
+  if ( mx == 0 and my == 0 ) {
+    stride = src_stride;
+    return src_ptr;
+  }
+
+  alignas(16) SafeArray< SafeArray< uint8_t, 16 + 8 >, 16 + 8 > intermediate;
+  const uint8_t *intermediate_ptr = &intermediate.at( 0 ).at( 0 );
+  const uint8_t *dst_ptr = &scratch.at( 0 ).at( 0 );
+
+  if ( mx ) {
+    if ( my ) {
+      VP8Raster::Block<16>::sse_horiz_inter_predict( src_ptr - 2 * src_stride, src_stride,
+                                                     intermediate_ptr, 16, 16 + 5, mx );
+      VP8Raster::Block<16>::sse_vert_inter_predict( intermediate_ptr, 16, dst_ptr, 16, 16, my );
+    }
+    else {
+      VP8Raster::Block<16>::sse_horiz_inter_predict( src_ptr, src_stride, dst_ptr, 16, 16, mx );
+    }
+  }
+  else {
+    VP8Raster::Block<16>::sse_vert_inter_predict( src_ptr - 2 * src_stride, src_stride,
+                                                  dst_ptr, 16, 16, my );
+  }
+
+  stride = 16;
+  return dst_ptr;
+}
+
+template<>
+uint32_t Encoder::subpixel_sad( const VP8Raster::Block<16> & block,
+                                const SafeRaster & reference,
+                                const MotionVector & mv )
+{
+  alignas(16) SafeArray<SafeArray<uint8_t, 16>, 16> scratch;
+  unsigned int stride;
+  const uint8_t * prediction = subpixel_predict( block, reference, mv, scratch, stride );
+
+  return vpx_sad16x16_sse2( &block.contents().at( 0, 0 ), block.contents().stride(),
+                            prediction, stride );
+}
+
+template<>
+uint32_t Encoder::subpixel_variance( const VP8Raster::Block<16> & block,
+                                     const SafeRaster & reference,
+                                     const MotionVector & mv )
+{
+  alignas(16) SafeArray<SafeArray<uint8_t, 16>, 16> scratch;
+  unsigned int stride;
+  const uint8_t * prediction = subpixel_predict( block, reference, mv, scratch, stride );
+
+  unsigned int sse;
+  return vpx_variance16x16_sse2( &block.contents().at( 0, 0 ), block.contents().stride(),
+                                 prediction, stride, &sse );
+}
+
 #endif
+
+SafeArray<uint32_t, 4> Encoder::subpixel_sad_x4( const VP8Raster::Block<16> & block,
+                                                 const SafeRaster & reference,
+                                                 const SafeArray<MotionVector, 4> & mvs,
+                                                 const unsigned int count )
+{
+  SafeArray<uint32_t, 4> sads;
+  SafeArray<const uint8_t *, 4> predictions;
+  bool full_pixel = ( count > 0 );
+
+  for ( unsigned int i = 0; i < count; i++ ) {
+    const MotionVector & mv = mvs.at( i );
+
+    if ( ( mv.x() & 7 ) or ( mv.y() & 7 ) ) {
+      full_pixel = false;
+      break;
+    }
+
+    predictions.at( i ) = &reference.at( block.column() * 16 + ( mv.x() >> 3 ),
+                                         block.row() * 16 + ( mv.y() >> 3 ) );
+  }
+
+  if ( not full_pixel ) {
+    for ( unsigned int i = 0; i < count; i++ ) {
+      sads.at( i ) = subpixel_sad( block, reference, mvs.at( i ) );
+    }
+
+    return sads;
+  }
+
+  /* the kernel always does four */
+  for ( unsigned int i = count; i < 4; i++ ) {
+    predictions.at( i ) = predictions.at( 0 );
+  }
+
+  sad16x16x4( &block.contents().at( 0, 0 ), block.contents().stride(),
+              predictions, reference.stride(), sads );
+
+  return sads;
+}
@@ -0,0 +1,186 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <getopt.h>
+
+#include <chrono>
+#include <iostream>
+#include <string>
+#include <thread>
+
+#include "yuv4mpeg.hh"
+#include "encoder.hh"
+#include "chunked_encoder.hh"
+#include "ivf_writer.hh"
+
+using namespace std;
+
+void usage_error( const string & program_name )
+{
+  cerr << "Usage: " << program_name << " [options] <input.y4m>"                              << endl
+                                                                                             << endl
+       << "Options:"                                                                         << endl
+       << " -o <arg>, --output=<arg>              Output file name (default: output.ivf)"    << endl
+       << " -c <arg>, --chunk-size=<arg>          Frames per chunk (default: 16)"            << endl
+       << " -j <arg>, --threads=<arg>             Chunks encoded at once"                    << endl
+       << "                                         (default: one per core)"                 << endl
+       << " -s <arg>, --ssim=<arg>                SSIM for the output (default: 0.99)"       << endl
+       << " -y <arg>, --y-ac-qi=<arg>             Quantization index for Y"                  << endl
+       << " -P <arg>, --speed=<arg>               Speed preset"                              << endl
+       << "                                         0: slowest (best) ... 8: fastest"        << endl
+       << " -w <arg>, --kf-q-weight=<arg>         Keyframe quantizer weight (default: 1.0)"  << endl
+       << " -e, --extra-frame-chunk               Encode each chunk with the last frame"     << endl
+       << "                                         of the one before it"                    << endl
+       << endl;
+}
+
+int main( int argc, char *argv[] )
+{
+  try {
+    if ( argc <= 0 ) {
+      abort();
+    }
+
+    if ( argc < 2 ) {
+      usage_error( argv[ 0 ] );
+      return EXIT_FAILURE;
+    }
+
+    string output_file = "output.ivf";
+    unsigned int chunk_size = 16;
+    unsigned int thread_count = max( 1u, thread::hardware_concurrency() );
+    double ssim = 0.99;
+    Optional<uint8_t> y_ac_qi;
+    SpeedPreset speed_preset { SpeedPreset::SLOWEST };
+    double kf_q_weight = 1.0;
+    bool extra_frame_chunk = false;
+
+    const option command_line_options[] = {
+      { "output",               required_argument, nullptr, 'o' },
+      { "chunk-size",           required_argument, nullptr, 'c' },
+      { "threads",              required_argument, nullptr, 'j' },
+      { "ssim",                 required_argument, nullptr, 's' },
+      { "y-ac-qi",              required_argument, nullptr, 'y' },
+      { "speed",                required_argument, nullptr, 'P' },
+      { "kf-q-weight",          required_argument, nullptr, 'w' },
+      { "extra-frame-chunk",    no_argument,       nullptr, 'e' },
+      { 0, 0, 0, 0 }
+    };
+
+    while ( true ) {
+      const int opt = getopt_long( argc, argv, "o:c:j:s:y:P:w:e", command_line_options, nullptr );
+
+      if ( opt == -1 ) {
+        break;
+      }
+
+      switch ( opt ) {
+      case 'o':
+        output_file = optarg;
+        break;
+
+      case 'c':
+        chunk_size = stoul( optarg );
+        break;
+
+      case 'j':
+        thread_count = stoul( optarg );
+        break;
+
+      case 's':
+        ssim = stod( optarg );
+        break;
+
+      case 'y':
+        y_ac_qi = Optional<uint8_t>( true, stoul( optarg ) );
+        break;
+
+      case 'P':
+      {
+        const unsigned long preset = stoul( optarg );
+
+        if ( preset > SpeedPreset::FASTEST ) {
+          throw runtime_error( "invalid speed preset: " + string( optarg ) );
+        }
+
+        speed_preset = SpeedPreset( preset );
+        break;
+      }
+
+      case 'w':
+        kf_q_weight = stod( optarg );
+        break;
+
+      case 'e':
+        extra_frame_chunk = true;
+        break;
+
+      default:
+        throw runtime_error( "getopt_long: unexpected return value." );
+      }
+    }
+
+    if ( optind >= argc ) {
+      usage_error( argv[ 0 ] );
+      return EXIT_FAILURE;
+    }
+
+    const string input_file = argv[ optind ];
+    YUV4MPEGReader input = ( input_file == "-" )
+                           ? YUV4MPEGReader( FileDescriptor( STDIN_FILENO ) )
+                           : YUV4MPEGReader( input_file );
+
+    IVFWriter output { output_file, "VP80", input.display_width(), input.display_height(), 1, 1 };
+
+    ChunkedEncoder encoder { input.display_width(), input.display_height(),
+                             speed_preset, chunk_size, thread_count };
+
+    if ( y_ac_qi.initialized() ) {
+      encoder.set_quantizer( y_ac_qi.get() );
+    }
+    else {
+      encoder.set_minimum_ssim( ssim );
+    }
+
+    encoder.set_kf_q_weight( kf_q_weight );
+    encoder.set_extra_frame_chunks( extra_frame_chunk );
+
+    const auto encode_beginning = chrono::steady_clock::now();
+    const unsigned int chunk_count = encoder.encode( input, output );
+    const auto encode_ending = chrono::steady_clock::now();
+
+    cerr << "Encoded " << chunk_count << " chunks on " << thread_count << " threads in "
+         << chrono::duration_cast<chrono::milliseconds>( encode_ending - encode_beginning ).count()
+         << " ms." << endl;
+  } catch ( const exception &  e ) {
+    print_exception( argv[ 0 ], e );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -47,6 +47,7 @@
 #include "ivf_writer.hh"
 #include "display.hh"
 #include "enc_state_serializer.hh"
+#include "lookahead.hh"
 
 using namespace std;
 
@@ -61,16 +62,26 @@ void usage_error( const string & program_name )
        << "                                         ivf (default), y4m"                      << endl
        << " -O <arg>, --output-state=<arg>        Output file name for final"                << endl
        << "                                         encoder state (default: none)"           << endl
+       << " -k, --pack-state                      Compress the planes in the output state"   << endl
        << " -I <arg>, --input-state=<arg>         Input file name for initial"               << endl
        << "                                         encoder state (default: none)"           << endl
        << " -y, --y-ac-qi=<arg>                   Quantization index for Y"                  << endl
        << " -q, --quality=(best|rt)               Quality setting"                           << endl
        << "                                         best: best quality, slowest (default)"   << endl
        << "                                         rt:   real-time"                         << endl
+       << " -P <arg>, --speed=<arg>               Speed preset, overrides --quality"         << endl
+       << "                                         0: slowest (best) ... 8: fastest"        << endl
+       << "                                         (rt is 6)"                               << endl
        << " -F <arg>, --frame-sizes=<arg>         Target frame sizes file"                   << endl
        << "                                         Each line specifies the target size"     << endl
        << "                                         in bytes for the corresponding frame."   << endl
        << " --two-pass                            Do the second encoding pass"               << endl
+       << " -a <arg>, --aq=<arg>                  Adaptive quantization strength"            << endl
+       << "                                         (0-63, default: 0, off)"                 << endl
+       << " -R <x,y,w,h>, --roi=<x,y,w,h>         Region of interest, in pixels"             << endl
+       << "                                         (needs --aq; can be repeated)"           << endl
+       << " -L <arg>, --lookahead=<arg>           Frames analyzed ahead, on another thread"  << endl
+       << "                                         (0-63, default: 0, off)"                 << endl
                                                                                              << endl
        << "Re-encode:"                                                                       << endl
        << " -r, --reencode                        Re-encode"                                 << endl
@@ -109,6 +120,7 @@ int main( int argc, char *argv[] )
     string input_format = "ivf";
     string input_state = "";
     string output_state = "";
+    EncoderStatePlanes output_state_planes = EncoderStatePlanes::RAW;
     string pred_file = "";
     string pred_ivf_initial_state = "";
     string frame_sizes_file = "";
@@ -120,6 +132,10 @@ int main( int argc, char *argv[] )
     bool no_wait = false;
     Optional<uint8_t> y_ac_qi;
     EncoderQuality quality = BEST_QUALITY;
+    Optional<uint8_t> speed;
+    uint8_t aq_strength = 0;
+    vector<RegionOfInterest> regions_of_interest;
+    size_t lookahead_frames = 0;
 
     EncoderMode encoder_mode = MINIMUM_SSIM;
 
@@ -129,6 +145,7 @@ int main( int argc, char *argv[] )
       { "ssim",                 required_argument, nullptr, 's' },
       { "input-format",         required_argument, nullptr, 'i' },
       { "output-state",         required_argument, nullptr, 'O' },
+      { "pack-state",           no_argument,       nullptr, 'k' },
       { "input-state",          required_argument, nullptr, 'I' },
       { "two-pass",             no_argument,       nullptr, '2' },
       { "y-ac-qi",              required_argument, nullptr, 'y' },
@@ -138,13 +155,17 @@ int main( int argc, char *argv[] )
       { "kf-q-weight",          required_argument, nullptr, 'w' },
       { "extra-frame-chunk",    no_argument,       nullptr, 'e' },
       { "quality",              required_argument, nullptr, 'q' },
+      { "speed",                required_argument, nullptr, 'P' },
       { "frame-sizes",          required_argument, nullptr, 'F' },
       { "no-wait",              no_argument,       nullptr, 'W' },
+      { "aq",                   required_argument, nullptr, 'a' },
+      { "roi",                  required_argument, nullptr, 'R' },
+      { "lookahead",            required_argument, nullptr, 'L' },
       { 0, 0, 0, 0 }
     };
 
     while ( true ) {
-      const int opt = getopt_long( argc, argv, "o:s:i:O:I:2y:p:S:rw:eq:F:W", command_line_options, nullptr );
+      const int opt = getopt_long( argc, argv, "o:s:i:O:kI:2y:p:S:rw:eq:P:F:Wa:R:L:", command_line_options, nullptr );
 
       if ( opt == -1 ) {
         break;
@@ -168,6 +189,10 @@ int main( int argc, char *argv[] )
         output_state = optarg;
         break;
 
+      case 'k':
+        output_state_planes = EncoderStatePlanes::PACKED;
+        break;
+
       case 'I':
         input_state = optarg;
         break;
@@ -213,11 +238,56 @@ int main( int argc, char *argv[] )
 
         break;
 
+      case 'P':
+      {
+        const unsigned long preset = stoul( optarg );
+
+        if ( preset > SpeedPreset::FASTEST ) {
+          throw runtime_error( "invalid speed preset: " + string( optarg ) );
+        }
+
+        speed = preset;
+        break;
+      }
+
       case 'F':
         frame_sizes_file = optarg;
         encoder_mode = TARGET_FRAME_SIZE;
         break;
 
+      case 'a':
+      {
+        const unsigned long strength = stoul( optarg );
+
+        if ( strength > Encoder::MAX_AQ_STRENGTH ) {
+          throw runtime_error( "invalid adaptive quantization strength: " + string( optarg ) );
+        }
+
+        aq_strength = strength;
+        break;
+      }
+
+      case 'R':
+      {
+        RegionOfInterest region;
+
+        if ( sscanf( optarg, "%u,%u,%u,%u", &region.x, &region.y, &region.width, &region.height ) != 4 ) {
+          throw runtime_error( "invalid region of interest: " + string( optarg ) );
+        }
+
+        regions_of_interest.push_back( region );
+        break;
+      }
+
+      case 'L':
+        lookahead_frames = stoul( optarg );
+
+        if ( lookahead_frames > Lookahead::MAX_DEPTH ) {
+          throw runtime_error( "invalid lookahead: " + string( optarg ) );
+        }
+
+        break;
+
       default:
         throw runtime_error( "getopt_long: unexpected return value." );
       }
@@ -251,6 +321,14 @@ int main( int argc, char *argv[] )
       throw runtime_error( "unsupported input format" );
     }
 
+    SpeedPreset speed_preset { quality };
+    speed_preset.two_pass = two_pass;
+
+    if ( speed.initialized() ) {
+      speed_preset = SpeedPreset( speed.get() );
+      speed_preset.two_pass = speed_preset.two_pass or two_pass;
+    }
+
     Decoder pred_decoder( input_reader->display_width(), input_reader->display_height() );
 
     if ( pred_file != "" and pred_ivf_initial_state != "") {
@@ -265,45 +343,14 @@ int main( int argc, char *argv[] )
         throw runtime_error( "re-encoding without an input_state" );
       }
 
-      /* pre-read all the original rasters */
-      vector<RasterHandle> original_rasters;
-      for ( size_t i = 0; ; i++ ) {
-        auto next_raster = input_reader->get_next_frame();
-
-        if ( next_raster.initialized() ) {
-          original_rasters.emplace_back( next_raster.get() );
-        } else {
-          break;
-        }
-      }
-
-      /* pre-read all the prediction frames */
-      vector<pair<Optional<KeyFrame>, Optional<InterFrame> > > prediction_frames;
-
       IVF pred_ivf { pred_file };
 
       if ( not pred_decoder.minihash_match( pred_ivf.expected_decoder_minihash() ) ) {
         throw Invalid( "Mismatch between prediction IVF and prediction_ivf_initial_state" );
       }
 
-      for ( unsigned int i = 0; i < pred_ivf.frame_count(); i++ ) {
-        UncompressedChunk unch { pred_ivf.frame( i ), pred_ivf.width(), pred_ivf.height(), false };
-
-        if ( unch.key_frame() ) {
-          KeyFrame frame = pred_decoder.parse_frame<KeyFrame>( unch );
-          pred_decoder.decode_frame( frame );
-
-          prediction_frames.emplace_back( move( frame ), Optional<InterFrame>() );
-        } else {
-          InterFrame frame = pred_decoder.parse_frame<InterFrame>( unch );
-          pred_decoder.decode_frame( frame );
-
-          prediction_frames.emplace_back( Optional<KeyFrame>(), move( frame ) );
-        }
-      }
-
-      /* wait for EOF on stdin */
-      if ( not no_wait ) {
+      /* wait for EOF on stdin (unless that's where the originals come from) */
+      if ( not no_wait and input_file != "-" ) {
         FileDescriptor stdin( STDIN_FILENO );
         while ( not stdin.eof() ) {
           stdin.read( 1 );
@@ -311,15 +358,15 @@ int main( int argc, char *argv[] )
       }
 
       Encoder encoder( EncoderStateDeserializer::build<Decoder>( input_state ),
-                       two_pass, quality );
+                       speed_preset );
 
       output.set_expected_decoder_entry_hash( encoder.export_decoder().get_hash().hash() );
 
-      encoder.reencode( original_rasters, prediction_frames, kf_q_weight,
+      encoder.reencode( *input_reader, pred_ivf, move( pred_decoder ), kf_q_weight,
                         extra_frame_chunk, output );
 
       if (output_state != "") {
-        EncoderStateSerializer odata = {};
+        EncoderStateSerializer odata( output_state_planes );
         encoder.export_decoder().serialize(odata);
         odata.write(output_state);
       }
@@ -328,14 +375,17 @@ int main( int argc, char *argv[] )
       /* primary encoding */
       Encoder encoder = input_state == ""
         ? Encoder( input_reader->display_width(), input_reader->display_height(),
-                   two_pass, quality )
+                   speed_preset )
         : Encoder( EncoderStateDeserializer::build<Decoder>( input_state ),
-                   two_pass, quality );
+                   speed_preset );
 
       if ( not input_state.empty() ) {
         output.set_expected_decoder_entry_hash( encoder.export_decoder().get_hash().hash() );
       }
 
+      encoder.set_adaptive_quantization( aq_strength );
+      encoder.set_regions_of_interest( regions_of_interest );
+
       ifstream frame_sizes_if;
 
       if ( encoder_mode == TARGET_FRAME_SIZE ) {
@@ -348,9 +398,32 @@ int main( int argc, char *argv[] )
                               ? frame_sizes_if
                               : cin;
 
+      /* with a lookahead, the frames come from it, along with its analysis */
+      unique_ptr<Lookahead> lookahead;
+
+      if ( lookahead_frames > 0 ) {
+        lookahead.reset( new Lookahead( *input_reader, lookahead_frames ) );
+      }
+
+      auto next_frame =
+        [&] () -> Optional<RasterHandle>
+        {
+          if ( not lookahead ) {
+            return input_reader->get_next_frame();
+          }
+
+          const shared_ptr<const FrameAnalysis> analysis = lookahead->next_frame();
+          encoder.set_frame_analysis( analysis );
+
+          if ( not analysis ) {
+            return {};
+          }
+
+          return Optional<RasterHandle>( true, analysis->raster );
+        };
+
       unsigned int frame_no = 0;
-      for ( auto raster = input_reader->get_next_frame(); raster.initialized();
-            raster = input_reader->get_next_frame() ) {
+      for ( auto raster = next_frame(); raster.initialized(); raster = next_frame() ) {
 
         cerr << "Encoding frame #" << frame_no++ << "...";
         const auto encode_beginning = chrono::system_clock::now();
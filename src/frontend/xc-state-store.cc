@@ -0,0 +1,130 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+#include <getopt.h>
+
+#include <iostream>
+#include <string>
+#include <vector>
+
+#include "decoder.hh"
+#include "enc_state_serializer.hh"
+#include "state_store.hh"
+
+using namespace std;
+
+void usage_error( const string & program_name )
+{
+  cerr << "Usage: " << program_name << " [-k] <store> put <state> [<parent-minihash>]" << endl
+       << "       " << program_name << " <store> get <minihash> <state>" << endl
+       << "       " << program_name << " <store> list" << endl
+       << endl
+       << "put prints the minihash the state was stored under. With a parent, the" << endl
+       << "state's reference may be stored as a delta against the parent's." << endl
+       << endl
+       << " -k, --pack-state     Compress the planes of the objects that put writes" << endl
+       << endl;
+}
+
+static uint32_t parse_minihash( const string & str )
+{
+  return stoul( str, nullptr, 16 );
+}
+
+int main( int argc, char *argv[] )
+{
+  try {
+    if ( argc <= 0 ) {
+      abort();
+    }
+
+    EncoderStatePlanes planes = EncoderStatePlanes::RAW;
+
+    const option command_line_options[] = {
+      { "pack-state", no_argument, nullptr, 'k' },
+      { 0, 0, 0, 0 }
+    };
+
+    while ( true ) {
+      const int opt = getopt_long( argc, argv, "+k", command_line_options, nullptr );
+
+      if ( opt == -1 ) {
+        break;
+      }
+
+      switch ( opt ) {
+      case 'k':
+        planes = EncoderStatePlanes::PACKED;
+        break;
+
+      default:
+        usage_error( argv[ 0 ] );
+        return EXIT_FAILURE;
+      }
+    }
+
+    /* the store, the command and its arguments */
+    const vector<string> args( argv + optind, argv + argc );
+
+    if ( args.size() < 2 ) {
+      usage_error( argv[ 0 ] );
+      return EXIT_FAILURE;
+    }
+
+    StateStore store( args[ 0 ], planes );
+    const string & command = args[ 1 ];
+
+    cout << hex;
+
+    if ( command == "put" and ( args.size() == 3 or args.size() == 4 ) ) {
+      const Decoder decoder = EncoderStateDeserializer::build<Decoder>( args[ 2 ] );
+      const uint32_t parent = ( args.size() == 4 ) ? parse_minihash( args[ 3 ] ) : 0;
+      cout << store.put( decoder, parent ) << endl;
+    }
+    else if ( command == "get" and args.size() == 4 ) {
+      const Decoder decoder = store.get( parse_minihash( args[ 2 ] ) );
+      EncoderStateSerializer odata;
+      decoder.serialize( odata );
+      odata.write( args[ 3 ] );
+    }
+    else if ( command == "list" and args.size() == 2 ) {
+      for ( const uint32_t minihash : store.minihashes() ) {
+        cout << minihash << endl;
+      }
+    }
+    else {
+      usage_error( argv[ 0 ] );
+      return EXIT_FAILURE;
+    }
+  } catch ( const exception &  e ) {
+    print_exception( argv[ 0 ], e );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -173,9 +173,13 @@ void usage( const char *argv0 )
 {
   cerr << "Usage: " << argv0
        << " [-m,--mode MODE] [-d, --device CAMERA] [-p, --pixfmt PIXEL_FORMAT]"
-       << " [-u,--update-rate RATE] [--log-mem-usage] HOST PORT CONNECTION_ID" << endl
+       << " [-u,--update-rate RATE] [-s,--speed PRESET] [-r,--intra-refresh] [--log-mem-usage]"
+       << " HOST PORT CONNECTION_ID" << endl
        << endl
-       << "Accepted MODEs are s1, s2 (default), conventional." << endl;
+       << "Accepted MODEs are s1, s2 (default), conventional." << endl
+       << "With --intra-refresh, the receiver is brought to a known state by refreshing a band" << endl
+       << "of the picture in each frame, instead of by a key frame." << endl
+       << "Accepted PRESETs are 0 (slowest) to 8 (fastest); the default is 6." << endl;
 }
 
 uint64_t ack_seq_no( const AckPacket & ack,
@@ -204,18 +208,22 @@ int main( int argc, char *argv[] )
   size_t update_rate __attribute__((unused)) = 1;
   OperationMode operation_mode = OperationMode::S2;
   bool log_mem_usage = false;
+  uint8_t speed = SpeedPreset::REALTIME;
+  bool intra_refresh = false;
 
   const option command_line_options[] = {
     { "mode",          required_argument, nullptr, 'm' },
     { "device",        required_argument, nullptr, 'd' },
     { "pixfmt",        required_argument, nullptr, 'p' },
     { "update-rate",   required_argument, nullptr, 'u' },
+    { "speed",         required_argument, nullptr, 's' },
+    { "intra-refresh", no_argument,       nullptr, 'r' },
     { "log-mem-usage", no_argument,       nullptr, 'M' },
     { 0, 0, 0, 0 }
   };
 
   while ( true ) {
-    const int opt = getopt_long( argc, argv, "d:p:m:u:", command_line_options, nullptr );
+    const int opt = getopt_long( argc, argv, "d:p:m:u:s:r", command_line_options, nullptr );
 
     if ( opt == -1 ) { break; }
 
@@ -239,6 +247,22 @@ int main( int argc, char *argv[] )
       update_rate = paranoid::stoul( optarg );
       break;
 
+    case 's':
+    {
+      const unsigned int preset = paranoid::stoul( optarg );
+
+      if ( preset > SpeedPreset::FASTEST ) {
+        throw runtime_error( "invalid speed preset: " + string( optarg ) );
+      }
+
+      speed = preset;
+      break;
+    }
+
+    case 'r':
+      intra_refresh = true;
+      break;
+
     case 'M':
       log_mem_usage = true;
       break;
@@ -276,6 +300,10 @@ int main( int argc, char *argv[] )
   const size_t MAX_SKIPPED = 3;
   size_t skipped_count = 0;
 
+  /* how big each frame of an intra refresh cycle gets before we know the
+     capacity of the network */
+  const size_t DEFAULT_REFRESH_SIZE = 8 * 1400;
+
   if ( not PIXEL_FORMAT_STRS.count( pixel_format ) ) {
     throw runtime_error( "unsupported pixel format" );
   }
@@ -284,8 +312,10 @@ int main( int argc, char *argv[] )
   Camera camera { 1280, 720, PIXEL_FORMAT_STRS.at( pixel_format ), camera_device };
 
   /* construct the encoder */
-  Encoder base_encoder { camera.display_width(), camera.display_height(),
-                         false /* two-pass */, REALTIME_QUALITY };
+  SpeedPreset speed_preset { speed };
+  speed_preset.two_pass = false;
+
+  Encoder base_encoder { camera.display_width(), camera.display_height(), speed_preset };
 
   const uint32_t initial_state = base_encoder.minihash();
 
@@ -496,6 +526,20 @@ int main( int argc, char *argv[] )
                                   increment_quantizer( last_quantizer, +23 ), 0 );
       }
 
+      if ( intra_refresh ) {
+        /* a refresh cycle (whenever one starts or is running) takes as much of
+           each frame as the network can carry right now */
+        size_t refresh_size = DEFAULT_REFRESH_SIZE;
+
+        if ( avg_delay != numeric_limits<uint32_t>::max() ) {
+          refresh_size = max( size_t( 1 ), target_size( avg_delay, last_acked, cumulative_fpf.back() ) );
+        }
+
+        for ( auto & job : encode_jobs ) {
+          job.encoder.set_intra_refresh( refresh_size );
+        }
+      }
+
       // this thread will spawn all the encoding jobs and will wait on the results
       thread(
         [&encode_jobs, &encode_outputs, &encode_end_pipe, operation_mode]()
@@ -0,0 +1,148 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* Fits the rate model to the residual of a noisy picture against a flat
+   prediction, and checks what the curve it predicts has to look like: it
+   goes through the analysis point, gets smaller with the quantizer, never
+   goes under the overhead, and the online correction converges to what the
+   frames actually cost.
+
+   usage: rate-model-test */
+
+#include <cmath>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+
+#include "exception.hh"
+#include "frame.hh"
+#include "rate_model.hh"
+
+using namespace std;
+
+const uint16_t width = 64;
+const uint16_t height = 64;
+
+const uint8_t probe_y_ac_qi = 40;
+const size_t probe_size = 4000;
+
+static void check( const bool condition, const string & what )
+{
+  if ( not condition ) {
+    throw runtime_error( what );
+  }
+}
+
+int main( int, char *argv[] )
+{
+  try {
+    default_random_engine rng;
+    normal_distribution<double> noise( 0, 24 );
+
+    MutableRasterHandle original( width, height );
+    MutableRasterHandle predicted( width, height );
+
+    auto noisy = [&] ( const unsigned int base ) -> uint8_t
+      {
+        return min( 255.0, max( 0.0, base + noise( rng ) ) );
+      };
+
+    original.get().Y().forall_ij( [&] ( uint8_t & p, unsigned int column, unsigned int ) { p = noisy( 64 + column ); } );
+    original.get().U().forall( [&] ( uint8_t & p ) { p = noisy( 128 ); } );
+    original.get().V().forall( [&] ( uint8_t & p ) { p = noisy( 128 ); } );
+
+    predicted.get().Y().fill( 128 );
+    predicted.get().U().fill( 128 );
+    predicted.get().V().fill( 128 );
+
+    QuantIndices quant_indices;
+    quant_indices.y_ac_qi = probe_y_ac_qi;
+    const Quantizer quantizer( quant_indices );
+
+    KeyFrame frame( width, height );
+    CoefficientHistogram histogram;
+
+    frame.mutable_macroblocks().forall_ij(
+      [&] ( KeyFrameMacroblock & frame_mb, unsigned int mb_column, unsigned int mb_row )
+      {
+        frame_mb.Y2().set_prediction_mode( DC_PRED );
+        frame_mb.Y2().set_coded( true );
+
+        histogram.add( original.get().macroblock( mb_column, mb_row ),
+                       predicted.get().macroblock( mb_column, mb_row ),
+                       frame_mb, quantizer, 1 );
+      }
+    );
+
+    const ProbabilityTables probability_tables;
+
+    /* with no coefficients, everything is overhead */
+    {
+      const RateModel model;
+      const auto sizes = model.predict( CoefficientHistogram(), probability_tables,
+                                        probe_y_ac_qi, probe_size );
+
+      for ( unsigned int y_ac_qi = 0; y_ac_qi < RateModel::QUANTIZER_INDICES; y_ac_qi++ ) {
+        check( sizes.at( y_ac_qi ) == probe_size, "an empty frame depends on the quantizer" );
+      }
+    }
+
+    RateModel model;
+    auto sizes = model.predict( histogram, probability_tables, probe_y_ac_qi, probe_size );
+
+    check( sizes.at( probe_y_ac_qi ) == probe_size, "the curve misses the analysis point" );
+    check( sizes.at( 0 ) > sizes.at( probe_y_ac_qi ), "the finest quantizer isn't bigger" );
+    check( sizes.at( RateModel::QUANTIZER_INDICES - 1 ) < sizes.at( probe_y_ac_qi ),
+           "the coarsest quantizer isn't smaller" );
+
+    for ( unsigned int y_ac_qi = 0; y_ac_qi < RateModel::QUANTIZER_INDICES; y_ac_qi++ ) {
+      check( sizes.at( y_ac_qi ) + 1 >= probe_size * RateModel::MIN_OVERHEAD_FRACTION,
+             "a prediction went under the overhead" );
+    }
+
+    /* the typical error starts at 10% */
+    check( model.fits( 100, 120 ) and not model.fits( 100, 105 ), "wrong margin" );
+
+    /* frames that always turn out twice as big as the analysis said */
+    for ( unsigned int i = 0; i < 24; i++ ) {
+      sizes = model.predict( histogram, probability_tables, probe_y_ac_qi, probe_size );
+      model.update( sizes.at( probe_y_ac_qi ), 2 * probe_size );
+    }
+
+    cout << "correction: " << model.correction() << ", predicted at y_ac_qi "
+         << int( probe_y_ac_qi ) << ": " << sizes.at( probe_y_ac_qi ) << " bytes" << endl;
+
+    check( abs( model.correction() - 2.0 ) < 0.01, "the correction did not converge" );
+    check( model.fits( 100, 101 ), "the typical error did not shrink" );
+  } catch ( const exception & e ) {
+    print_exception( argv[ 0 ], e );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
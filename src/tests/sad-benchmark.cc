@@ -0,0 +1,167 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* Checks the four-candidate SAD kernels against the C version on random
+   blocks, then times them against four calls to the single-block SSE2 SAD.
+
+   usage: sad-benchmark [ITERATIONS] */
+
+#include <chrono>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <vector>
+
+#include "config.h"
+#include "exception.hh"
+#include "sad.hh"
+
+#ifdef HAVE_SSE2
+#include "sad_sse.hh"
+#endif
+
+using namespace std;
+
+typedef void SAD4Function( const uint8_t *, const unsigned int,
+                           const SafeArray<const uint8_t *, 4> &, const unsigned int,
+                           SafeArray<uint32_t, 4> & );
+
+const unsigned int stride = 64;
+const unsigned int height = 64;
+
+/* candidate blocks are arranged like a diamond search step around (24, 24) */
+const SafeArray<SafeArray<int, 2>, 4> offsets = {{ {{ -8, 0 }}, {{ 0, -8 }}, {{ 0, 8 }}, {{ 8, 0 }} }};
+
+static SafeArray<const uint8_t *, 4> candidates( const vector<uint8_t> & reference, const int shift )
+{
+  SafeArray<const uint8_t *, 4> refs;
+
+  for ( unsigned int i = 0; i < 4; i++ ) {
+    refs.at( i ) = &reference.at( ( 24 + offsets.at( i ).at( 1 ) + shift ) * stride
+                                  + 24 + offsets.at( i ).at( 0 ) + shift );
+  }
+
+  return refs;
+}
+
+static void check( const string & name, SAD4Function * sad4,
+                   const vector<uint8_t> & source, const vector<uint8_t> & reference )
+{
+  for ( int shift = -7; shift <= 7; shift++ ) {
+    SafeArray<uint32_t, 4> expected, actual;
+    sad16x16x4_c( &source.at( 0 ), stride, candidates( reference, shift ), stride, expected );
+    sad4( &source.at( 0 ), stride, candidates( reference, shift ), stride, actual );
+
+    if ( expected != actual ) {
+      throw runtime_error( name + " disagrees with sad16x16x4_c" );
+    }
+  }
+}
+
+template<class Function>
+static void benchmark( const string & name, const unsigned int iterations,
+                       const vector<uint8_t> & reference, Function && sad4 )
+{
+  uint64_t checksum = 0;
+  const auto start = chrono::steady_clock::now();
+
+  for ( unsigned int i = 0; i < iterations; i++ ) {
+    SafeArray<uint32_t, 4> sads;
+    sad4( candidates( reference, int( i % 15 ) - 7 ), sads );
+    checksum += sads.at( 0 ) + sads.at( 1 ) + sads.at( 2 ) + sads.at( 3 );
+  }
+
+  const double seconds = chrono::duration<double>( chrono::steady_clock::now() - start ).count();
+
+  cout << name << ": " << 1e9 * seconds / iterations << " ns per four candidates"
+       << " (checksum " << checksum << ")" << endl;
+}
+
+int main( int argc, char *argv[] )
+{
+  try {
+    const unsigned int iterations = ( argc > 1 ) ? abs( atoi( argv[ 1 ] ) ) : 10000000;
+
+    default_random_engine rng;
+    uniform_int_distribution<uint16_t> pixel( 0, 255 );
+
+    vector<uint8_t> source( stride * 16 );
+    vector<uint8_t> reference( stride * height );
+
+    for ( uint8_t & p : source ) { p = pixel( rng ); }
+    for ( uint8_t & p : reference ) { p = pixel( rng ); }
+
+    /* make the SADs small enough to be plausible, but not all equal */
+    for ( unsigned int i = 0; i < reference.size(); i += 3 ) {
+      reference.at( i ) = source.at( i % source.size() );
+    }
+
+    SAD4Function * sad16x16x4_dispatch = sad16x16x4;
+    check( "sad16x16x4", sad16x16x4_dispatch, source, reference );
+
+#ifdef HAVE_SSE2
+    check( "sad16x16x4_sse2", sad16x16x4_sse2, source, reference );
+
+    if ( have_avx2() ) {
+      check( "sad16x16x4_avx2", sad16x16x4_avx2, source, reference );
+    }
+#endif
+
+    const auto run =
+      [&] ( SAD4Function * sad4 )
+      {
+        return [&source, sad4] ( const SafeArray<const uint8_t *, 4> & refs, SafeArray<uint32_t, 4> & sads )
+          {
+            sad4( &source.at( 0 ), stride, refs, stride, sads );
+          };
+      };
+
+    benchmark( "sad16x16x4_c", iterations, reference, run( sad16x16x4_c ) );
+
+#ifdef HAVE_SSE2
+    benchmark( "4 x vpx_sad16x16_sse2", iterations, reference,
+               [&source] ( const SafeArray<const uint8_t *, 4> & refs, SafeArray<uint32_t, 4> & sads )
+               {
+                 for ( unsigned int i = 0; i < 4; i++ ) {
+                   sads.at( i ) = vpx_sad16x16_sse2( &source.at( 0 ), stride, refs.at( i ), stride );
+                 }
+               } );
+
+    benchmark( "sad16x16x4_sse2", iterations, reference, run( sad16x16x4_sse2 ) );
+
+    if ( have_avx2() ) {
+      benchmark( "sad16x16x4_avx2", iterations, reference, run( sad16x16x4_avx2 ) );
+    }
+#endif
+  } catch ( const exception & e ) {
+    print_exception( argv[ 0 ], e );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
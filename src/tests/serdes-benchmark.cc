@@ -0,0 +1,124 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* Times a round trip of a decoder's state through EncoderStateSerializer and
+   EncoderStateDeserializer, with the raster planes stored raw and packed, and
+   checks that the state survives it.
+
+   usage: serdes-benchmark [ITERATIONS] [WIDTH] [HEIGHT] */
+
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <unistd.h>
+
+#include "decoder.hh"
+#include "exception.hh"
+
+using namespace std;
+
+/* smooth enough to look like a picture, with some noise to keep it honest */
+static Decoder textured_decoder( const uint16_t width, const uint16_t height )
+{
+  default_random_engine rng;
+  uniform_int_distribution<int> noise( -2, 2 );
+
+  MutableRasterHandle raster( width, height );
+
+  for ( TwoD<uint8_t> * plane : { &raster.get().Y(), &raster.get().U(), &raster.get().V() } ) {
+    plane->forall_ij( [&] ( uint8_t & p, const unsigned int column, const unsigned int row )
+                      {
+                        const double value = 128 + 50 * sin( column * 0.05 ) * cos( row * 0.03 )
+                                             + 30 * sin( ( column + 2 * row ) * 0.01 ) + noise( rng );
+                        p = max( 0.0, min( 255.0, value ) );
+                      } );
+  }
+
+  return Decoder( DecoderState( width, height ), References( move( raster ) ) );
+}
+
+static void benchmark( const string & name, const EncoderStatePlanes planes,
+                       const unsigned int iterations, const Decoder & decoder )
+{
+  char filename[] = "/tmp/serdes-benchmark.XXXXXX";
+  FileDescriptor temp_file( SystemCall( "mkstemp", mkstemp( filename ) ) );
+
+  double write_seconds = 0, read_seconds = 0;
+  size_t file_size = 0;
+
+  for ( unsigned int i = 0; i < iterations; i++ ) {
+    auto start = chrono::steady_clock::now();
+
+    EncoderStateSerializer odata( planes );
+    decoder.serialize( odata );
+    odata.write( filename );
+
+    write_seconds += chrono::duration<double>( chrono::steady_clock::now() - start ).count();
+    start = chrono::steady_clock::now();
+
+    EncoderStateDeserializer idata( filename );
+    file_size = idata.size();
+    const Decoder copy = Decoder::deserialize( idata );
+
+    read_seconds += chrono::duration<double>( chrono::steady_clock::now() - start ).count();
+
+    if ( copy != decoder ) {
+      throw runtime_error( name + ": decoder state did not survive the round trip" );
+    }
+  }
+
+  SystemCall( "unlink", unlink( filename ) );
+
+  cout << name << ": " << file_size << " bytes, "
+       << 1e3 * write_seconds / iterations << " ms to serialize and write, "
+       << 1e3 * read_seconds / iterations << " ms to read and deserialize" << endl;
+}
+
+int main( int argc, char *argv[] )
+{
+  try {
+    const unsigned int iterations = ( argc > 1 ) ? abs( atoi( argv[ 1 ] ) ) : 100;
+    const uint16_t width = ( argc > 2 ) ? abs( atoi( argv[ 2 ] ) ) : 1280;
+    const uint16_t height = ( argc > 3 ) ? abs( atoi( argv[ 3 ] ) ) : 720;
+
+    const Decoder decoder = textured_decoder( width, height );
+
+    cout << width << "x" << height << endl;
+    benchmark( "raw planes", EncoderStatePlanes::RAW, iterations, decoder );
+    benchmark( "packed planes", EncoderStatePlanes::PACKED, iterations, decoder );
+  } catch ( const exception & e ) {
+    print_exception( argv[ 0 ], e );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -136,16 +136,18 @@ void progress(unsigned i, unsigned num_tests) {
 
 template<typename T>
 void run_one_test(T (*gen)(default_random_engine &), default_random_engine &rng, string tname) {
-  EncoderStateSerializer odata = {};
-
   T _in = (*gen)(rng);
-  _in.serialize(odata);
 
-  EncoderStateDeserializer idata = deser_from_ser(move(odata));
-  T _out = T::deserialize(idata);
+  for (EncoderStatePlanes planes : {EncoderStatePlanes::RAW, EncoderStatePlanes::PACKED}) {
+    EncoderStateSerializer odata(planes);
+    _in.serialize(odata);
+
+    EncoderStateDeserializer idata = deser_from_ser(move(odata));
+    T _out = T::deserialize(idata);
 
-  if (!(_in == _out)) {
-    throw runtime_error(tname + "failed: _in and _out do not match");
+    if (!(_in == _out)) {
+      throw runtime_error(tname + "failed: _in and _out do not match");
+    }
   }
 }
 
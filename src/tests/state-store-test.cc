@@ -0,0 +1,174 @@
+/* -*-mode:c++; tab-width: 2; indent-tabs-mode: nil; c-basic-offset: 2 -*- */
+
+/* Copyright 2013-2018 the Alfalfa authors
+                       and the Massachusetts Institute of Technology
+
+   Redistribution and use in source and binary forms, with or without
+   modification, are permitted provided that the following conditions are
+   met:
+
+      1. Redistributions of source code must retain the above copyright
+         notice, this list of conditions and the following disclaimer.
+
+      2. Redistributions in binary form must reproduce the above copyright
+         notice, this list of conditions and the following disclaimer in the
+         documentation and/or other materials provided with the distribution.
+
+   THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS
+   "AS IS" AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT
+   LIMITED TO, THE IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR
+   A PARTICULAR PURPOSE ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT
+   HOLDER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL,
+   SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT
+   LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+   DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+   THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+   (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+   OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
+
+/* Stores a chain of decoder states that differ by a few macroblocks each,
+   with every state's parent being the one before it, and checks that they
+   all come back out of the store (opened afresh) as they went in.
+
+   usage: state-store-test DIRECTORY [STATES] */
+
+#include <cstdio>
+#include <cstdlib>
+#include <iostream>
+#include <random>
+#include <string>
+#include <vector>
+
+#include <ftw.h>
+
+#include "decoder.hh"
+#include "exception.hh"
+#include "state_store.hh"
+
+using namespace std;
+
+const uint16_t width = 176;
+const uint16_t height = 144;
+
+static size_t total_size = 0;
+
+static int add_size( const char *, const struct stat * info, int type, struct FTW * )
+{
+  if ( type == FTW_F ) {
+    total_size += info->st_size;
+  }
+  return 0;
+}
+
+int main( int argc, char *argv[] )
+{
+  try {
+    if ( argc < 2 ) {
+      cerr << "Usage: " << argv[ 0 ] << " DIRECTORY [STATES]" << endl;
+      return EXIT_FAILURE;
+    }
+
+    const string directory = argv[ 1 ];
+    const unsigned int state_count = ( argc > 2 ) ? abs( atoi( argv[ 2 ] ) ) : 40;
+
+    default_random_engine rng;
+    uniform_int_distribution<uint16_t> pixel( 0, 255 );
+    uniform_int_distribution<unsigned int> column( 0, width - 1 );
+    uniform_int_distribution<unsigned int> row( 0, height - 1 );
+
+    MutableRasterHandle first( width, height );
+    first.get().Y().forall( [&] ( uint8_t & p ) { p = pixel( rng ); } );
+    first.get().U().forall( [&] ( uint8_t & p ) { p = pixel( rng ); } );
+    first.get().V().forall( [&] ( uint8_t & p ) { p = pixel( rng ); } );
+
+    vector<Decoder> decoders { Decoder( DecoderState( width, height ), References( move( first ) ) ) };
+
+    while ( decoders.size() < state_count ) {
+      MutableRasterHandle next( width, height );
+      next.get().copy_from( decoders.back().get_references().last.get() );
+
+      for ( unsigned int i = 0; i < 5; i++ ) {
+        next.get().Y().at( column( rng ), row( rng ) ) = pixel( rng );
+      }
+
+      decoders.emplace_back( DecoderState( width, height ), References( move( next ) ) );
+    }
+
+    {
+      StateStore store( directory, EncoderStatePlanes::PACKED );
+      uint32_t parent = 0;
+
+      for ( const Decoder & decoder : decoders ) {
+        parent = store.put( decoder, parent );
+      }
+
+      /* storing them again changes nothing */
+      for ( const Decoder & decoder : decoders ) {
+        store.put( decoder );
+      }
+    }
+
+    StateStore store( directory );
+
+    if ( store.minihashes().size() != decoders.size() ) {
+      throw runtime_error( "wrong number of states in the store" );
+    }
+
+    /* latest first, so that every delta has to be followed back */
+    for ( auto decoder = decoders.rbegin(); decoder != decoders.rend(); decoder++ ) {
+      if ( store.get( decoder->minihash() ) != *decoder ) {
+        throw runtime_error( "state did not survive the store" );
+      }
+    }
+
+    SystemCall( "nftw", nftw( directory.c_str(), add_size, 16, FTW_PHYS ) );
+
+    /* an object under the wrong name, as a hash collision would leave it, is
+       caught both when storing and when loading */
+    const auto object_path =
+      [&] ( const Decoder & decoder )
+      {
+        char name[ 17 ];
+        snprintf( name, sizeof( name ), "%016llx",
+                  static_cast<unsigned long long>( decoder.get_references().last.hash() ) );
+        return directory + "/objects/" + name;
+      };
+
+    SystemCall( "rename", rename( object_path( decoders.front() ).c_str(),
+                                  object_path( decoders.back() ).c_str() ) );
+
+    for ( const bool storing : { true, false } ) {
+      bool caught = false;
+
+      try {
+        StateStore collided_store( directory );
+
+        if ( storing ) {
+          collided_store.put( decoders.back() );
+        }
+        else {
+          collided_store.get( decoders.back().minihash() );
+        }
+      } catch ( const runtime_error & ) {
+        caught = true;
+      }
+
+      if ( not caught ) {
+        throw runtime_error( "a mismatched object went unnoticed" );
+      }
+    }
+
+    const size_t raw_size = decoders.size() * ( width * height * 3 / 2 );
+    cout << decoders.size() << " states: " << total_size << " bytes in the store, "
+         << raw_size << " bytes of rasters" << endl;
+
+    if ( total_size * 4 > raw_size ) {
+      throw runtime_error( "the store did not save space" );
+    }
+  } catch ( const exception & e ) {
+    print_exception( argv[ 0 ], e );
+    return EXIT_FAILURE;
+  }
+
+  return EXIT_SUCCESS;
+}
@@ -27,6 +27,7 @@
    OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE. */
 
 #include <stdexcept>
+#include <fcntl.h>
 
 #include "ivf.hh"
 #include "file.hh"
@@ -34,8 +35,12 @@
 using namespace std;
 
 IVF::IVF( const string & filename )
+  : IVF( SystemCall( filename, open( filename.c_str(), O_RDONLY ) ) )
+{}
+
+IVF::IVF( FileDescriptor && fd )
 try :
-  file_( filename ),
+  file_( move( fd ) ),
     header_( file_( 0, supported_header_len ) ),
     fourcc_( header_( 8, 4 ).to_string() ),
     width_( header_( 12, 2 ).le16() ),
@@ -53,6 +53,7 @@ public:
   static constexpr int frame_header_len = 12;
 
   IVF( const std::string & filename );
+  IVF( FileDescriptor && fd );
 
   const std::string & fourcc( void ) const { return fourcc_; }
   uint16_t width( void ) const { return width_; }